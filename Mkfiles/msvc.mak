@@ -144,6 +144,7 @@ LIBOBJ_ASM = \
 	asm\floats.obj \
 	asm\directiv.obj \
 	asm\pragma.obj \
+	asm\batch.obj \
 	asm\assemble.obj asm\labels.obj asm\parser.obj \
 	asm\preproc.obj asm\quote.obj \
 	asm\listing.obj asm\eval.obj asm\exprlib.obj asm\exprdump.obj \
@@ -20,6 +20,7 @@
 #include "disp8.h"
 #include "listing.h"
 #include "dbginfo.h"
+#include "hashtbl.h"
 
 enum match_result {
     /*
@@ -95,6 +96,17 @@ static int process_ea(operand *input, int rfield, opflags_t rflags,
 /* Convert a prefix to a byte value */
 static int prefix_byte(enum prefixes pfx, const int bits);
 
+/* Instruction encoding cache */
+struct insn_cache_capture;
+static struct insn_cache_capture *insn_capture; /* Capturing gencode() output */
+static bool insn_cache_veto;    /* Match depended on the location */
+static void insn_cache_capture_out(const struct out_data *data);
+
+/* Branch relaxation */
+static bool relax_match(const insn *ins, const struct itemplate *temp,
+                        enum match_result *m);
+static void relax_record(const insn *ins, int64_t isize);
+
 /*
  * Convert operand/address/mode size to a BITS opflag constant.
  * This is not valid for 80+ bits!
@@ -464,6 +476,10 @@ static void out(struct out_data *data)
         zeropad = data->size - amax;
         data->size = amax;
     }
+
+    if (unlikely(insn_capture))
+        insn_cache_capture_out(data);
+
     lfmt->output(data);
 
     if (likely(data->loc.segment != NO_SEG)) {
@@ -715,6 +731,7 @@ static enum match_result
 jmp_match(const insn *ins, const struct itemplate *temp)
 {
     const struct operand * const op0 = get_operand_const(ins, 0);
+    enum match_result m;
     int64_t delta;
 
     if (op0->type & STRICT)
@@ -736,6 +753,12 @@ jmp_match(const insn *ins, const struct itemplate *temp)
         }
     }
 
+    /* The result depends on the location; do not cache it */
+    insn_cache_veto = true;
+
+    if (relax_match(ins, temp, &m))
+        return m;
+
     if (op0->opflags & OPFLAG_UNKNOWN) {
         /* Be optimistic in pass 1 */
         return MOK_GOOD;
@@ -775,6 +798,406 @@ jmp_match(const insn *ins, const struct itemplate *temp)
     return MOK_GOOD;
 }
 
+/*
+ * Branch relaxation.
+ *
+ * Left to itself, jump sizing converges one optimization pass at a
+ * time: when a jump grows from short to near, it can push the target
+ * of an earlier forward jump out of range, but that jump only sees the
+ * new target offset in the next pass.  A chain of such jumps takes a
+ * pass per jump.
+ *
+ * Instead, every jump which jmp_match() considers is recorded during
+ * the first two passes.  At the end of the first optimization pass the
+ * sizes of all of them are solved for together, and the solution is
+ * used as the decision of jmp_match() during the next pass.  The passes
+ * after that check it the normal way, so a solution which turns out to
+ * be wrong costs a pass or two, but never changes the output.
+ *
+ * Jumps are matched between passes by their sequence number.  The
+ * targets of forward references in the first optimization pass are
+ * offsets from the first pass; they are moved by the size changes of
+ * the jumps before them between the two passes.
+ */
+struct relax_jump {
+    int64_t offset;             /* Offset of the jump */
+    int64_t target;             /* Offset of the target */
+    int32_t segment;            /* Segment of the jump and the target */
+    uint8_t size;               /* Size in this pass */
+    uint8_t ssize, nsize;       /* Sizes of the short and near forms */
+    uint8_t flags;
+};
+#define RJ_RELAX        1       /* Can be short or near */
+#define RJ_STALE        2       /* Target offset is from the previous pass */
+#define RJ_NEAR         4       /* Solved: must be near */
+
+enum relax_mode {
+    RELAX_OFF,                  /* Not active */
+    RELAX_FIRST,                /* Recording the first pass */
+    RELAX_SECOND,               /* Recording the first optimization pass */
+    RELAX_APPLY                 /* Using the solution */
+};
+
+static struct {
+    enum relax_mode mode, next_mode;
+    struct relax_jump *prev, *cur; /* Previous and current pass */
+    size_t nprev, ncur, maxprev, maxcur;
+    size_t index;               /* Sequence number of the next jump */
+    const struct itemplate *short_temp; /* Last template in jmp_match() */
+    bool seen;                  /* jmp_match() saw this instruction */
+    bool force_near;            /* Find the near form of a jump */
+} relax;
+
+/*
+ * Called from jmp_match() for a jump which could be short.  Returns
+ * true with the match result in *m if the decision has been made here.
+ */
+static bool relax_match(const insn *ins, const struct itemplate *temp,
+                        enum match_result *m)
+{
+    const struct relax_jump *rj;
+
+    relax.seen = true;
+    relax.short_temp = temp;
+
+    if (unlikely(relax.force_near)) {
+        *m = MERR_INVALOP;
+        return true;
+    }
+
+    if (likely(relax.mode != RELAX_APPLY))
+        return false;
+
+    if (relax.index >= relax.ncur ||
+        relax.cur[relax.index].segment != ins->loc.segment) {
+        /* Out of step with the recorded pass, give up */
+        relax.mode = RELAX_OFF;
+        return false;
+    }
+
+    rj = &relax.cur[relax.index];
+    if (!(rj->flags & RJ_RELAX))
+        return false;
+
+    *m = (rj->flags & RJ_NEAR) ? MERR_INVALOP : MOK_GOOD;
+    return true;
+}
+
+/*
+ * Record a jump seen by jmp_match() and sized by insn_size().
+ */
+static void relax_record(const insn *ins, int64_t isize)
+{
+    const struct operand * const op0 = get_operand_const(ins, 0);
+    struct relax_jump *rj;
+    int64_t ssize, nsize;
+
+    if (relax.mode == RELAX_APPLY) {
+        relax.index++;
+        return;
+    }
+
+    if (relax.ncur >= relax.maxcur) {
+        relax.maxcur = relax.maxcur ? relax.maxcur << 1 : 1024;
+        relax.cur = nasm_realloc(relax.cur,
+                                 relax.maxcur * sizeof(*relax.cur));
+    }
+
+    rj = &relax.cur[relax.ncur++];
+    nasm_zero(*rj);
+    rj->offset  = ins->loc.offset;
+    rj->segment = ins->loc.segment;
+    rj->size    = isize;
+
+    /* The first pass only provides the offsets and sizes */
+    if (relax.mode == RELAX_FIRST)
+        return;
+
+    if ((op0->opflags & OPFLAG_UNKNOWN) || op0->segment != ins->loc.segment)
+        return;                 /* Cannot be short */
+
+    if (ins->itemp == relax.short_temp) {
+        insn tmpins = *ins;
+        enum match_result m;
+
+        relax.force_near = true;
+        m = find_match(&tmpins);
+        relax.force_near = false;
+        if (m < MOK_GOOD)
+            return;             /* No near form */
+
+        ssize = isize;
+        nsize = calcsize_speculative(&tmpins, tmpins.itemp);
+    } else {
+        ssize = calcsize_speculative(ins, relax.short_temp);
+        nsize = isize;
+    }
+
+    if (ssize <= 0 || nsize < ssize)
+        return;
+
+    rj->target = op0->offset;
+    rj->ssize  = ssize;
+    rj->nsize  = nsize;
+    rj->flags  = RJ_RELAX;
+    if (op0->opflags & OPFLAG_PREVPASS)
+        rj->flags |= RJ_STALE;
+}
+
+/*
+ * Sorted offsets of a set of jumps, with a Fenwick tree of the size
+ * changes of the jumps, so that the total size change of all jumps
+ * before any offset can be found quickly.
+ */
+struct relax_shift {
+    size_t n;
+    size_t *order;              /* Jump numbers by segment and offset */
+    int32_t *segment;           /* Sorted segments */
+    int64_t *offset;            /* Sorted offsets */
+    int64_t *tree;              /* Fenwick tree of size changes */
+};
+
+static const struct relax_jump *relax_sort_jumps;
+
+static int relax_cmp(const void *a, const void *b)
+{
+    const struct relax_jump *ja = &relax_sort_jumps[*(const size_t *)a];
+    const struct relax_jump *jb = &relax_sort_jumps[*(const size_t *)b];
+
+    if (ja->segment != jb->segment)
+        return ja->segment < jb->segment ? -1 : 1;
+    if (ja->offset != jb->offset)
+        return ja->offset < jb->offset ? -1 : 1;
+    return 0;
+}
+
+static void relax_shift_init(struct relax_shift *rs,
+                             const struct relax_jump *jumps, size_t n)
+{
+    size_t i;
+
+    rs->n = n;
+    nasm_newn(rs->order, n);
+    nasm_newn(rs->segment, n);
+    nasm_newn(rs->offset, n);
+    nasm_newn(rs->tree, n + 1);
+
+    for (i = 0; i < n; i++)
+        rs->order[i] = i;
+    relax_sort_jumps = jumps;
+    qsort(rs->order, n, sizeof(*rs->order), relax_cmp);
+
+    for (i = 0; i < n; i++) {
+        rs->segment[i] = jumps[rs->order[i]].segment;
+        rs->offset[i]  = jumps[rs->order[i]].offset;
+    }
+}
+
+static void relax_shift_free(struct relax_shift *rs)
+{
+    nasm_free(rs->order);
+    nasm_free(rs->segment);
+    nasm_free(rs->offset);
+    nasm_free(rs->tree);
+}
+
+/* Add delta to the size change of the jump at sorted position i */
+static void relax_shift_add(struct relax_shift *rs, size_t i, int64_t delta)
+{
+    for (i++; i <= rs->n; i += i & -i)
+        rs->tree[i] += delta;
+}
+
+/* Total size change of the jumps at sorted positions [0,i) */
+static int64_t relax_shift_sum(const struct relax_shift *rs, size_t i)
+{
+    int64_t sum = 0;
+
+    for (; i; i -= i & -i)
+        sum += rs->tree[i];
+    return sum;
+}
+
+/* First sorted position not before (segment, offset) */
+static size_t relax_shift_find(const struct relax_shift *rs,
+                               int32_t segment, int64_t offset)
+{
+    size_t lo = 0, hi = rs->n;
+
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        if (rs->segment[mid] < segment ||
+            (rs->segment[mid] == segment && rs->offset[mid] < offset))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Total size change of the jumps in segment before offset */
+static int64_t relax_shift(const struct relax_shift *rs,
+                           int32_t segment, int64_t offset)
+{
+    size_t start = relax_shift_find(rs, segment, INT64_MIN);
+    size_t end   = relax_shift_find(rs, segment, offset);
+
+    return relax_shift_sum(rs, end) - relax_shift_sum(rs, start);
+}
+
+/*
+ * Does the short form of the jump at sorted position i reach its
+ * target, with the current size changes?
+ */
+static bool relax_fits(const struct relax_shift *rs, size_t i,
+                       const struct relax_jump *rj)
+{
+    int64_t here = rj->offset + relax_shift_sum(rs, i);
+    int64_t there = rj->target +
+        relax_shift_sum(rs, relax_shift_find(rs, rj->segment, rj->target));
+    int64_t delta = there - here - rj->ssize;
+
+    return (int8_t)delta == delta;
+}
+
+#define RELAX_MAX_SWEEPS 64
+
+/*
+ * Solve for the sizes of the jumps recorded in the first optimization
+ * pass.  Returns true if the solution differs from that pass.
+ */
+static bool relax_solve(void)
+{
+    struct relax_jump * const jumps = relax.cur;
+    const size_t n = relax.ncur;
+    struct relax_shift rs;
+    bool changed, differs;
+    size_t i, k, sweep;
+
+    if (!n || n != relax.nprev)
+        return false;
+
+    for (i = 0; i < n; i++) {
+        if (jumps[i].segment != relax.prev[i].segment)
+            return false;       /* Not the same jumps */
+    }
+
+    /* Move stale targets to where they are in this pass */
+    relax_shift_init(&rs, relax.prev, n);
+    for (k = 0; k < n; k++) {
+        i = rs.order[k];
+        relax_shift_add(&rs, k, jumps[i].size - relax.prev[i].size);
+    }
+    for (i = 0; i < n; i++) {
+        struct relax_jump *rj = &jumps[i];
+        if ((rj->flags & (RJ_RELAX|RJ_STALE)) == (RJ_RELAX|RJ_STALE))
+            rj->target += relax_shift(&rs, rj->segment, rj->target);
+    }
+    relax_shift_free(&rs);
+
+    /*
+     * Start with every jump short, and make jumps near until all the
+     * short ones fit.  A jump never becomes short again, so this ends.
+     * Sweeping backwards first lets the growth of a jump be seen at
+     * once by the forward jumps over it.
+     */
+    relax_shift_init(&rs, jumps, n);
+    for (k = 0; k < n; k++) {
+        const struct relax_jump *rj = &jumps[rs.order[k]];
+        if (rj->flags & RJ_RELAX)
+            relax_shift_add(&rs, k, rj->ssize - rj->size);
+    }
+
+    sweep = 0;
+    do {
+        changed = false;
+        for (k = 0; k < n; k++) {
+            size_t pos = (sweep & 1) ? k : n - 1 - k;
+            struct relax_jump *rj = &jumps[rs.order[pos]];
+
+            if ((rj->flags & (RJ_RELAX|RJ_NEAR)) != RJ_RELAX)
+                continue;
+            if (relax_fits(&rs, pos, rj))
+                continue;
+
+            rj->flags |= RJ_NEAR;
+            relax_shift_add(&rs, pos, rj->nsize - rj->ssize);
+            changed = true;
+        }
+    } while (changed && ++sweep < RELAX_MAX_SWEEPS);
+
+    relax_shift_free(&rs);
+
+    differs = false;
+    for (i = 0; i < n; i++) {
+        const struct relax_jump *rj = &jumps[i];
+        if (rj->flags & RJ_RELAX) {
+            uint8_t size = (rj->flags & RJ_NEAR) ? rj->nsize : rj->ssize;
+            differs |= size != rj->size;
+        }
+    }
+
+    return differs;
+}
+
+/*
+ * Called at the beginning and end of each pass from assemble_file().
+ */
+void relax_pass_start(void)
+{
+    if (pass_first())
+        relax.next_mode = RELAX_FIRST;
+    else if (pass_type() != PASS_OPT)
+        relax.next_mode = RELAX_OFF;
+
+    relax.mode  = relax.next_mode;
+    relax.index = 0;
+    if (relax.mode != RELAX_APPLY)
+        relax.ncur = 0;
+}
+
+void relax_pass_end(void)
+{
+    struct relax_jump *tmp;
+    size_t tmpmax;
+
+    switch (relax.mode) {
+    case RELAX_FIRST:
+        /* Keep this pass as the previous one */
+        tmp = relax.prev;
+        tmpmax = relax.maxprev;
+        relax.prev    = relax.cur;
+        relax.nprev   = relax.ncur;
+        relax.maxprev = relax.maxcur;
+        relax.cur     = tmp;
+        relax.maxcur  = tmpmax;
+        relax.ncur    = 0;
+        relax.next_mode = RELAX_SECOND;
+        return;
+
+    case RELAX_SECOND:
+        if (global_offset_changed && relax_solve()) {
+            relax.next_mode = RELAX_APPLY;
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    relax.next_mode = RELAX_OFF;
+    relax_free();
+}
+
+void relax_free(void)
+{
+    nasm_free(relax.prev);
+    nasm_free(relax.cur);
+    relax.prev = relax.cur = NULL;
+    relax.nprev = relax.ncur = relax.maxprev = relax.maxcur = 0;
+}
+
 static inline int64_t merge_resb(insn *ins, int64_t isize)
 {
     int nbytes = resb_bytes(ins->opcode);
@@ -884,6 +1307,236 @@ list_add_template_info(const insn *ins)
     nasm_free(buf);
 }
 
+/*
+ * Instruction encoding cache.
+ *
+ * Generated code (%rep bodies, unrolled loops, TIMES) tends to
+ * contain the same instruction many times over. For instructions
+ * whose encoding only depends on the instruction itself -- register
+ * and absolute immediate operands, not location-relative -- remember
+ * the matched template, the size and, once the final pass has
+ * generated it, the encoded bytes, so that repeated instances skip
+ * find_match(), calcsize() and gencode() entirely.
+ *
+ * An instruction is only entered into the cache if it did not raise
+ * any diagnostics, and the cache is flushed whenever anything else
+ * the encoding depends on changes: CPU level, optimization flags,
+ * default BND, and the warning state.
+ */
+#define INSN_CACHE_MAX_BYTES    16
+#define INSN_CACHE_MAX_ENTRIES  65536
+
+struct insn_cache_opkey {
+    opflags_t       type;
+    opflags_t       xsize;
+    int64_t         offset;
+    enum reg_enum   basereg;
+    int             eaflags;
+    int             opflags;
+    int             iflag;
+    decoflags_t     decoflags;
+    bool            bcast;
+    uint8_t         disp_size;
+};
+
+struct insn_cache_key {
+    enum opcode         opcode;
+    int                 prefixes[MAXPREFIX];
+    int                 evex_rm;
+    enum optimization   opt;
+    uint8_t             bits;
+    uint8_t             operands;
+    int8_t              brerop; /* Operand index of evex_brerop, or -1 */
+    struct insn_cache_opkey oprs[MAX_OPERANDS]; /* Must be last */
+};
+
+struct insn_cache_chunk {
+    uint8_t size;
+    uint8_t flags;              /* enum out_flags */
+};
+
+struct insn_cache_entry {
+    const struct itemplate *itemp;
+    int                 itempindex;
+    int64_t             size;   /* Result of calcsize() */
+    unsigned int        nchunks; /* Output chunks, 0 = not yet generated */
+    struct insn_cache_chunk chunks[INSN_CACHE_MAX_BYTES];
+    uint8_t             bytes[INSN_CACHE_MAX_BYTES];
+    struct insn_cache_key key;
+};
+
+/* Output of gencode() being captured for the cache */
+struct insn_cache_capture {
+    bool                bad;    /* Something other than plain bytes */
+    unsigned int        nchunks;
+    size_t              len;
+    struct insn_cache_chunk chunks[INSN_CACHE_MAX_BYTES];
+    uint8_t             bytes[INSN_CACHE_MAX_BYTES];
+};
+
+/* Everything outside the instruction the encoding depends on */
+struct insn_cache_context {
+    iflag_t             cpu;
+    enum optimization   optimizing;
+    bool                bnd;
+    uint8_t             warnings[NUM_WARNINGS];
+};
+
+struct insn_cache_stats insn_cache_stats;
+static struct hash_table insn_cache;
+static struct insn_cache_context insn_cache_ctx;
+
+void insn_cache_free(void)
+{
+    hash_free_all(&insn_cache, false);
+}
+
+/*
+ * Build the cache key for an instruction. Returns the key length, or
+ * zero if this instruction cannot be cached.
+ */
+static size_t insn_cache_key(const insn *ins, struct insn_cache_key *key)
+{
+    int i;
+
+    if (ins->eops || resb_bytes(ins->opcode))
+        return 0;
+
+    nasm_zero(*key);
+
+    for (i = 0; i < ins->operands; i++) {
+        const struct operand *op = &ins->oprs[i];
+        struct insn_cache_opkey *ok = &key->oprs[i];
+
+        if (is_class(MEMORY, op->type) || !absolute_op(op) ||
+            (op->opflags & (OPFLAG_FORWARD|OPFLAG_EXTERN|OPFLAG_UNKNOWN)))
+            return 0;
+
+        ok->type      = op->type;
+        ok->xsize     = op->xsize;
+        ok->offset    = op->offset;
+        ok->basereg   = op->basereg;
+        ok->eaflags   = op->eaflags;
+        ok->opflags   = op->opflags & ~OPFLAG_PREVPASS;
+        ok->iflag     = op->iflag;
+        ok->decoflags = op->decoflags;
+        ok->bcast     = op->bcast;
+        ok->disp_size = op->disp_size;
+    }
+
+    key->opcode   = ins->opcode;
+    memcpy(key->prefixes, ins->prefixes, sizeof key->prefixes);
+    key->evex_rm  = ins->evex_rm;
+    key->opt      = ins->opt;
+    key->bits     = ins->bits;
+    key->operands = ins->operands;
+    key->brerop   = ins->evex_brerop ? ins->evex_brerop->opidx : -1;
+
+    return offsetof(struct insn_cache_key, oprs) +
+        ins->operands * sizeof(struct insn_cache_opkey);
+}
+
+/* Flush the cache if the encoding context has changed */
+static void insn_cache_check_context(void)
+{
+    if (likely(!memcmp(&insn_cache_ctx.cpu, &cpu, sizeof cpu) &&
+               insn_cache_ctx.optimizing == optimizing &&
+               insn_cache_ctx.bnd == globl.bnd &&
+               !memcmp(insn_cache_ctx.warnings, warning_state,
+                       sizeof warning_state)))
+        return;
+
+    insn_cache_free();
+    insn_cache_ctx.cpu        = cpu;
+    insn_cache_ctx.optimizing = optimizing;
+    insn_cache_ctx.bnd        = globl.bnd;
+    memcpy(insn_cache_ctx.warnings, warning_state, sizeof warning_state);
+}
+
+/*
+ * Look up an instruction in the cache. *keylen is set to zero if the
+ * instruction is not cacheable at all.
+ */
+static struct insn_cache_entry *
+insn_cache_lookup(const insn *ins, struct insn_cache_key *key, size_t *keylen)
+{
+    void **dp;
+
+    *keylen = insn_cache_key(ins, key);
+    if (!*keylen)
+        return NULL;
+
+    insn_cache_check_context();
+    dp = hash_findb(&insn_cache, key, *keylen, NULL);
+    return dp ? *dp : NULL;
+}
+
+/* Enter a freshly matched instruction into the cache */
+static struct insn_cache_entry *
+insn_cache_insert(const struct insn_cache_key *key, size_t keylen,
+                  const insn *ins, int64_t size)
+{
+    struct insn_cache_entry *ce;
+    struct hash_insert hi;
+
+    if (insn_cache.load >= INSN_CACHE_MAX_ENTRIES)
+        insn_cache_free();
+
+    hash_findb(&insn_cache, key, keylen, &hi);
+
+    nasm_new(ce);
+    ce->itemp      = ins->itemp;
+    ce->itempindex = ins->itempindex;
+    ce->size       = size;
+    memcpy(&ce->key, key, keylen);
+    hash_add(&hi, &ce->key, ce);
+
+    return ce;
+}
+
+/* Record the output of gencode(), called from out() */
+static void insn_cache_capture_out(const struct out_data *data)
+{
+    struct insn_cache_capture *cap = insn_capture;
+    struct insn_cache_chunk *chunk;
+
+    if (data->type != OUT_RAWDATA ||
+        cap->nchunks >= INSN_CACHE_MAX_BYTES ||
+        data->size > INSN_CACHE_MAX_BYTES - cap->len) {
+        cap->bad = true;
+        return;
+    }
+
+    chunk = &cap->chunks[cap->nchunks++];
+    chunk->size  = data->size;
+    chunk->flags = data->flags;
+    memcpy(cap->bytes + cap->len, data->data, data->size);
+    cap->len += data->size;
+}
+
+/* Emit an instruction from the cache */
+static void insn_cache_replay(struct out_data *data, insn *ins,
+                              const struct insn_cache_entry *ce)
+{
+    const uint8_t *p = ce->bytes;
+    unsigned int i;
+
+    ins->itemp      = ce->itemp;
+    ins->itempindex = ce->itempindex;
+    if (list_option('X'))
+        list_add_template_info(ins);
+
+    data->itemp   = ce->itemp;
+    data->inslen  = ce->size;
+    data->insoffs = 0;
+
+    for (i = 0; i < ce->nchunks; i++) {
+        data->flags = ce->chunks[i].flags;
+        out_rawdata(data, p, ce->chunks[i].size);
+        p += ce->chunks[i].size;
+    }
+}
+
 static int64_t assemble(insn *instruction)
 {
     struct out_data data;
@@ -906,7 +1559,7 @@ static int64_t assemble(insn *instruction)
         bool need_downlevel_times;
         off_t base = 0;
         off_t len;
-        const void *map = NULL;
+        struct nasm_mapping *map = NULL;
         char *buf = NULL;
         size_t blk = 0;         /* Buffered I/O block size */
         size_t m = 0;           /* Bytes last read */
@@ -946,8 +1599,11 @@ static int64_t assemble(insn *instruction)
         if (!len)
             goto end_incbin;
 
-        /* Try to map file data */
-        map = nasm_map_file(fp, base, len);
+        /*
+         * Try to map file data; the backend can hold on to the mapping
+         * rather than copy the data.
+         */
+        map = nasm_map_file_ref(fp, base, len);
         if (!map) {
             blk = len < (off_t)INCBIN_MAX_BUF ? (size_t)len : INCBIN_MAX_BUF;
             buf = nasm_malloc(blk);
@@ -969,7 +1625,9 @@ static int64_t assemble(insn *instruction)
             lfmt->uplevel(LIST_INCBIN, len);
 
             if (map) {
-                out_rawdata(&data, map, len);
+                data.map = map;
+                out_rawdata(&data, map->data, len);
+                data.map = NULL;
             } else if ((off_t)m == len) {
                 out_rawdata(&data, buf, len);
             } else {
@@ -1018,19 +1676,41 @@ static int64_t assemble(insn *instruction)
     close_done:
         if (buf)
             nasm_free(buf);
-        if (map)
-            nasm_unmap_file(map, len);
+        nasm_mapping_put(map);
         fclose(fp);
     done:
         instruction->times = 1; /* Tell the upper layer not to iterate */
         ;
     } else {
         /* "Real" instruction */
+        struct insn_cache_key key;
+        struct insn_cache_entry *ce;
+        struct insn_cache_capture cap;
+        size_t keylen;
+        uint64_t diags;
+
+        ce = insn_cache_lookup(instruction, &key, &keylen);
+        if (ce && ce->nchunks) {
+            insn_cache_stats.hits++;
+            insn_cache_replay(&data, instruction, ce);
+            return data.loc.offset - start;
+        }
+
+        insn_cache_stats.misses++;
+        diags = erropt.diagnostics;
+        insn_cache_veto = false;
 
         /* Pre-match instruction structure update */
         insn_early_setup(instruction);
 
-        m = find_match(instruction);
+        if (ce) {
+            /* Matched in an earlier pass, but not yet generated */
+            instruction->itemp      = ce->itemp;
+            instruction->itempindex = ce->itempindex;
+            m = MOK_GOOD;
+        } else {
+            m = find_match(instruction);
+        }
 
         if (m >= MOK_GOOD) {
             const struct itemplate * const temp = instruction->itemp;
@@ -1079,13 +1759,28 @@ static int64_t assemble(insn *instruction)
             data.inslen = merge_resb(instruction, data.inslen);
 
             data.insoffs = 0;
+            if (keylen) {
+                nasm_zero(cap);
+                insn_capture = &cap;
+            }
             gencode(&data, instruction);
+            insn_capture = NULL;
             if (unlikely(data.insoffs != data.inslen)) {
                 nasm_nonfatal("instruction length changed during code generation (%u -> %u)",
                            (unsigned int)data.insoffs, (unsigned int)data.inslen);
             }
 
             nasm_assert(data.loc.offset - start == data.inslen);
+
+            if (keylen && !cap.bad && !insn_cache_veto &&
+                erropt.diagnostics == diags) {
+                if (!ce)
+                    ce = insn_cache_insert(&key, keylen, instruction,
+                                           data.inslen);
+                ce->nchunks = cap.nchunks;
+                memcpy(ce->chunks, cap.chunks, sizeof cap.chunks);
+                memcpy(ce->bytes, cap.bytes, sizeof cap.bytes);
+            }
         } else {
             no_match_error(m, instruction);
             instruction->times = 1; /* Avoid repeated error messages */
@@ -1299,10 +1994,28 @@ static int64_t insn_size(insn *instruction)
         return len;
     } else {
         /* Normal instruction, or RESx */
+        struct insn_cache_key key;
+        struct insn_cache_entry *ce;
+        size_t keylen;
+        uint64_t diags;
+
+        ce = insn_cache_lookup(instruction, &key, &keylen);
+        if (ce) {
+            insn_cache_stats.hits++;
+            instruction->itemp      = ce->itemp;
+            instruction->itempindex = ce->itempindex;
+            debug_set_type(instruction);
+            return ce->size;
+        }
+
+        insn_cache_stats.misses++;
+        diags = erropt.diagnostics;
+        insn_cache_veto = false;
 
         /* Pre-matching setup */
         insn_early_setup(instruction);
 
+        relax.seen = false;
         m = find_match(instruction);
         if (m < MOK_GOOD) {
             no_match_error(m, instruction);
@@ -1310,9 +2023,15 @@ static int64_t insn_size(insn *instruction)
         }
 
         isize = calcsize(instruction);
+        if (relax.seen && relax.mode != RELAX_OFF)
+            relax_record(instruction, isize);
         debug_set_type(instruction);
         isize = merge_resb(instruction, isize);
 
+        if (keylen && isize > 0 && !insn_cache_veto &&
+            erropt.diagnostics == diags)
+            insn_cache_insert(&key, keylen, instruction, isize);
+
         return isize;
     }
 }
@@ -2929,15 +3648,35 @@ static uint32_t op_evexflags(const operand * o, uint32_t mask)
     return evexflags(o->decoflags, mask);
 }
 
+/*
+ * The operand type bits a template operand can require, which the
+ * instruction operand must also have; this is a necessary condition
+ * for matches() to accept the template.
+ */
+#define OPCLASS_MASK (OPTYPE_MASK | REG_CLASS_MASK)
+
+static inline bool opclass_match(const struct itemplate *itemp,
+                                 const insn *ins)
+{
+    int i;
+
+    for (i = 0; i < ins->operands; i++) {
+        if (itemp->opd[i] & ~ins->oprs[i].type & OPCLASS_MASK)
+            return false;
+    }
+    return true;
+}
+
 static enum match_result find_match(insn *instruction)
 {
     const int bits = instruction->bits;
     const struct itemplate_list *templist;
     const struct itemplate *temp;
     const struct itemplate *best;
+    const uint16_t *byops;
     enum match_result m, merr;
     int rex = instruction->prefixes[PPS_REX];
-    int n, i, besti;
+    int n, i, j, besti;
 
     instruction->itemp = best = NULL;
     instruction->itempindex = besti = -1;
@@ -2951,19 +3690,53 @@ static enum match_result find_match(insn *instruction)
     merr = MERR_INVALOP;
 
     templist = &nasm_instructions[instruction->opcode];
-    n    = templist->ntemp;
-    temp = templist->temp;
+    byops    = templist->byops;
 
-    for (i = 0; i < n; i++) {
-        m = matches(temp, instruction);
-        if (m > merr) {
-            best = temp;
-            besti = i;
-            merr = m;
-            if (merr == MOK_GOOD)
-                break;
+    /*
+     * First only try the templates which can possibly match: the
+     * ones with the right number of operands and compatible operand
+     * classes. Any other template would make matches() return an
+     * error, so this finds the same template as trying all of them.
+     */
+    if (byops) {
+        const int oprs = instruction->operands;
+
+        for (j = byops[oprs]; j < byops[oprs+1]; j++) {
+            i = byops[j];
+            temp = &templist->temp[i];
+            if (!opclass_match(temp, instruction))
+                continue;
+
+            m = matches(temp, instruction);
+            if (m > merr) {
+                best = temp;
+                besti = i;
+                merr = m;
+                if (merr == MOK_GOOD)
+                    break;
+            }
+        }
+    }
+
+    /*
+     * No match: run through all the templates to find the most
+     * specific error message.
+     */
+    if (merr < MOK_FIRST) {
+        n    = templist->ntemp;
+        temp = templist->temp;
+
+        for (i = 0; i < n; i++) {
+            m = matches(temp, instruction);
+            if (m > merr) {
+                best = temp;
+                besti = i;
+                merr = m;
+                if (merr == MOK_GOOD)
+                    break;
+            }
+            temp++;
         }
-        temp++;
     }
 
     if (merr >= MOK_FIRST) {
@@ -21,8 +21,22 @@ extern struct location absolute;
 int64_t increment_offset(int64_t delta);
 void process_insn(insn *instruction);
 
+/* Instruction encoding cache statistics */
+struct insn_cache_stats {
+    uint64_t hits;              /* Instructions replayed from the cache */
+    uint64_t misses;            /* Instructions matched and encoded */
+};
+extern struct insn_cache_stats insn_cache_stats;
+void insn_cache_free(void);
+
+/* Branch relaxation, called around each pass */
+void relax_pass_start(void);
+void relax_pass_end(void);
+void relax_free(void);
+
 bool directive_valid(const char *);
 bool process_directives(char *);
+void section_cache_free(void);
 void process_pragma(char *);
 
 /* Is this a compile-time absolute constant? */
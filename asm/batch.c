@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/* Copyright 2025 The NASM Authors - All Rights Reserved */
+
+/*
+ * batch.c   batch mode driver
+ *
+ * "--batch listfile" assembles each line of listfile as an
+ * independent job, running up to "-j N" jobs at the same time.
+ * The assembler keeps far too much global state to run several jobs
+ * in one address space, so each job runs in a forked copy of this
+ * process; this still saves starting a new program for every file.
+ *
+ * This is kept apart from the rest of the assembler, as <sys/wait.h>
+ * may define names which clash with the assembler's own.
+ */
+
+#include "compiler.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
+#include "nasmlib.h"
+#include "nctype.h"
+#include "error.h"
+#include "batch.h"
+
+#define ARG_BUF_DELTA 128
+
+/*
+ * Find and remove the batch mode options from the command line.
+ * Returns the name of the batch file, or NULL if not in batch mode.
+ */
+const char *batch_options(int *argcp, char **argv, int *njobs)
+{
+    const char *listfile = NULL;
+    const char *jobs = NULL;
+    const char *jobsopt = NULL;
+    int argc = *argcp;
+    char **nargv;
+    int i, j;
+
+    /* Don't touch the command line unless this is a batch */
+    nargv = nasm_malloc((argc + 1) * sizeof(char *));
+
+    for (i = j = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char **optp = NULL;
+
+        if (!strcmp(arg, "--batch")) {
+            optp = &listfile;
+        } else if (!strncmp(arg, "--batch=", 8)) {
+            listfile = arg + 8;
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) {
+            optp = &jobs;
+            jobsopt = arg;
+        } else if (!strncmp(arg, "--jobs=", 7)) {
+            jobs = arg + 7;
+            jobsopt = "--jobs";
+        } else if (arg[0] == '-' && arg[1] == 'j') {
+            jobs = arg + 2;
+            jobsopt = "-j";
+        } else {
+            nargv[j++] = argv[i];
+            continue;
+        }
+
+        if (optp) {
+            if (++i >= argc)
+                nasm_fatalf(ERR_USAGE, "option `%s' requires an argument",
+                            arg);
+            *optp = argv[i];
+        }
+    }
+
+    if (!listfile) {
+        nasm_free(nargv);
+        if (jobsopt)
+            nasm_fatalf(ERR_USAGE, "option `%s' is only valid with `--batch'",
+                        jobsopt);
+        return NULL;
+    }
+
+    *njobs = 1;
+    if (jobs) {
+        char *ep;
+        long n = strtol(jobs, &ep, 10);
+        if (*ep || n < 1 || n > INT_MAX)
+            nasm_fatalf(ERR_USAGE, "invalid number of jobs `%s'", jobs);
+        *njobs = n;
+    }
+
+    memcpy(argv + 1, nargv + 1, (j - 1) * sizeof(char *));
+    argv[j] = NULL;
+    *argcp = j;
+    nasm_free(nargv);
+    return listfile;
+}
+
+/* Read one line of the batch file, returning NULL at end of file */
+static char *batch_getline(FILE *f)
+{
+    size_t size = ARG_BUF_DELTA;
+    size_t len = 0;
+    char *buf = nasm_malloc(size);
+
+    while (fgets(buf + len, size - len, f)) {
+        len += strlen(buf + len);
+        if (len && buf[len-1] == '\n')
+            return buf;
+        if (len < size - 1)
+            break;              /* End of file without a newline */
+        size += ARG_BUF_DELTA;
+        buf = nasm_realloc(buf, size);
+    }
+
+    if (len)
+        return buf;
+
+    nasm_free(buf);
+    return NULL;
+}
+
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+
+/* Wait for one job to finish, and return true if it failed */
+static bool batch_wait(void)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, 0)) < 0 && errno == EINTR)
+        ;
+    if (pid < 0)
+        nasm_fatalf(ERR_PERROR, "unable to wait for batch job");
+
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int run_batch(int argc, char **argv, const char *listfile, int njobs,
+              batch_job_func job)
+{
+    FILE *lf;
+    char *line;
+    char **jargv;
+    int running = 0;
+    bool failed = false;
+
+    nasm_ctype_init();          /* For nasm_isspace() */
+
+    lf = nasm_open_read(listfile, NF_TEXT);
+    if (!lf)
+        nasm_fatalf(ERR_PERROR, "unable to open batch file `%s'", listfile);
+
+    while ((line = batch_getline(lf))) {
+        char *p, *q;
+        int jargc;
+        pid_t pid;
+
+        line[strcspn(line, "\r\n\032")] = '\0';
+        p = nasm_skip_spaces(line);
+        if (!*p || *p == ';' || *p == '#') {
+            nasm_free(line);
+            continue;           /* Blank line or comment */
+        }
+
+        /* Common arguments, then the whitespace-separated job arguments */
+        jargv = nasm_malloc((argc + strlen(p) / 2 + 2) * sizeof(char *));
+        memcpy(jargv, argv, argc * sizeof(char *));
+        jargc = argc;
+        while ((q = nasm_get_word(p, &p)))
+            jargv[jargc++] = q;
+        jargv[jargc] = NULL;
+
+        while (running >= njobs) {
+            failed |= batch_wait();
+            running--;
+        }
+
+        fflush(NULL);           /* Don't let the child repeat our output */
+        pid = fork();
+        if (pid < 0)
+            nasm_fatalf(ERR_PERROR, "unable to start batch job");
+
+        if (!pid) {
+            fclose(lf);
+            exit(job(jargc, jargv, argc - 1));
+        }
+
+        running++;
+        nasm_free(jargv);
+        nasm_free(line);
+    }
+
+    fclose(lf);
+
+    while (running--)
+        failed |= batch_wait();
+
+    return failed;
+}
+
+#else
+
+int run_batch(int argc, char **argv, const char *listfile, int njobs,
+              batch_job_func job)
+{
+    (void)argc;
+    (void)argv;
+    (void)listfile;
+    (void)njobs;
+    (void)job;
+
+    nasm_fatalf(ERR_USAGE, "batch mode is not supported on this platform");
+}
+
+#endif
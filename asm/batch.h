@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/* Copyright 2025 The NASM Authors - All Rights Reserved */
+
+/*
+ * batch.h   batch mode driver
+ */
+
+#ifndef NASM_BATCH_H
+#define NASM_BATCH_H
+
+#include "compiler.h"
+
+/*
+ * Run one job: the first ncommon arguments after argv[0] are common
+ * to all jobs in the batch.  Returns the exit status of the job.
+ */
+typedef int (*batch_job_func)(int argc, char **argv, int ncommon);
+
+const char *batch_options(int *argcp, char **argv, int *njobs);
+int run_batch(int argc, char **argv, const char *listfile, int njobs,
+              batch_job_func job);
+
+#endif /* NASM_BATCH_H */
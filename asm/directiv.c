@@ -23,6 +23,76 @@
 #include "labels.h"
 #include "iflag.h"
 #include "quote.h"
+#include "hashtbl.h"
+
+/*
+ * Cache of [SECTION] directives already handed to the backend during
+ * this pass, for backends which promise that repeating an identical
+ * section() call has no further effect (OFMT_SECTION_CACHE). Code which
+ * switches back and forth between a few sections then only pays for a
+ * hash lookup.
+ */
+struct section_cache_entry {
+    int32_t seg;
+    int     bits_in;
+    int     bits_out;
+    char    name[1];            /* Directive argument, as passed */
+};
+
+static struct hash_table section_cache;
+
+void section_cache_free(void)
+{
+    hash_free_all(&section_cache, false);
+}
+
+static int32_t cached_section(const char *value, int *bits)
+{
+    struct section_cache_entry *sce;
+    struct hash_insert hi;
+    void **sp;
+    size_t len;
+    int32_t seg;
+    int bits_in = *bits;
+    uint64_t diags;
+
+    if (!(ofmt->flags & OFMT_SECTION_CACHE))
+        return ofmt->section((char *)value, bits);
+
+    sp = hash_find(&section_cache, value, &hi);
+    if (sp) {
+        sce = *sp;
+        if (sce->bits_in == bits_in) {
+            *bits = sce->bits_out;
+            return sce->seg;
+        }
+    }
+
+    /* The backend modifies its argument, so keep a copy for the key */
+    len = strlen(value);
+    sce = nasm_malloc(sizeof(*sce) + len);
+    memcpy(sce->name, value, len + 1);
+
+    diags = erropt.diagnostics;
+    seg = ofmt->section((char *)value, bits);
+
+    if (seg == NO_SEG || erropt.diagnostics != diags) {
+        /* Anything noteworthy must be said again next time */
+        nasm_free(sce);
+    } else {
+        sce->seg      = seg;
+        sce->bits_in  = bits_in;
+        sce->bits_out = *bits;
+        if (sp) {
+            nasm_free(*sp);
+            *sp = sce;
+        } else {
+            hash_add(&hi, sce->name, sce);
+        }
+    }
+
+    return seg;
+}
 
 struct cpunames {
     const char *name;
@@ -291,6 +361,7 @@ bool process_directives(char *directive)
     default:
         if (d > D_ofmt && d < D_pragma_tokens) {
             /* It's a backend-specific directive */
+            section_cache_free();
             switch (ofmt->directive(d, value)) {
             case DIRR_UNKNOWN:
                 goto unknown;
@@ -321,7 +392,7 @@ bool process_directives(char *directive)
     case D_SECTION:
     {
 	int sb = globl.bits;
-        int32_t seg = ofmt->section(value, &sb);
+        int32_t seg = cached_section(value, &sb);
 
         if (seg == NO_SEG) {
             nasm_nonfatal("segment name `%s' not recognized", value);
@@ -521,6 +592,11 @@ bool process_directives(char *directive)
     }
 
     case D_WARNING:         /* [WARNING {push|pop|{+|-|*}warn-name}] */
+        /*
+         * A cached section directive may have been silenced by the
+         * old warning state; it must not be silent under the new one.
+         */
+        section_cache_free();
         value = nasm_skip_spaces(value);
         if ((*value | 0x20) == 'p') {
             if (!nasm_stricmp(value, "push"))
@@ -567,6 +567,8 @@ void nasm_verror(errflags severity, const char *fmt, va_list args)
         abort();
     }
 
+    erropt.diagnostics++;
+
     if (is_suppressed(severity))
         return;
 
@@ -18,19 +18,28 @@
 #include "floats.h"
 #include "assemble.h"
 
-#define TEMPEXPRS_DELTA 128
-#define TEMPEXPR_DELTA 8
+#define EVAL_ARENA_SIZE 4096    /* expr entries per arena chunk */
 
 static scanner scanfunc;        /* Address of scanner routine */
 static void *scpriv;            /* Scanner private pointer */
 
-static expr **tempexprs = NULL;
-static int ntempexprs;
-static int tempexprs_size = 0;
+/*
+ * All the vectors built while evaluating an expression are bump
+ * allocated from a chain of chunks, which is rewound at the start of
+ * the next evaluate() call. The chunks themselves are kept around, so
+ * in steady state the evaluator does not touch the heap at all.
+ */
+struct eval_chunk {
+    struct eval_chunk *next;
+    size_t size;
+    expr e[1];
+};
+
+static struct eval_chunk *arena_head, *arena_cur;
+static size_t arena_used;       /* Entries in use in arena_cur */
 
 static expr *tempexpr;
-static int ntempexpr;
-static int tempexpr_size;
+static size_t ntempexpr;
 
 static struct tokenval *tokval; /* The current token */
 static int tt;                   /* The t_type of tokval */
@@ -48,9 +57,51 @@ static int64_t deadman;
  */
 void eval_cleanup(void)
 {
-    while (ntempexprs)
-        nasm_free(tempexprs[--ntempexprs]);
-    nasm_free(tempexprs);
+    struct eval_chunk *c, *next;
+
+    for (c = arena_head; c; c = next) {
+        next = c->next;
+        nasm_free(c);
+    }
+    arena_head = arena_cur = NULL;
+    arena_used = 0;
+}
+
+static void arena_reset(void)
+{
+    arena_cur = arena_head;
+    arena_used = 0;
+}
+
+/*
+ * The vector under construction does not fit in the current chunk;
+ * move it to the next one, allocating that if needed.
+ */
+static void arena_next_chunk(void)
+{
+    struct eval_chunk *c = arena_cur ? arena_cur->next : arena_head;
+
+    if (!c || c->size <= ntempexpr) {
+        size_t size = ntempexpr < EVAL_ARENA_SIZE/2 ?
+            EVAL_ARENA_SIZE : ntempexpr << 1;
+
+        c = nasm_malloc(sizeof(*c) + (size - 1) * sizeof(expr));
+        c->size = size;
+        if (arena_cur) {
+            c->next = arena_cur->next;
+            arena_cur->next = c;
+        } else {
+            c->next = arena_head;
+            arena_head = c;
+        }
+    }
+
+    if (ntempexpr)
+        memcpy(c->e, tempexpr, ntempexpr * sizeof(expr));
+
+    arena_cur = c;
+    arena_used = 0;
+    tempexpr = c->e;
 }
 
 /*
@@ -58,17 +109,15 @@ void eval_cleanup(void)
  */
 static void begintemp(void)
 {
-    tempexpr = NULL;
-    tempexpr_size = ntempexpr = 0;
+    ntempexpr = 0;
+    tempexpr = arena_cur ? arena_cur->e + arena_used : NULL;
 }
 
 static void addtotemp(int32_t type, int64_t value)
 {
-    while (ntempexpr >= tempexpr_size) {
-        tempexpr_size += TEMPEXPR_DELTA;
-        tempexpr = nasm_realloc(tempexpr,
-                                tempexpr_size * sizeof(*tempexpr));
-    }
+    if (unlikely(!arena_cur || arena_used + ntempexpr >= arena_cur->size))
+        arena_next_chunk();
+
     tempexpr[ntempexpr].type = type;
     tempexpr[ntempexpr++].value = value;
 }
@@ -76,12 +125,8 @@ static void addtotemp(int32_t type, int64_t value)
 static expr *finishtemp(void)
 {
     addtotemp(0L, 0L);          /* terminate */
-    while (ntempexprs >= tempexprs_size) {
-        tempexprs_size += TEMPEXPRS_DELTA;
-        tempexprs = nasm_realloc(tempexprs,
-                                 tempexprs_size * sizeof(*tempexprs));
-    }
-    return tempexprs[ntempexprs++] = tempexpr;
+    arena_used += ntempexpr;
+    return tempexpr;
 }
 
 /*
@@ -162,6 +207,16 @@ static expr *scalar_mult(expr * vect, int64_t scalar, int affect_hints)
     return vect;
 }
 
+/*
+ * Is this a plain integer, exactly as scalarvect() would build it?
+ * Operations on two of those are folded into the left operand's
+ * vector without classifying either side or building a new vector.
+ */
+static inline bool is_scalar(const expr *e)
+{
+    return e->type == EXPR_SIMPLE && !e[1].type;
+}
+
 static expr *scalarvect(int64_t scalar)
 {
     begintemp();
@@ -318,6 +373,10 @@ static expr *rexp0(void)
         f = rexp1();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value = e->value || f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`|' operator may only be applied to"
@@ -345,6 +404,10 @@ static expr *rexp1(void)
         f = rexp2();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value = !e->value ^ !f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`^' operator may only be applied to"
@@ -371,6 +434,10 @@ static expr *rexp2(void)
         f = rexp3();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value = e->value && f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`&' operator may only be applied to"
@@ -388,6 +455,7 @@ static expr *rexp3(void)
 {
     expr *e, *f;
     int64_t v;
+    bool unknown;
 
     e = expr0();
     if (!e)
@@ -402,13 +470,48 @@ static expr *rexp3(void)
         if (!f)
             return NULL;
 
+        if (is_scalar(e) && is_scalar(f)) {
+            int64_t vv = (uint64_t)e->value - (uint64_t)f->value;
+
+            if (vv && hint)
+                hint->type = EAH_SUMMED; /* As add_vectors() does */
+
+            switch (tto) {
+            case TOKEN_EQ:
+                v = !vv;
+                break;
+            case TOKEN_NE:
+                v = !!vv;
+                break;
+            case TOKEN_LEG:
+                v = (vv < 0) ? -1 : (vv > 0) ? 1 : 0;
+                break;
+            case TOKEN_LT:
+                v = vv < 0;
+                break;
+            case TOKEN_LE:
+                v = vv <= 0;
+                break;
+            case TOKEN_GT:
+                v = vv > 0;
+                break;
+            case TOKEN_GE:
+            default:
+                v = vv >= 0;
+                break;
+            }
+            e->value = v;
+            continue;
+        }
+
         e = add_vectors(e, scalar_mult(f, -1L, false));
 
+        unknown = false;
         switch (tto) {
         case TOKEN_EQ:
         case TOKEN_NE:
             if (is_unknown(e))
-                v = -1;         /* means unknown */
+                unknown = true;
             else if (!is_really_simple(e) || reloc_value(e) != 0)
                 v = (tto == TOKEN_NE);    /* unequal, so return true if NE */
             else
@@ -416,7 +519,7 @@ static expr *rexp3(void)
             break;
         default:
             if (is_unknown(e))
-                v = -1;         /* means unknown */
+                unknown = true;
             else if (!is_really_simple(e)) {
                 nasm_nonfatal("`%s': operands differ by a non-scalar",
                               (tto == TOKEN_LE ? "<=" :
@@ -440,7 +543,7 @@ static expr *rexp3(void)
             break;
         }
 
-        if (v == -1)
+        if (unknown)
             e = unknown_expr();
         else
             e = scalarvect(v);
@@ -461,6 +564,10 @@ static expr *expr0(void)
         f = expr1();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value |= f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`|' operator may only be applied to"
@@ -487,6 +594,10 @@ static expr *expr1(void)
         f = expr2();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value ^= f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`^' operator may only be applied to"
@@ -513,6 +624,10 @@ static expr *expr2(void)
         f = expr3();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            e->value &= f->value;
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("`&' operator may only be applied to"
@@ -540,6 +655,20 @@ static expr *expr3(void)
         f = expr4();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            switch (tto) {
+            case TOKEN_SHL:
+                e->value = e->value << f->value;
+                break;
+            case TOKEN_SHR:
+                e->value = ((uint64_t)e->value) >> f->value;
+                break;
+            case TOKEN_SAR:
+                e->value = ((int64_t)e->value) >> f->value;
+                break;
+            }
+            continue;
+        }
         if (!(is_simple(e) || is_just_unknown(e)) ||
             !(is_simple(f) || is_just_unknown(f))) {
             nasm_nonfatal("shift operator may only be applied to"
@@ -578,6 +707,21 @@ static expr *expr4(void)
         f = expr5();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f)) {
+            int64_t sum = (tto == '+') ?
+                (uint64_t)e->value + (uint64_t)f->value :
+                (uint64_t)e->value - (uint64_t)f->value;
+
+            /* Same result, and hint, as add_vectors() */
+            if (sum) {
+                e->value = sum;
+                if (hint)
+                    hint->type = EAH_SUMMED;
+            } else {
+                e->type = e->value = 0;
+            }
+            continue;
+        }
         switch (tto) {
         case '+':
             e = add_vectors(e, f);
@@ -604,6 +748,26 @@ static expr *expr5(void)
         f = expr6();
         if (!f)
             return NULL;
+        if (is_scalar(e) && is_scalar(f) && (tto == '*' || f->value)) {
+            switch (tto) {
+            case '*':
+                e->value = (uint64_t)e->value * (uint64_t)f->value;
+                break;
+            case '/':
+                e->value = ((uint64_t)e->value) / ((uint64_t)f->value);
+                break;
+            case '%':
+                e->value = ((uint64_t)e->value) % ((uint64_t)f->value);
+                break;
+            case TOKEN_SDIV:
+                e->value = ((int64_t)e->value) / ((int64_t)f->value);
+                break;
+            case TOKEN_SMOD:
+                e->value = ((int64_t)e->value) % ((int64_t)f->value);
+                break;
+            }
+            continue;
+        }
         if (tto != '*' && (!(is_simple(e) || is_just_unknown(e)) ||
                          !(is_simple(f) || is_just_unknown(f)))) {
             nasm_nonfatal("division operator may only be applied to"
@@ -816,6 +980,10 @@ static expr *expr6(void)
         e = expr6();
         if (!e)
             return NULL;
+        if (is_scalar(e)) {
+            e->value = ~e->value;
+            return e;
+        }
         if (is_just_unknown(e))
             return unknown_expr();
         else if (!is_simple(e)) {
@@ -830,6 +998,10 @@ static expr *expr6(void)
         e = expr6();
         if (!e)
             return NULL;
+        if (is_scalar(e)) {
+            e->value = !e->value;
+            return e;
+        }
         if (is_just_unknown(e))
             return unknown_expr();
         else if (!is_simple(e)) {
@@ -941,7 +1113,9 @@ static expr *expr6(void)
                 label_ofs = in_absolute ? absolute.offset : location.offset;
             } else {
                 enum label_type ltype;
-                ltype = lookup_label(tokval->t_charptr, &label_seg, &label_ofs);
+                bool current;
+                ltype = lookup_label_pass(tokval->t_charptr,
+                                          &label_seg, &label_ofs, &current);
                 if (ltype == LBL_none) {
                     scope = local_scope(tokval->t_charptr);
                     if (critical) {
@@ -955,8 +1129,10 @@ static expr *expr6(void)
                     type = EXPR_UNKNOWN;
                     label_seg = NO_SEG;
                     label_ofs = 1;
-                } else if (is_extern(ltype)) {
-                    if (opflags)
+                } else {
+                    if (opflags && !current)
+                        *opflags |= OPFLAG_PREVPASS;
+                    if (is_extern(ltype) && opflags)
                         *opflags |= OPFLAG_EXTERN;
                 }
             }
@@ -995,8 +1171,7 @@ expr *evaluate(scanner sc, void *scprivate, struct tokenval *tv,
     tokval = tv;
     opflags = fwref;
 
-    while (ntempexprs)          /* initialize temporary storage */
-        nasm_free(tempexprs[--ntempexprs]);
+    arena_reset();              /* initialize temporary storage */
 
     tt = tokval->t_type;
     if (tt == TOKEN_INVALID)
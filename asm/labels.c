@@ -11,7 +11,7 @@
 #include "nasm.h"
 #include "nasmlib.h"
 #include "error.h"
-#include "hashtbl.h"
+#include "hashtbl.h"              /* For crc64() */
 #include "labels.h"
 
 /*
@@ -54,11 +54,18 @@ static bool set_prevlabel(const char *l)
     return l[0] != '.';
 }
 
-#define LABEL_BLOCK     128     /* no. of labels/block */
-#define LBLK_SIZE       (LABEL_BLOCK * sizeof(union label))
+/*
+ * Labels are numbered from 1; label number 0 means "no label".  The
+ * label data is split into the fields needed for every lookup and
+ * definition, which are packed together, and the rarely used rest.
+ * Both are kept in blocks of LABEL_BLOCK entries, so pointers to them
+ * remain valid as more labels are created.
+ */
+typedef uint32_t labelno;
 
-#define END_LIST        -3      /* don't clash with NO_SEG! */
-#define END_BLOCK       -2
+#define LABEL_BLOCK_SHIFT 10
+#define LABEL_BLOCK     (1 << LABEL_BLOCK_SHIFT)   /* labels per block */
+#define LABEL_BLOCK_MASK (LABEL_BLOCK - 1)
 
 #define PERMTS_SIZE     16384   /* size of text blocks */
 #if (PERMTS_SIZE < IDLEN_MAX)
@@ -71,24 +78,32 @@ static const char * const types[] = {
     "special", "output format special"
 };
 
-union label {                   /* actual label structures */
-    struct {
-        int32_t segment;
-        int32_t subsection;     /* Available for ofmt->herelabel() */
-        int64_t offset;
-        int64_t size;
-        int64_t defined;        /* 0 if undefined, passn+1 for when defn seen */
-        int64_t lastref;        /* Last pass where we saw a reference */
-        char *label, *mangled, *special;
-        const char *def_file;   /* Where defined */
-        int32_t def_line;
-        enum label_type type, mangled_type;
-    } defn;
-    struct {
-        int32_t movingon;
-        int64_t dummy;
-        union label *next;
-    } admin;
+struct label_hot {              /* used on every lookup */
+    int64_t offset;
+    int64_t defined;            /* 0 if undefined, passn+1 for when defn seen */
+    int64_t lastref;            /* Last pass where we saw a reference */
+    int32_t segment;
+    enum label_type type;
+};
+
+struct label_cold {             /* everything else */
+    char *label, *mangled, *special;
+    const char *def_file;       /* Where defined */
+    int64_t size;
+    int32_t subsection;         /* Available for ofmt->herelabel() */
+    int32_t def_line;
+    enum label_type mangled_type;
+};
+
+/*
+ * Open-addressed hash table of label numbers.  The hash and the name
+ * are kept in the table, so a lookup only touches the label data once
+ * the label has been found.
+ */
+struct label_slot {
+    uint32_t hash;
+    labelno lnum;               /* 0 if the slot is free */
+    const char *name;
 };
 
 struct permts {                 /* permanent text storage */
@@ -100,39 +115,60 @@ struct permts {                 /* permanent text storage */
 
 uint64_t global_offset_changed;		/* counter for global offset changes */
 
-static struct hash_table ltab;          /* labels hash table */
-static union label *ldata;              /* all label data blocks */
-static union label *lfree;              /* labels free block */
+static struct label_slot *ltab;         /* labels hash table */
+static size_t ltab_size;                /* size of ltab, a power of 2 */
+static struct label_hot **lhot_blocks;  /* label data blocks */
+static struct label_cold **lcold_blocks;
+static size_t lblocks;                  /* number of label data blocks */
+static labelno nlabels;                 /* labels in use, including 0 */
 static struct permts *perm_head;        /* start of perm. text storage */
 static struct permts *perm_tail;        /* end of perm. text storage */
 
-static void init_block(union label *blk);
 static char *perm_alloc(size_t len);
 static char *perm_copy(const char *string);
 static char *perm_copy3(const char *s1, const char *s2, const char *s3);
-static const char *mangle_label_name(union label *lptr);
+static const char *mangle_label_name(labelno lnum);
 
 static const char *prevlabel;
+static size_t prevlabel_len;
+static uint64_t prevlabel_hash;         /* crc64() of prevlabel */
 
 static bool initialized = false;
 
+static inline struct label_hot *lhot(labelno lnum)
+{
+    return &lhot_blocks[lnum >> LABEL_BLOCK_SHIFT][lnum & LABEL_BLOCK_MASK];
+}
+
+static inline struct label_cold *lcold(labelno lnum)
+{
+    return &lcold_blocks[lnum >> LABEL_BLOCK_SHIFT][lnum & LABEL_BLOCK_MASK];
+}
+
+static inline uint32_t label_slot_hash(uint64_t hash)
+{
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
 /*
  * Emit a symdef to the output and the debug format backends.
  */
-static void out_symdef(union label *lptr)
+static void out_symdef(labelno lnum)
 {
+    struct label_hot *lh = lhot(lnum);
+    struct label_cold *lc = lcold(lnum);
     int backend_type;
     int64_t backend_offset;
 
     /* Backend-defined special segments are passed to symdef immediately */
     if (pass_final()) {
         /* Emit special fixups for globals and commons */
-        switch (lptr->defn.type) {
+        switch (lh->type) {
         case LBL_GLOBAL:
         case LBL_REQUIRED:
         case LBL_COMMON:
-            if (lptr->defn.special)
-                ofmt->symdef(lptr->defn.mangled, 0, 0, 3, lptr->defn.special);
+            if (lc->special)
+                ofmt->symdef(lc->mangled, 0, 0, 3, lc->special);
             break;
         default:
             break;
@@ -140,121 +176,207 @@ static void out_symdef(union label *lptr)
         return;
     }
 
-    if (pass_type() != PASS_STAB && lptr->defn.type != LBL_BACKEND)
+    if (pass_type() != PASS_STAB && lh->type != LBL_BACKEND)
         return;
 
     /* Clean up this hack... */
-    switch(lptr->defn.type) {
+    switch(lh->type) {
     case LBL_EXTERN:
         /* If not seen in the previous or this pass, drop it */
-        if (lptr->defn.lastref < pass_count())
+        if (lh->lastref < pass_count())
             return;
 
         /* Otherwise, promote to LBL_REQUIRED at this time */
-        lptr->defn.type = LBL_REQUIRED;
+        lh->type = LBL_REQUIRED;
 
         /* fall through */
     case LBL_GLOBAL:
     case LBL_REQUIRED:
         backend_type = 1;
-        backend_offset = lptr->defn.offset;
+        backend_offset = lh->offset;
         break;
     case LBL_COMMON:
         backend_type = 2;
-        backend_offset = lptr->defn.size;
+        backend_offset = lc->size;
         break;
     default:
         backend_type = 0;
-        backend_offset = lptr->defn.offset;
+        backend_offset = lh->offset;
         break;
     }
 
     /* Might be necessary for a backend symbol */
-    mangle_label_name(lptr);
+    mangle_label_name(lnum);
 
-    ofmt->symdef(lptr->defn.mangled, lptr->defn.segment,
+    ofmt->symdef(lc->mangled, lh->segment,
                  backend_offset, backend_type,
-                 lptr->defn.special);
+                 lc->special);
 
     /*
      * NASM special symbols are not passed to the debug format; none
      * of the current backends want to see them.
      */
-    if (lptr->defn.type == LBL_SPECIAL || lptr->defn.type == LBL_BACKEND)
+    if (lh->type == LBL_SPECIAL || lh->type == LBL_BACKEND)
         return;
 
-    dfmt->debug_deflabel(lptr->defn.mangled, lptr->defn.segment,
-                         lptr->defn.offset, backend_type,
-                         lptr->defn.special);
+    dfmt->debug_deflabel(lc->mangled, lh->segment,
+                         lh->offset, backend_type,
+                         lc->special);
 }
 
 /*
- * Internal routine: finds the `union label' corresponding to the
- * given label name. Creates a new one, if it isn't found, and if
- * `create' is true.
+ * Double the size of the hash table.
  */
-static union label *find_label(const char *label, bool create, bool *created)
+static void grow_label_table(void)
 {
-    union label *lptr, **lpp;
-    char *label_str = NULL;
-    struct hash_insert ip;
+    struct label_slot *otab = ltab;
+    size_t osize = ltab_size;
+    size_t mask, i, pos;
+
+    ltab_size = osize ? osize << 1 : 4096;
+    ltab = nasm_zalloc(ltab_size * sizeof(*ltab));
+    mask = ltab_size - 1;
+
+    for (i = 0; i < osize; i++) {
+        if (!otab[i].lnum)
+            continue;
+        for (pos = otab[i].hash & mask; ltab[pos].lnum; pos = (pos+1) & mask)
+            ;
+        ltab[pos] = otab[i];
+    }
 
-    nasm_assert(label != NULL);
+    nasm_free(otab);
+}
 
-    if (islocal(label))
-        label = label_str = nasm_strcat(prevlabel, label);
+/*
+ * Allocate a new, empty label.
+ */
+static labelno new_label(const char *prefix, const char *label)
+{
+    labelno lnum = nlabels++;
+    struct label_cold *lc;
+
+    if (!(lnum & LABEL_BLOCK_MASK)) {
+        size_t blk = lnum >> LABEL_BLOCK_SHIFT;
+
+        if (blk >= lblocks) {
+            lblocks = lblocks ? lblocks << 1 : 16;
+            lhot_blocks = nasm_realloc(lhot_blocks,
+                                       lblocks * sizeof(*lhot_blocks));
+            lcold_blocks = nasm_realloc(lcold_blocks,
+                                        lblocks * sizeof(*lcold_blocks));
+        }
+        lhot_blocks[blk] = nasm_malloc(LABEL_BLOCK * sizeof(struct label_hot));
+        lcold_blocks[blk] = nasm_malloc(LABEL_BLOCK * sizeof(struct label_cold));
+    }
 
-    lpp = (union label **) hash_find(&ltab, label, &ip);
-    lptr = lpp ? *lpp : NULL;
+    nasm_zero(*lhot(lnum));
+    lc = lcold(lnum);
+    nasm_zero(*lc);
+    lc->label = *prefix ? perm_copy3(prefix, label, "") : perm_copy(label);
+    lc->subsection = NO_SEG;
 
-    if (lptr || !create) {
-        if (created)
-            *created = false;
-        if (label_str)
-            nasm_free(label_str);
+    return lnum;
+}
 
-        return lptr;
+/*
+ * Internal routine: finds the label number corresponding to the
+ * given label name. Creates a new one, if it isn't found, and if
+ * `create' is true.  Returns 0 if not found.
+ *
+ * Local labels are looked up without building the full name: the
+ * hash of prevlabel is kept, and the hash of the local part is
+ * computed on top of it.
+ */
+static labelno find_label(const char *label, bool create, bool *created)
+{
+    const char *prefix = "";
+    size_t plen = 0;
+    uint64_t hash = CRC64_INIT;
+    uint32_t shash;
+    size_t mask, pos;
+    labelno lnum;
+
+    nasm_assert(label != NULL);
+
+    if (islocal(label)) {
+        prefix = prevlabel;
+        plen   = prevlabel_len;
+        hash   = prevlabel_hash;
     }
 
-    /* Create a new label... */
-    if (lfree->admin.movingon == END_BLOCK) {
-        /*
-         * must allocate a new block
-         */
-        lfree->admin.next = nasm_malloc(LBLK_SIZE);
-        lfree = lfree->admin.next;
-        init_block(lfree);
+    hash  = crc64(hash, label);
+    shash = label_slot_hash(hash);
+    mask  = ltab_size - 1;
+
+    for (pos = shash & mask; (lnum = ltab[pos].lnum); pos = (pos+1) & mask) {
+        if (ltab[pos].hash == shash) {
+            const char *name = ltab[pos].name;
+            if (!memcmp(name, prefix, plen) && !strcmp(name + plen, label)) {
+                if (created)
+                    *created = false;
+                return lnum;
+            }
+        }
     }
 
     if (created)
-        *created = true;
+        *created = create;
 
-    nasm_zero(*lfree);
-    lfree->defn.label     = perm_copy(label);
-    lfree->defn.subsection = NO_SEG;
-    if (label_str)
-        nasm_free(label_str);
+    if (!create)
+        return 0;
+
+    /* Create a new label... */
+    lnum = new_label(prefix, label);
+
+    /* Keep the table at most half full */
+    if (nlabels > (ltab_size >> 1)) {
+        grow_label_table();
+        mask = ltab_size - 1;
+        for (pos = shash & mask; ltab[pos].lnum; pos = (pos+1) & mask)
+            ;
+    }
 
-    hash_add(&ip, lfree->defn.label, lfree);
-    return lfree++;
+    ltab[pos].hash = shash;
+    ltab[pos].lnum = lnum;
+    ltab[pos].name = lcold(lnum)->label;
+    return lnum;
 }
 
 enum label_type lookup_label(const char *label,
                              int32_t *segment, int64_t *offset)
 {
-    union label *lptr;
+    bool current;
+
+    return lookup_label_pass(label, segment, offset, &current);
+}
+
+/*
+ * Like lookup_label(), but also tell if the label has been defined
+ * in this pass yet; if not, the value is from the previous pass.
+ */
+enum label_type lookup_label_pass(const char *label, int32_t *segment,
+                                  int64_t *offset, bool *current)
+{
+    labelno lnum;
+    struct label_hot *lh;
 
     if (!initialized)
         return LBL_none;
 
-    lptr = find_label(label, false, NULL);
-    if (lptr && lptr->defn.defined) {
+    lnum = find_label(label, false, NULL);
+    if (!lnum)
+        return LBL_none;
+
+    lh = lhot(lnum);
+    if (lh->defined) {
         int64_t lpass = pass_count() + 1;
 
-        lptr->defn.lastref = lpass;
-        *segment = lptr->defn.segment;
-        *offset = lptr->defn.offset;
-        return lptr->defn.type;
+        lh->lastref = lpass;
+        *segment = lh->segment;
+        *offset = lh->offset;
+        *current = lh->defined == lpass;
+        return lh->type;
     }
 
     return LBL_none;
@@ -314,16 +436,17 @@ void set_label_mangle(enum directive how, const char *what)
 /*
  * Format a label name with appropriate prefixes and suffixes
  */
-static const char *mangle_label_name(union label *lptr)
+static const char *mangle_label_name(labelno lnum)
 {
+    struct label_cold *lc = lcold(lnum);
+    enum label_type type = lhot(lnum)->type;
     const char *prefix;
     const char *suffix;
 
-    if (likely(lptr->defn.mangled &&
-               lptr->defn.mangled_type == lptr->defn.type))
-        return lptr->defn.mangled; /* Already mangled */
+    if (likely(lc->mangled && lc->mangled_type == type))
+        return lc->mangled; /* Already mangled */
 
-    switch (lptr->defn.type) {
+    switch (type) {
     case LBL_GLOBAL:
     case LBL_STATIC:
     case LBL_EXTERN:
@@ -341,19 +464,20 @@ static const char *mangle_label_name(union label *lptr)
         break;
     }
 
-    lptr->defn.mangled_type = lptr->defn.type;
+    lc->mangled_type = type;
 
     if (!(*prefix) && !(*suffix))
-        lptr->defn.mangled = lptr->defn.label;
+        lc->mangled = lc->label;
     else
-        lptr->defn.mangled = perm_copy3(prefix, lptr->defn.label, suffix);
+        lc->mangled = perm_copy3(prefix, lc->label, suffix);
 
-    return lptr->defn.mangled;
+    return lc->mangled;
 }
 
 static void
-handle_herelabel(union label *lptr, int32_t *segment, int64_t *offset)
+handle_herelabel(labelno lnum, int32_t *segment, int64_t *offset)
 {
+    struct label_cold *lc = lcold(lnum);
     int32_t oldseg;
 
     if (likely(!ofmt->herelabel))
@@ -369,9 +493,9 @@ handle_herelabel(union label *lptr, int32_t *segment, int64_t *offset)
         int32_t newseg;
         bool copyoffset = false;
 
-        nasm_assert(lptr->defn.mangled);
-        newseg = ofmt->herelabel(lptr->defn.mangled, lptr->defn.type,
-                                 oldseg, &lptr->defn.subsection, &copyoffset);
+        nasm_assert(lc->mangled);
+        newseg = ofmt->herelabel(lc->mangled, lhot(lnum)->type,
+                                 oldseg, &lc->subsection, &copyoffset);
         if (likely(newseg == oldseg))
             return;
 
@@ -387,42 +511,44 @@ handle_herelabel(union label *lptr, int32_t *segment, int64_t *offset)
     }
 }
 
-static bool declare_label_lptr(union label *lptr,
+static bool declare_label_lnum(labelno lnum,
                                enum label_type type, const char *special)
 {
-    enum label_type oldtype = lptr->defn.type;
+    struct label_hot *lh = lhot(lnum);
+    struct label_cold *lc = lcold(lnum);
+    enum label_type oldtype = lh->type;
 
     if (special && !special[0])
         special = NULL;
 
     if (!pass_stable() && oldtype == LBL_LOCAL) {
-        if (is_extern(type) && lptr->defn.defined)
+        if (is_extern(type) && lh->defined)
             oldtype = LBL_GLOBAL; /* Already defined, promote to global */
         else
             oldtype = type;
 
-        lptr->defn.type = oldtype;
+        lh->type = oldtype;
     }
 
     if (oldtype == type || (oldtype == LBL_EXTERN && type == LBL_REQUIRED)) {
-        lptr->defn.type = type;
+        lh->type = type;
 
         if (special) {
-            if (!lptr->defn.special)
-                lptr->defn.special = perm_copy(special);
-            else if (nasm_stricmp(lptr->defn.special, special))
+            if (!lc->special)
+                lc->special = perm_copy(special);
+            else if (nasm_stricmp(lc->special, special))
                 nasm_nonfatal("symbol `%s' has inconsistent attributes `%s' and `%s'",
-                              lptr->defn.label, lptr->defn.special, special);
+                              lc->label, lc->special, special);
         }
         return true;
     } else if (is_extern(oldtype) && is_global(type)) {
         /* EXTERN or REQUIRED can be replaced with GLOBAL or COMMON */
-        lptr->defn.type = type;
-        lptr->defn.defined = 0;
+        lh->type = type;
+        lh->defined = 0;
 
         /* Override special unconditionally */
         if (special)
-            lptr->defn.special = perm_copy(special);
+            lc->special = perm_copy(special);
         return true;
     } else if (is_extern(type) && (is_global(oldtype) || is_extern(oldtype))) {
         /*
@@ -431,21 +557,21 @@ static bool declare_label_lptr(union label *lptr,
          */
 
         /* Ignore special unless we don't already have one */
-        if (!lptr->defn.special)
-            lptr->defn.special = perm_copy(special);
+        if (!lc->special)
+            lc->special = perm_copy(special);
 
         return false; /* Don't call define_label() after this! */
     }
 
     nasm_nonfatal("symbol `%s' declared both as %s and %s",
-                  lptr->defn.label, types[lptr->defn.type], types[type]);
+                  lc->label, types[lh->type], types[type]);
     return false;
 }
 
 bool declare_label(const char *label, enum label_type type, const char *special)
 {
-    union label *lptr = find_label(label, true, NULL);
-    return declare_label_lptr(lptr, type, special);
+    labelno lnum = find_label(label, true, NULL);
+    return declare_label_lnum(lnum, type, special);
 }
 
 /*
@@ -455,7 +581,9 @@ bool declare_label(const char *label, enum label_type type, const char *special)
 void define_label(const char *label, int32_t segment,
                   int64_t offset, bool normal)
 {
-    union label *lptr;
+    labelno lnum;
+    struct label_hot *lh;
+    struct label_cold *lc;
     bool created, changed, largechange;
     int64_t size;
     int64_t lpass, lastdef;
@@ -472,39 +600,44 @@ void define_label(const char *label, int32_t segment,
      * or the offset changes. Increment global_offset_changed when that
      * happens, to tell the assembler core to make another pass.
      */
-    lptr = find_label(label, true, &created);
+    lnum = find_label(label, true, &created);
+    lh = lhot(lnum);
+    lc = lcold(lnum);
 
-    lastdef = lptr->defn.defined;
+    lastdef = lh->defined;
 
     if (segment) {
         /* We are actually defining this label */
-        if (is_extern(lptr->defn.type)) {
+        if (is_extern(lh->type)) {
             /* auto-promote EXTERN/REQUIRED to GLOBAL */
-            lptr->defn.type = LBL_GLOBAL;
+            lh->type = LBL_GLOBAL;
             lastdef = 0; /* We are "re-creating" this label */
         }
     } else {
         /* It's a pseudo-segment (extern, required, common) */
-        segment = lptr->defn.segment ? lptr->defn.segment : seg_alloc();
+        segment = lh->segment ? lh->segment : seg_alloc();
     }
 
-    if (lastdef || lptr->defn.type == LBL_BACKEND) {
+    if (lastdef || lh->type == LBL_BACKEND) {
         /*
          * We have seen this on at least one previous pass, or
          * potentially earlier in this same pass (in which case we
          * will probably error out further down.)
          */
-        mangle_label_name(lptr);
-        handle_herelabel(lptr, &segment, &offset);
+        mangle_label_name(lnum);
+        handle_herelabel(lnum, &segment, &offset);
     }
 
-    if (ismagic(label) && lptr->defn.type == LBL_LOCAL)
-        lptr->defn.type = LBL_SPECIAL;
+    if (ismagic(label) && lh->type == LBL_LOCAL)
+        lh->type = LBL_SPECIAL;
 
-    if (set_prevlabel(label) && normal)
-        prevlabel = lptr->defn.label;
+    if (set_prevlabel(label) && normal && prevlabel != lc->label) {
+        prevlabel = lc->label;
+        prevlabel_len = strlen(prevlabel);
+        prevlabel_hash = crc64(CRC64_INIT, prevlabel);
+    }
 
-    if (lptr->defn.type == LBL_COMMON) {
+    if (lh->type == LBL_COMMON) {
         size = offset;
         offset = 0;
     } else {
@@ -513,9 +646,9 @@ void define_label(const char *label, int32_t segment,
 
     /* A "large change" is one which is not the offset */
     largechange = created || !lastdef ||
-        lptr->defn.segment != segment ||
-        lptr->defn.size != size;
-    changed = largechange || (lptr->defn.offset != offset);
+        lh->segment != segment ||
+        lc->size != size;
+    changed = largechange || (lh->offset != offset);
     global_offset_changed += changed;
 
     if (lastdef == lpass) {
@@ -527,19 +660,19 @@ void define_label(const char *label, int32_t segment,
          * Defined elsewhere in the program, seen in this pass.
          */
         if (changed) {
-            nasm_nonfatal("label `%s' inconsistently redefined", lptr->defn.label);
+            nasm_nonfatal("label `%s' inconsistently redefined", lc->label);
             noteflags = ERR_NONFATAL|ERR_HERE|ERR_NO_SEVERITY;
         } else {
             nasm_warn(WARN_LABEL_REDEF,
-                       "info: label `%s' redefined to an identical value", lptr->defn.label);
+                       "info: label `%s' redefined to an identical value", lc->label);
             noteflags = ERR_WARNING|ERR_HERE|ERR_NO_SEVERITY|WARN_LABEL_REDEF;
         }
 
         src_get(&saved_line, &saved_fname);
-        src_set(lptr->defn.def_line, lptr->defn.def_file);
-        nasm_error(noteflags, "info: label `%s' originally defined", lptr->defn.label);
+        src_set(lc->def_line, lc->def_file);
+        nasm_error(noteflags, "info: label `%s' originally defined", lc->label);
         src_set(saved_line, saved_fname);
-    } else if (changed && pass_final() && lptr->defn.type != LBL_SPECIAL) {
+    } else if (changed && pass_final() && lh->type != LBL_SPECIAL) {
         /*
          * Note: As a special case, LBL_SPECIAL symbols are allowed
          * to be changed even during the last pass.
@@ -548,23 +681,23 @@ void define_label(const char *label, int32_t segment,
             nasm_warn(WARN_LABEL_REDEF_LATE,
                       "label `%s' changed during code generation"
                       " (offset 0x%"PRIx64" -> 0x%"PRIx64")",
-                      lptr->defn.label, lptr->defn.offset, offset);
+                      lc->label, lh->offset, offset);
         } else {
             nasm_warn(WARN_LABEL_REDEF_LATE|ERR_UNDEAD,
                       "label `%s' %s during code generation",
-                   lptr->defn.label, created ? "defined" : "changed");
+                   lc->label, created ? "defined" : "changed");
         }
     }
-    lptr->defn.segment = segment;
-    lptr->defn.offset  = offset;
-    lptr->defn.size    = size;
-    lptr->defn.defined = lpass;
+    lh->segment = segment;
+    lh->offset  = offset;
+    lc->size    = size;
+    lh->defined = lpass;
 
     if (changed || lastdef != lpass)
-        src_get(&lptr->defn.def_line, &lptr->defn.def_file);
+        src_get(&lc->def_line, &lc->def_file);
 
     if (lastdef != lpass)
-        out_symdef(lptr);
+        out_symdef(lnum);
 }
 
 /*
@@ -580,8 +713,16 @@ void backend_label(const char *label, int32_t segment, int64_t offset)
 
 int init_labels(void)
 {
-    ldata = lfree = nasm_malloc(LBLK_SIZE);
-    init_block(lfree);
+    nlabels = 1;                /* Label 0 is never used */
+    lblocks = 16;
+    nasm_newn(lhot_blocks, lblocks);
+    nasm_newn(lcold_blocks, lblocks);
+    lhot_blocks[0] = nasm_malloc(LABEL_BLOCK * sizeof(struct label_hot));
+    lcold_blocks[0] = nasm_malloc(LABEL_BLOCK * sizeof(struct label_cold));
+
+    ltab = NULL;
+    ltab_size = 0;
+    grow_label_table();
 
     perm_head = perm_tail =
         nasm_malloc(sizeof(struct permts));
@@ -591,6 +732,8 @@ int init_labels(void)
     perm_head->usage = 0;
 
     prevlabel = "";
+    prevlabel_len = 0;
+    prevlabel_hash = CRC64_INIT;
 
     initialized = true;
 
@@ -599,19 +742,24 @@ int init_labels(void)
 
 void cleanup_labels(void)
 {
-    union label *lptr, *lhold;
+    size_t i;
 
     initialized = false;
 
-    hash_free(&ltab);
+    nasm_free(ltab);
+    ltab = NULL;
+    ltab_size = 0;
 
-    lptr = lhold = ldata;
-    while (lptr) {
-        lptr = &lptr[LABEL_BLOCK-1];
-        lptr = lptr->admin.next;
-        nasm_free(lhold);
-        lhold = lptr;
+    for (i = 0; i < (nlabels + LABEL_BLOCK_MASK) >> LABEL_BLOCK_SHIFT; i++) {
+        nasm_free(lhot_blocks[i]);
+        nasm_free(lcold_blocks[i]);
     }
+    nasm_free(lhot_blocks);
+    nasm_free(lcold_blocks);
+    lhot_blocks = NULL;
+    lcold_blocks = NULL;
+    lblocks = 0;
+    nlabels = 0;
 
     while (perm_head) {
         perm_tail = perm_head;
@@ -620,16 +768,6 @@ void cleanup_labels(void)
     }
 }
 
-static void init_block(union label *blk)
-{
-    int j;
-
-    for (j = 0; j < LABEL_BLOCK - 1; j++)
-        blk[j].admin.movingon = END_LIST;
-    blk[LABEL_BLOCK - 1].admin.movingon = END_BLOCK;
-    blk[LABEL_BLOCK - 1].admin.next = NULL;
-}
-
 static char * safe_alloc perm_alloc(size_t len)
 {
     char *p;
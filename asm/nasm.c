@@ -7,7 +7,6 @@
 
 #include "compiler.h"
 
-
 #include "nasm.h"
 #include "nasmlib.h"
 #include "nctype.h"
@@ -28,6 +27,7 @@
 #include "quote.h"
 #include "ver.h"
 #include "files.h"
+#include "batch.h"
 #include "error.h"
 
 /*
@@ -92,6 +92,21 @@ static struct RAA *offsets;
 static struct SAA *forwrefs;    /* keep track of forward references */
 static const struct forwrefinfo *forwref;
 
+/*
+ * Preprocessed lines recorded during the first pass, replayed for the
+ * optimization and stabilization passes if --pass-cache is given.
+ */
+struct cached_line {
+    struct src_location where;
+    size_t len;
+};
+static bool pass_cache;             /* --pass-cache given */
+static struct SAA *cache_lines;     /* struct cached_line */
+static struct SAA *cache_text;      /* NUL-terminated line text */
+static bool cache_recording, cache_replaying;
+static char *replay_buf;
+static size_t replay_bufsize;
+
 static struct strlist *include_path;
 static enum preproc_opt ppopt;
 
@@ -325,6 +340,10 @@ static void reset_limits_before_pass(void)
 
 int64_t switch_segment(int32_t segment)
 {
+    /* Already there; nothing to flush back or look up */
+    if (segment == location.segment && !in_absolute && segment != NO_SEG)
+        return location.offset;
+
     location.segment = segment;
     if (segment == NO_SEG) {
         location.offset = absolute.offset;
@@ -628,13 +647,49 @@ static const char *fix_dependfile_name(void)
     return set_filename(FN_DEPENDFILE, newname);
 }
 
-int main(int argc, char **argv)
+/*
+ * Batch mode (see batch.c) runs each job in a forked copy of this
+ * process, which calls assemble_job() with the job's command line.
+ *
+ * The arguments on the command line itself are common to all jobs and
+ * are put in front of the arguments of each job.  A file name given in
+ * the common arguments is only a default, which the job may override.
+ */
+static int batch_ncommon;       /* Common arguments of this batch job */
+static bool batch_common;       /* Processing the common arguments */
+static char *batch_filenames[FN_NFILES];
+
+static void cmdline_filename(enum filenames fn, const char *name)
 {
-    /* Do these as early as possible */
-    erropt.file = stderr;
-    _progname = argv[0];
-    if (!_progname || !_progname[0])
-        _progname = "nasm";
+    if (batch_common)
+        nasm_strdupto(&batch_filenames[fn], name);
+    else
+        copy_filename(fn, name);
+}
+
+/* Use the default file names for anything not set by the job itself */
+static void batch_default_filenames(void)
+{
+    enum filenames fn;
+
+    for (fn = 0; fn < FN_NFILES; fn++) {
+        if (!batch_filenames[fn])
+            continue;
+        if (!get_filename(fn))
+            set_filename(fn, batch_filenames[fn]);
+        else
+            nasm_free(batch_filenames[fn]);
+        batch_filenames[fn] = NULL;
+    }
+}
+
+/*
+ * Assemble one file as given by the command line; the first ncommon
+ * arguments are the common arguments of a batch job.
+ */
+static int assemble_job(int argc, char **argv, int ncommon)
+{
+    batch_ncommon = ncommon;
 
     timestamp();
 
@@ -801,7 +856,8 @@ int main(int argc, char **argv)
 
     if (operating_mode & OP_NORMAL) {
         const char *outname = get_filename(FN_OUTFILE);
-        ofile = nasm_open_write(outname, (ofmt->flags & OFMT_TEXT) ? NF_TEXT : NF_BINARY);
+        ofile = nasm_open_write(outname, NF_OUTPUT |
+                                ((ofmt->flags & OFMT_TEXT) ? NF_TEXT : NF_BINARY));
         if (!ofile)
             nasm_fatalf(ERR_PERROR, "unable to open output file `%s'", outname);
 
@@ -839,6 +895,25 @@ int main(int argc, char **argv)
     return terminate_after_phase();
 }
 
+int main(int argc, char **argv)
+{
+    const char *listfile;
+    int njobs;
+
+    /* Do these as early as possible */
+    erropt.file = stderr;
+    _progname = argv[0];
+    if (!_progname || !_progname[0])
+        _progname = "nasm";
+
+    /* Batch jobs are started before anything else is initialized */
+    listfile = batch_options(&argc, argv, &njobs);
+    if (listfile)
+        return run_batch(argc, argv, listfile, njobs, assemble_job);
+
+    return assemble_job(argc, argv, 0);
+}
+
 /*
  * Get a parameter for a command line option.
  * First arg must be in the form of e.g. -f...
@@ -1030,7 +1105,9 @@ enum text_options {
     OPT_DEBUG,
     OPT_INFO,
     OPT_REPRODUCIBLE,
-    OPT_BITS
+    OPT_BITS,
+    OPT_PASS_CACHE,
+    OPT_MACRO_CACHE
 };
 enum need_arg {
     ARG_NO,
@@ -1069,6 +1146,8 @@ static const struct textargs textopts[] = {
     {"debug",    OPT_DEBUG, ARG_MAYBE, 0},
     {"reproducible", OPT_REPRODUCIBLE, ARG_NO, 0},
     {"bits",     OPT_BITS, ARG_YES, 0},
+    {"pass-cache", OPT_PASS_CACHE, ARG_NO, 0},
+    {"macro-cache", OPT_MACRO_CACHE, ARG_YES, 0},
     {NULL, OPT_BOGUS, ARG_NO, 0}
 };
 
@@ -1106,7 +1185,7 @@ static bool process_arg(char *p, char *q, int pass)
 
         case 'o':       /* output file */
             if (pass == 2)
-                copy_filename(FN_OUTFILE, param);
+                cmdline_filename(FN_OUTFILE, param);
             break;
 
         case 'f':       /* output format */
@@ -1192,7 +1271,7 @@ static bool process_arg(char *p, char *q, int pass)
 
         case 'l':       /* listing file */
             if (pass == 2)
-                copy_filename(FN_LISTFILE, param);
+                cmdline_filename(FN_LISTFILE, param);
             break;
 
         case 'L':        /* listing options */
@@ -1202,7 +1281,7 @@ static bool process_arg(char *p, char *q, int pass)
 
         case 'Z':       /* error messages file */
             if (pass == 1)
-                copy_filename(FN_ERRFILE, param);
+                cmdline_filename(FN_ERRFILE, param);
             break;
 
         case 'F':       /* specify debug format */
@@ -1306,12 +1385,12 @@ static bool process_arg(char *p, char *q, int pass)
                 case 'D':
                     operating_mode |= OP_DEPEND;
                     if (q && (q[0] != '-' || q[1] == '\0')) {
-                        copy_filename(FN_DEPENDFILE, q);
+                        cmdline_filename(FN_DEPENDFILE, q);
                         advance = true;
                     }
                     break;
                 case 'F':
-                    copy_filename(FN_DEPENDFILE, q);
+                    cmdline_filename(FN_DEPENDFILE, q);
                     advance = true;
                     break;
                 case 'T':
@@ -1455,6 +1534,13 @@ static bool process_arg(char *p, char *q, int pass)
                 case OPT_REPRODUCIBLE:
                     reproducible = true;
                     break;
+                case OPT_PASS_CACHE:
+                    pass_cache = true;
+                    break;
+                case OPT_MACRO_CACHE:
+                    if (pass == 2)
+                        pp_macro_cache(param);
+                    break;
                 case OPT_HELP:
                     /* Allow --help topic without *requiring* topic */
                     if (!param)
@@ -1481,12 +1567,13 @@ static bool process_arg(char *p, char *q, int pass)
          * would require making this a list, and probably would require
          * some other more complicated changes.
          */
-        copy_filename(FN_INFILE, p);
+        cmdline_filename(FN_INFILE, p);
     }
 
     return advance;
 }
 
+
 #define ARG_BUF_DELTA 128
 
 static void process_respfile(FILE * rfile, int pass)
@@ -1622,6 +1709,7 @@ static void open_errfile(const char *errfile)
 static void parse_cmdline(int argc, char **argv, int pass)
 {
     char *envreal, *envcopy = NULL;
+    char **common_end = argv + batch_ncommon;
 
     /*
      * Initialize all the warnings to their default state, including
@@ -1632,6 +1720,7 @@ static void parse_cmdline(int argc, char **argv, int pass)
     /*
      * First, process the NASMENV environment variable.
      */
+    batch_common = batch_ncommon > 0;
     envreal = getenv("NASMENV");
     if (envreal) {
         envcopy = nasm_strdup(envreal);
@@ -1645,6 +1734,7 @@ static void parse_cmdline(int argc, char **argv, int pass)
     while (--argc) {
         bool advance;
         argv++;
+        batch_common = argv <= common_end;
         if (argv[0][0] == '@') {
             /*
              * We have a response file, so process this as a set of
@@ -1662,6 +1752,9 @@ static void parse_cmdline(int argc, char **argv, int pass)
         argv += advance, argc -= advance;
     }
 
+    batch_common = false;
+    batch_default_filenames();
+
     /*
      * Look for basic command line typos. This definitely doesn't
      * catch all errors, but it might help cases of fumbled fingers.
@@ -1709,6 +1802,98 @@ static void forward_refs(insn *instruction)
     }
 }
 
+static void pass_cache_free(void)
+{
+    if (cache_lines) {
+        saa_free(cache_lines);
+        saa_free(cache_text);
+        cache_lines = cache_text = NULL;
+    }
+    nasm_free(replay_buf);
+    replay_buf = NULL;
+    replay_bufsize = 0;
+}
+
+/*
+ * Start recording or replaying the preprocessed source for this pass.
+ * The final pass always runs the preprocessor, so that the listing,
+ * debug information and final-pass diagnostics are generated exactly
+ * as without the cache; so does any pass generating a listing (-Lp).
+ */
+static void pass_cache_start(void)
+{
+    cache_recording = cache_replaying = false;
+
+    if (!pass_cache)
+        return;
+
+    if (pass_final()) {
+        pass_cache_free();
+    } else if (pass_first()) {
+        cache_lines = saa_init(sizeof(struct cached_line));
+        cache_text  = saa_init(1);
+        cache_recording = true;
+    } else if (cache_lines && !list_on_this_pass()) {
+        saa_rewind(cache_lines);
+        saa_rewind(cache_text);
+        cache_replaying = true;
+    }
+}
+
+static char *pass_getline(struct scanline **scanned)
+{
+    struct cached_line *cl;
+    char *line;
+
+    *scanned = NULL;
+
+    if (cache_replaying) {
+        cl = saa_rstruct(cache_lines);
+        if (!cl)
+            return NULL;
+
+        if (cl->len >= replay_bufsize) {
+            replay_bufsize = cl->len + 1;
+            replay_buf = nasm_realloc(replay_buf, replay_bufsize);
+        }
+        saa_rnbytes(cache_text, replay_buf, cl->len + 1);
+        src_update(cl->where);
+        return replay_buf;
+    }
+
+    line = pp_getline_scan(scanned);
+    if (line && cache_recording) {
+        cl = saa_wstruct(cache_lines);
+        cl->where = src_where_top();
+        cl->len = saa_wcstring(cache_text, line) - 1;
+    }
+    return line;
+}
+
+static void pass_freeline(char *line, struct scanline *scanned)
+{
+    if (!cache_replaying)
+        nasm_free(line);
+    nasm_free(scanned);
+}
+
+static void pass_cache_end(void)
+{
+    if (cache_replaying) {
+        src_update(src_nowhere());
+        return;
+    }
+
+    pp_cleanup_pass();
+
+    /*
+     * If the preprocessor output depended on anything that can change
+     * between passes, the recorded lines are of no use.
+     */
+    if (cache_recording && pp_pass_dependent())
+        pass_cache_free();
+}
+
 void print_final_report(bool failure)
 {
     /* This test is here to reduce the likelihood of a recursive failure */
@@ -1720,6 +1905,10 @@ void print_final_report(bool failure)
             nasm_info(1, "assembly %s after 1+%"PRId64"+%u passes",
                       failure ? "failed" : "completed",
                       pass_count()-1-end_passes, end_passes);
+            nasm_info(1, "instruction cache: %"PRIu64" hits, %"PRIu64" misses",
+                      insn_cache_stats.hits, insn_cache_stats.misses);
+            nasm_info(1, "smacro cache: %"PRIu64" hits, %"PRIu64" tokens not re-expanded",
+                      pp_smacro_stats.hits, pp_smacro_stats.tokens);
         }
     }
 }
@@ -1728,6 +1917,7 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
 {
     static int64_t stall_count = 0; /* Make sure we make forward progress... */
     char *line;
+    struct scanline *scanned;
     insn output_ins;
     uint64_t prev_offset_changed;
 
@@ -1774,6 +1964,7 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
 
         error_pass_start(pass_final());
         global_offset_changed = 0;
+        relax_pass_start();
 
         /* Suppress ERR_PASS2 unless we are actually in the final pass */
         erropt.never = 0;
@@ -1813,12 +2004,16 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
         if (pass_first())
             location.known = true;
         ofmt->reset();
+        section_cache_free();
         switch_segment(ofmt->section(NULL, &globl.bits));
-        pp_reset(fname, PP_NORMAL, depend_list);
+
+        pass_cache_start();
+        if (!cache_replaying)
+            pp_reset(fname, PP_NORMAL, depend_list);
 
         globallineno = 0;
 
-        while ((line = pp_getline())) {
+        while ((line = pass_getline(&scanned))) {
             if (++globallineno > nasm_limit[LIMIT_LINES])
                 nasm_fatal("overall line count exceeds the maximum %"PRId64"\n",
                            nasm_limit[LIMIT_LINES]);
@@ -1831,16 +2026,17 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
                 goto end_of_line; /* Just do final cleanup */
 
             /* Not a directive, or even something that starts with [ */
-            parse_line(line, &output_ins, globl.bits);
+            parse_line(line, scanned, &output_ins, globl.bits);
             forward_refs(&output_ins);
             process_insn(&output_ins);
             cleanup_insn(&output_ins);
 
         end_of_line:
-            nasm_free(line);
-        }                       /* end while (line = pp_getline... */
+            pass_freeline(line, scanned);
+        }                       /* end while (line = pass_getline... */
 
-        pp_cleanup_pass();
+        pass_cache_end();
+        relax_pass_end();
 
         if (global_offset_changed) {
             switch (pass_type()) {
@@ -1889,6 +2085,11 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
         error_pass_end();
     }
 
+    pass_cache_free();
+    insn_cache_free();
+    section_cache_free();
+    relax_free();
+
     print_final_report(terminate_after_phase());
 
     lfmt->cleanup();
@@ -2205,6 +2406,14 @@ static void help(FILE *out, const char *what)
             "    --lprefix str  prepend the given string to local symbols\n"
             "    --lpostfix str append the given string to local symbols\n"
             "    --reproducible attempt to produce run-to-run identical output\n"
+            "    --pass-cache   reuse the preprocessed source of the first pass\n"
+            "                   for the optimization passes when possible\n"
+            "    --macro-cache dir\n"
+            "                   save the macro definitions of %include files in\n"
+            "                   dir, and reuse them instead of reading the files\n"
+            "    --batch file   assemble each line of file as a separate job, using\n"
+            "                   the rest of the command line as common options\n"
+            "    -j n           with --batch, run up to n jobs at a time (also --jobs)\n"
             , out);
     }
     if (help_is(with, HW_LIMIT)) {
@@ -710,7 +710,8 @@ static inline opflags_t set_imm_flags(struct operand *op, enum optimization opt)
     return op->type;
 }
 
-insn *parse_line(char *buffer, insn *result, const int bits)
+insn *parse_line(char *buffer, const struct scanline *scanned,
+                 insn *result, const int bits)
 {
     bool insn_is_label = false;
     struct eval_hints hints;
@@ -729,7 +730,7 @@ restart_parse:
     first               = true;
     colonless_label     = false;
 
-    stdscan_reset(buffer);
+    stdscan_reset_line(buffer, scanned);
     i = stdscan(NULL, &tokval);
 
     nasm_zero(*result);
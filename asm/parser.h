@@ -9,7 +9,8 @@
 #ifndef NASM_PARSER_H
 #define NASM_PARSER_H
 
-insn *parse_line(char *buffer, insn *result, const int bits);
+insn *parse_line(char *buffer, const struct scanline *scanned,
+                 insn *result, const int bits);
 void cleanup_insn(insn *instruction);
 
 #endif
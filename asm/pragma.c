@@ -202,6 +202,9 @@ void process_pragma(char *str)
 
     nasm_zero(pragma);
 
+    /* A backend pragma may change what its section names mean */
+    section_cache_free();
+
     pragma.facility_name = nasm_get_word(str, &p);
     if (!pragma.facility_name) {
         /* Empty %pragma */
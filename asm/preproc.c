@@ -32,6 +32,10 @@
 
 #include "compiler.h"
 
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
 #include "nctype.h"
 
 #include "nasm.h"
@@ -47,10 +51,15 @@
 #include "tables.h"
 #include "listing.h"
 #include "dbginfo.h"
+#include "saa.h"
+#include "md5.h"
+#include "ver.h"
 
 /*
  * This is a very slow option, but it can catch some
- * serious problems...
+ * serious problems...  It is separate from DEBUG_TOKENS since it
+ * scans every multi-line macro at each line boundary, which makes
+ * the leak check too slow to run over the test suite.
  */
 #ifndef DEBUG_MMACRO_REFCOUNTS
 # define DEBUG_MMACRO_REFCOUNTS 0
@@ -173,13 +182,14 @@ static bool is_smac_param(enum token_type toktype)
  * It still not something that should happen.
  */
 #define INLINE_TEXT (7*sizeof(char *)-sizeof(enum token_type) \
-                     -sizeof(unsigned int)-1)
+                     -sizeof(unsigned int)-sizeof(uint64_t)-1)
 #define MAX_TEXT (INT_MAX >> 2)
 
 struct Token {
     Token *next;
     unsigned int len;
     enum token_type type;
+    uint64_t hash;              /* Text hash for macro lookup, see tok_hash() */
     union {
         char a[INLINE_TEXT+1];
         struct {
@@ -243,6 +253,7 @@ struct SMacro {
     bool varadic;               /* greedy or supports > nparam arguments */
     bool casesense;
     bool alias;                 /* This is an alias macro */
+    struct smac_memo *memo;     /* Cached expansion, see smac_memo_use() */
 };
 
 /*
@@ -307,6 +318,8 @@ struct MMacro {
     Token **defaults;           /* Parameter default pointers */
     int ndefs;                  /* number of default parameters */
     Line *expansion;
+    struct mbody_line *body;    /* expansion in order, see compile_mmacro_body() */
+    size_t nbody;
 
     struct mstk mstk;           /* Macro expansion stack */
     struct mstk dstk;           /* Macro definitions stack */
@@ -427,6 +440,7 @@ static inline const char *tok_text(const struct Token *t)
  */
 static inline char *tok_text_buf(struct Token *t)
 {
+    t->hash = 0;
     return (t->len <= INLINE_TEXT) ? t->text.a : t->text.p.ptr;
 }
 
@@ -438,6 +452,20 @@ static inline unsigned int tok_check_len(size_t len)
     return len;
 }
 
+/*
+ * The case-insensitive hash of the token text, as hash_findi() would
+ * compute it. It is computed on first use and travels with the token
+ * through dup_Token(), so identifiers rescanned after each macro
+ * expansion are not hashed again. Zero means not yet computed;
+ * anything which changes the text must reset it.
+ */
+static inline uint64_t tok_hash(struct Token *t)
+{
+    if (unlikely(!t->hash))
+        t->hash = hash_keyi(tok_text(t), t->len + 1);
+    return t->hash;
+}
+
 static inline bool tok_text_match(const struct Token *a, const struct Token *b)
 {
     return a->len == b->len && !memcmp(tok_text(a), tok_text(b), a->len);
@@ -468,6 +496,7 @@ static Token *set_text(struct Token *t, const char *text, size_t len)
 
     nasm_zero(t->text);
 
+    t->hash = 0;
     t->len = len = tok_check_len(len);
     textp = (len > INLINE_TEXT)
 	? (t->text.p.ptr = nasm_malloc(len+1)) : t->text.a;
@@ -489,6 +518,7 @@ static Token *set_text_free(struct Token *t, char *text, unsigned int len)
 
     nasm_zero(t->text);
 
+    t->hash = 0;
     t->len = len = tok_check_len(len);
     if (len > INLINE_TEXT) {
 	textp = t->text.p.ptr = text;
@@ -546,6 +576,18 @@ struct Line {
     Token *first;
     struct src_location where;      /* Where defined */
     bool suppressed;
+    MMacro *replay;                 /* Body lines still to be expanded */
+    size_t pos;                     /* Next line in replay->body */
+};
+
+/*
+ * One line of a compiled macro body. "params" is set if the line
+ * contains any token which expand_mmac_params() would substitute;
+ * lines without it are passed through untouched.
+ */
+struct mbody_line {
+    const Line *line;
+    bool params;
 };
 
 /*
@@ -561,9 +603,9 @@ struct Include {
     Cond *conds;
     Line *expansion;
     FILE *fp;
-    unsigned char *data;        /* Data preloaded */
-    size_t datasz;              /* Total preloaded data */
-    size_t datapos;             /* Index into preloaded data buffer */
+    unsigned char *data;        /* Read buffer for fp */
+    size_t datasz;              /* Valid data in the read buffer */
+    size_t datapos;             /* Index into the read buffer */
     uint64_t nolist;            /* Listing inhibit counter */
     uint64_t noline;            /* Line number update inhibit counter */
     struct mstk mstk;
@@ -591,6 +633,46 @@ struct deadman {
 
 static struct deadman smacro_deadman, mmacro_deadman;
 
+/*
+ * Cache of the complete expansion of parameterless smacros, for
+ * macros expanded at the top level of a line. The expansion depends
+ * only on the definitions of the names looked up while expanding it;
+ * each of those names has a stamp recording the generation of the
+ * last change to its definition, and smac_gen counts all changes.
+ */
+struct smac_stamp {
+    uint64_t gen;               /* Generation of the last change */
+};
+
+struct smac_memo {
+    uint64_t gen;               /* Known to be valid at this generation */
+    bool impure;                /* The expansion can't be cached */
+    Token *expansion;           /* Fully expanded body */
+    int64_t calls;              /* Nested macro lookups while expanding */
+    int64_t levels;             /* Maximum nesting while expanding */
+    uint64_t work;              /* Tokens processed while expanding */
+    size_t ndeps;
+    struct smac_stamp **deps;   /* Names looked up while expanding */
+};
+
+static struct hash_table smac_stamps;
+static uint64_t smac_gen;       /* Any smacro definition changed */
+static uint64_t smac_flush;     /* All cached expansions invalid */
+static int smac_nesting;        /* Depth of smacro expansion */
+
+/* State while filling a cache entry */
+static struct smac_fill {
+    bool active;
+    bool impure;
+    int64_t calls;
+    int64_t levels;             /* Lowest smacro_deadman.levels */
+    uint64_t work;
+    size_t ndeps, maxdeps;
+    struct smac_stamp **deps;
+} smac_fill;
+
+struct pp_smacro_stats pp_smacro_stats;
+
 /*
  * Conditional assembly: we maintain a separate stack of these for
  * each level of file inclusion. (The only reason we keep the
@@ -686,6 +768,13 @@ static Line *predef = NULL;
 static bool do_predef;
 static enum preproc_mode pp_mode;
 
+/*
+ * Set if an expression evaluated during this pass referenced a label
+ * or the current location; the output of such a pass cannot be
+ * assumed to be the same in the next pass.
+ */
+static bool pass_dependent;
+
 static uint64_t nested_mac_count;
 static uint64_t nested_rep_count;
 
@@ -738,6 +827,10 @@ static const struct use_package *
 get_use_pkg(Token *t, const char *dname, const char **name);
 static void mark_smac_params(Token *tline, const SMacro *tmpl,
                              enum token_type type);
+struct file_hash_entry;
+static bool mcache_include(Include *inc, const char *name,
+                           const struct file_hash_entry *fhe);
+static void mcache_abort(void);
 
 /* Safe extraction of token type */
 static inline enum token_type tok_type(const Token *x)
@@ -831,6 +924,7 @@ static const char *unquote_token_anystr(Token *t, uint32_t badctl, char qstart)
 
     olen = t->len;
     p = (olen > INLINE_TEXT) ? t->text.p.ptr : t->text.a;
+    t->hash = 0;
     t->len = nlen = nasm_unquote_anystr(p, NULL, badctl, qstart);
     t->type = TOKEN_INTERNAL_STR;
 
@@ -982,6 +1076,7 @@ static void do_delete_tlist(Token **listp)
 static void free_line(Line *l)
 {
     put_mmacro(&l->finishes);
+    put_mmacro(&l->replay);
     free_tlist(l->first);
     nasm_free(l);
 }
@@ -1145,6 +1240,9 @@ static MMacro *new_mmacro(void)
  */
 static void clear_mmacro(MMacro *m)
 {
+    /* params[0] is a private copy of a captured label, if any */
+    if (m->params)
+        delete_Token(m->params[0]);
     nasm_delete(m->params);
     nasm_delete(m->iname);
     nasm_delete(m->paramlen);
@@ -1159,11 +1257,16 @@ static void free_mmacro(MMacro *m)
     nasm_assert(m->refcnt == 0);
 
     clear_mmacro(m);
-#if !DEBUG_MMACRO_REFCOUNTS
     free_tlist(m->dlist);
+    m->dlist = NULL;
     /* The actual tokens in m->defaults freed by freeing m->dlist */
     nasm_delete(m->defaults);
     free_llist(m->expansion);
+    m->expansion = NULL;
+    nasm_delete(m->body);
+#if DEBUG_MMACRO_REFCOUNTS
+    /* Keep the MMacro itself to catch dangling references */
+#else
     m->next = NULL;
     nasm_delete(m->name);
     nasm_free(m);
@@ -1208,6 +1311,11 @@ static void free_smacro_members(SMacro *s)
     }
     nasm_free(s->name);
     delete_tlist(s->expansion);
+    if (s->memo) {
+        delete_tlist(s->memo->expansion);
+        nasm_free(s->memo->deps);
+        nasm_free(s->memo);
+    }
 }
 
 static void clear_smacro(SMacro *s)
@@ -1238,12 +1346,70 @@ enum clear_what {
     CLEAR_ALL       = CLEAR_ALLDEFINE|CLEAR_MMACRO
 };
 
+/*
+ * Bloom filters over the names in the global smacro and mmacro
+ * tables. Most identifiers the preprocessor looks at (instructions,
+ * registers, labels) are not macros at all, and the filter answers
+ * that without probing the hash table. Names are added as they are
+ * entered in the table and never removed; the filter is rebuilt
+ * when the table is cleared or replaced.
+ */
+#define MACRO_BLOOM_BITS 15
+struct macro_bloom {
+    uint64_t bits[(1 << MACRO_BLOOM_BITS) / 64];
+};
+static struct macro_bloom smac_bloom, mmac_bloom;
+
+static inline struct macro_bloom *macro_bloom_for(const struct hash_table *tbl)
+{
+    if (tbl == &smacros)
+        return &smac_bloom;
+    else if (tbl == &mmacros)
+        return &mmac_bloom;
+    else
+        return NULL;
+}
+
+static inline void macro_bloom_add(struct macro_bloom *b, uint64_t hash)
+{
+    const unsigned int mask = (1U << MACRO_BLOOM_BITS) - 1;
+    const unsigned int h1 = hash & mask;
+    const unsigned int h2 = (hash >> 32) & mask;
+
+    b->bits[h1 >> 6] |= UINT64_C(1) << (h1 & 63);
+    b->bits[h2 >> 6] |= UINT64_C(1) << (h2 & 63);
+}
+
+static inline bool macro_bloom_test(const struct macro_bloom *b, uint64_t hash)
+{
+    const unsigned int mask = (1U << MACRO_BLOOM_BITS) - 1;
+    const unsigned int h1 = hash & mask;
+    const unsigned int h2 = (hash >> 32) & mask;
+
+    return (b->bits[h1 >> 6] >> (h1 & 63)) &
+        (b->bits[h2 >> 6] >> (h2 & 63)) & 1;
+}
+
+static void macro_bloom_rebuild(const struct hash_table *tbl)
+{
+    struct macro_bloom *b = macro_bloom_for(tbl);
+    struct hash_iterator it;
+    const struct hash_node *np;
+
+    nasm_zero(*b);
+    hash_for_each(tbl, it, np)
+        macro_bloom_add(b, np->hash);
+}
+
 static void clear_smacro_table(struct hash_table *smt, enum clear_what what)
 {
     struct hash_iterator it;
     const struct hash_node *np;
     bool empty = true;
 
+    if (smt == &smacros)
+        smac_flush = ++smac_gen;
+
     /*
      * Walk the hash table and clear out anything we don't want
      */
@@ -1269,6 +1435,26 @@ static void clear_smacro_table(struct hash_table *smt, enum clear_what what)
      */
     if (empty)
         hash_free_all(smt, true);
+
+    if (smt == &smacros)
+        macro_bloom_rebuild(smt);
+}
+
+/*
+ * Record a change to the definition of an smacro, for the expansion
+ * cache. Context-local macros are never cached.
+ */
+static void smac_changed(const Context *ctx, const char *mname)
+{
+    struct smac_stamp **sp;
+
+    if (ctx)
+        return;
+
+    smac_gen++;
+    sp = (struct smac_stamp **)hash_findi(&smac_stamps, mname, NULL);
+    if (sp)
+        (*sp)->gen = smac_gen;
 }
 
 static void free_smacro_table(struct hash_table *smt)
@@ -1287,6 +1473,9 @@ static void free_mmacro_table(struct hash_table *mmt)
         free_mmacro_list(&m);
     }
     hash_free(mmt);
+
+    if (mmt == &mmacros)
+        macro_bloom_rebuild(mmt);
 }
 
 static void free_macros(void)
@@ -1318,6 +1507,7 @@ static void **
 hash_findi_add(struct hash_table *hash, const char *str)
 {
     struct hash_insert hi;
+    struct macro_bloom *bloom;
     void **r;
     char *strx;
     size_t l = strlen(str) + 1;
@@ -1326,6 +1516,10 @@ hash_findi_add(struct hash_table *hash, const char *str)
     if (r)
         return r;
 
+    bloom = macro_bloom_for(hash);
+    if (bloom)
+        macro_bloom_add(bloom, hi.node.hash);
+
     strx = nasm_malloc(l);  /* Use a more efficient allocator here? */
     memcpy(strx, str, l);
     return hash_add(&hi, strx, NULL);
@@ -1345,6 +1539,23 @@ hash_findix(struct hash_table *hash, const char *str)
     return p ? *p : NULL;
 }
 
+/*
+ * Look up the macro named by an identifier token in the global smacro
+ * or mmacro table, using the hash cached in the token and the Bloom
+ * filter for the table.
+ */
+static void *macro_find(struct hash_table *tbl, Token *t)
+{
+    const uint64_t hash = tok_hash(t);
+    void **p;
+
+    if (!macro_bloom_test(macro_bloom_for(tbl), hash))
+        return NULL;
+
+    p = hash_findibh(tbl, tok_text(t), t->len + 1, hash, NULL);
+    return p ? *p : NULL;
+}
+
 static void inject_predefs(void)
 {
     Line *pd, *l;
@@ -1383,7 +1594,29 @@ static uint64_t get_uleb128(const char **pp)
     return v;
 }
 
-static char *line_from_stdmac(void)
+/*
+ * Lines handed out by read_line() live in this buffer, and are valid
+ * until the next call.
+ */
+static char *linebuf;
+static size_t linebufsize;
+
+/* Make sure the line buffer can hold at least size bytes */
+static inline char *linebuf_reserve(size_t size)
+{
+    if (unlikely(size > linebufsize)) {
+        size_t newsize = linebufsize ? linebufsize : BUFSIZ;
+
+        while (newsize < size)
+            newsize <<= 1;
+
+        linebuf = nasm_realloc(linebuf, newsize);
+        linebufsize = newsize;
+    }
+    return linebuf;
+}
+
+static const char *line_from_stdmac(void)
 {
     static const char *stdmacpos = NULL;
     static char *stdmacbuf = NULL;
@@ -1412,7 +1645,7 @@ static char *line_from_stdmac(void)
     /* Length encoded using uleb128 encoding */
     len = get_uleb128(&stdmacpos);
 
-    line = nasm_malloc(len + 1);
+    line = linebuf_reserve(len + 1);
     memcpy(line, stdmacpos, len);
     line[len] = '\0';
     stdmacpos += len;
@@ -1420,41 +1653,105 @@ static char *line_from_stdmac(void)
     return line;
 }
 
+#define INCLUDE_BUFSIZ  65536
+
+/*
+ * Refill the read buffer of an include file. Returns false at end of file.
+ */
+static bool include_fill(Include *inc)
+{
+    if (!inc->data)
+        inc->data = nasm_malloc(INCLUDE_BUFSIZ);
+
+    inc->datapos = 0;
+    inc->datasz  = fread(inc->data, 1, INCLUDE_BUFSIZ, inc->fp);
+    return inc->datasz != 0;
+}
+
+static inline int include_getc(Include *inc)
+{
+    if (inc->datapos >= inc->datasz && !include_fill(inc))
+        return EOF;
+    return inc->data[inc->datapos++];
+}
+
+static inline int include_peekc(Include *inc)
+{
+    if (inc->datapos >= inc->datasz && !include_fill(inc))
+        return EOF;
+    return inc->data[inc->datapos];
+}
+
+/*
+ * Return the length of the run of ordinary characters at the start
+ * of the buffer, i.e. up to the first character which needs special
+ * handling in line_from_file().
+ */
+static size_t plain_span(const unsigned char *p, size_t len)
+{
+    /* Includes the terminating '\0', which also ends a line */
+    static const char specials[] = "\r\\\032";
+    const unsigned char *q;
+    size_t i;
+
+    /* Most lines end in a newline; don't scan past it */
+    q = memchr(p, '\n', len);
+    if (q)
+        len = q - p;
+
+    for (i = 0; i < sizeof specials; i++) {
+        q = memchr(p, specials[i], len);
+        if (q)
+            len = q - p;
+    }
+
+    return len;
+}
+
 /*
- * Read a line from the a file. Return NULL on end of file.
+ * Read a line from the current include file. Return NULL on end of file.
+ *
+ * Lines end with LF, CR or CR LF; ^Z and NUL also end a line. A
+ * backslash immediately before a line ending joins the next line to
+ * this one.
  */
-static char *line_from_file(FILE *f)
+static const char *line_from_file(Include *inc)
 {
-    int c;
-    unsigned int size, next;
-    const unsigned int delta = BUFSIZ;
-    const unsigned int pad = 8;
+    int c, next;
+    size_t len = 0;
     bool cont = false;
-    char *buffer, *p;
+    char *line;
 
-    istk->where.lineno += istk->lineskip + istk->lineinc;
-    src_set_linnum(istk->where.lineno);
-    istk->lineskip = 0;
+    inc->where.lineno += inc->lineskip + inc->lineinc;
+    src_set_linnum(inc->where.lineno);
+    inc->lineskip = 0;
 
-    size = delta;
-    p = buffer = nasm_malloc(size);
+    while (true) {
+        size_t n = inc->datasz - inc->datapos;
+
+        if (n)
+            n = plain_span(inc->data + inc->datapos, n);
+        if (n) {
+            line = linebuf_reserve(len + n + 1);
+            memcpy(line + len, inc->data + inc->datapos, n);
+            len += n;
+            inc->datapos += n;
+            cont = false;
+            continue;
+        }
 
-    do {
-        c = fgetc(f);
+        c = include_getc(inc);
 
         switch (c) {
         case EOF:
-            if (p == buffer) {
-                nasm_free(buffer);
+            if (!len)
                 return NULL;
-            }
             c = 0;
             break;
 
         case '\r':
-            next = fgetc(f);
-            if (next != '\n')
-                ungetc(next, f);
+            if (include_peekc(inc) == '\n')
+                inc->datapos++;
             if (cont) {
                 cont = false;
                 continue;
@@ -1475,38 +1772,32 @@ static char *line_from_file(FILE *f)
             break;
 
         case '\\':
-            next = fgetc(f);
-            ungetc(next, f);
+            next = include_peekc(inc);
             if (next == '\r' || next == '\n') {
                 cont = true;
-                istk->lineskip += istk->lineinc;
+                inc->lineskip += inc->lineinc;
                 continue;
             }
             break;
         }
 
-        if (p >= (buffer + size - pad)) {
-            buffer = nasm_realloc(buffer, size + delta);
-            p = buffer + size - pad;
-            size += delta;
-        }
-
-        *p++ = c;
-    } while (c);
-
-    return buffer;
+        line = linebuf_reserve(len + 1);
+        line[len++] = c;
+        if (!c)
+            return line;
+        cont = false;
+    }
 }
 
 /*
  * Common read routine regardless of source
  */
-static char *read_line(void)
+static const char *read_line(void)
 {
-    char *line;
-    FILE *f = istk->fp;
+    const char *line;
 
-    if (f)
-        line = line_from_file(f);
+    if (istk->fp)
+        line = line_from_file(istk);
     else
         line = line_from_stdmac();
 
@@ -1614,10 +1905,7 @@ static Token *tokenize(const char *line)
             } else if (nasm_isidchar(*p) ||
                        (*p == '%' && nasm_isidchar(p[1]))) {
                 /* Identifier or some sort */
-                do {
-                    p++;
-                }
-                while (nasm_isidchar(*p));
+                p = nasm_skip_idchars(p + 1);
             } else if (*p == '%') {
                 /* %% operator */
                 p++;
@@ -1722,8 +2010,7 @@ static Token *tokenize(const char *line)
              * special to the preprocessor.
              */
             type = TOKEN_ID;
-            while (nasm_isidchar(*++p))
-                ;
+            p = nasm_skip_idchars(p + 1);
          } else if (nasm_isquote(*p)) {
             /*
              * A string token.
@@ -1935,21 +2222,66 @@ static Token *tokenize(const char *line)
 
 /*
  * Tokens are allocated in blocks to improve speed. Set the blocksize
- * to 0 to use regular nasm_malloc(); this is useful for debugging.
+ * to 0 to use regular nasm_malloc(); this is useful for debugging
+ * with external memory checkers.
  *
  * alloc_Token() returns a zero-initialized token structure.
+ *
+ * The blocks are released at the end of each pass if no tokens are
+ * still in use; the only tokens which should survive a pass are the
+ * ones in the predef list. Configuring with --enable-token-debug
+ * poisons freed tokens, checks that they have not been written to
+ * when reused, and checks for leaked tokens at the end of each pass.
  */
-#define TOKEN_BLOCKSIZE 0 /* 4096 */ /* Number of tokens, not bytes */
+#define TOKEN_BLOCKSIZE 4096 /* Number of tokens, not bytes */
+
+static size_t tokens_live;      /* Tokens currently allocated */
 
 #if TOKEN_BLOCKSIZE
 
 static Token *freeTokens  = NULL;
 static Token *tokenblocks = NULL;
 
+#ifdef DEBUG_TOKENS
+# define TOKEN_POISON 0xdf
+
+/* Poison everything except the next pointer and the type */
+static void poison_Token(Token *t)
+{
+    memset(&t->len, TOKEN_POISON, sizeof t->len);
+    memset(&t->text, TOKEN_POISON, sizeof t->text);
+}
+
+static void check_poison_Token(const Token *t)
+{
+    const unsigned char *p = (const unsigned char *)&t->text;
+    size_t i;
+
+    if (t->type != TOKEN_FREE)
+        nasm_panic("token %p on the free list is not free", (const void *)t);
+
+    for (i = 0; i < sizeof t->text; i++) {
+        if (p[i] != TOKEN_POISON)
+            nasm_panic("free token %p was modified", (const void *)t);
+    }
+}
+#else
+static inline void poison_Token(Token *t)
+{
+    (void)t;
+}
+static inline void check_poison_Token(const Token *t)
+{
+    (void)t;
+}
+#endif
+
 static Token *alloc_Token(void)
 {
     Token *t = freeTokens;
 
+    tokens_live++;
+
     if (unlikely(!t)) {
         Token *block;
         size_t i;
@@ -1967,8 +2299,11 @@ static Token *alloc_Token(void)
         /*
          * Add the rest to the free list
          */
-        for (i = 2; i < TOKEN_BLOCKSIZE - 1; i++)
-            block[i].next = &block[i+1];
+        for (i = 2; i < TOKEN_BLOCKSIZE; i++) {
+            block[i].next = (i < TOKEN_BLOCKSIZE - 1) ? &block[i+1] : NULL;
+            block[i].type = TOKEN_FREE;
+            poison_Token(&block[i]);
+        }
 
         freeTokens = &block[2];
 
@@ -1978,8 +2313,9 @@ static Token *alloc_Token(void)
         return &block[1];
     }
 
+    check_poison_Token(t);
     freeTokens = t->next;
-    t->next = NULL;
+    nasm_zero(*t);
     return t;
 }
 
@@ -1990,13 +2326,15 @@ static Token *free_Token(Token *t)
     nasm_assert(t);
     nasm_assert(t->type != TOKEN_FREE);
 
+    tokens_live--;
+
     next = t->next;
     if (t->len > INLINE_TEXT)
         nasm_free(t->text.p.ptr);
 
-    nasm_zero(*t);
     t->type = TOKEN_FREE;
     t->next = freeTokens;
+    poison_Token(t);
     freeTokens = t;
 
     return next;
@@ -2017,6 +2355,7 @@ static void free_Blocks(void)
 static inline Token *alloc_Token(void)
 {
     Token *t;
+    tokens_live++;
     nasm_new(t);
     return t;
 }
@@ -2024,6 +2363,7 @@ static inline Token *alloc_Token(void)
 static Token *free_Token(Token *t)
 {
     Token *next = t->next;
+    tokens_live--;
     if (t->len > INLINE_TEXT)
         nasm_free(t->text.p.ptr);
     nasm_free(t);
@@ -2037,6 +2377,31 @@ static inline void free_Blocks(void)
 
 #endif
 
+/*
+ * At the end of a pass, the only tokens left should be the ones in the
+ * predef list. If there are none, return the token blocks to the system.
+ */
+static void cleanup_Tokens(void)
+{
+#ifdef DEBUG_TOKENS
+    size_t predef_tokens = 0;
+    const Line *l;
+    const Token *t;
+
+    list_for_each(l, predef) {
+        list_for_each(t, l->first)
+            predef_tokens++;
+    }
+
+    if (tokens_live != predef_tokens)
+        nasm_panic("%"PRIzu" tokens leaked during this pass",
+                   tokens_live - predef_tokens);
+#endif
+
+    if (!tokens_live)
+        free_Blocks();
+}
+
 static Token *do_delete_Token(Token **tp)
 {
     if (tp && *tp)
@@ -2251,6 +2616,96 @@ static char *detoken(Token * tlist, bool expand_locals)
     return line;
 }
 
+/*
+ * Can a token of this type be handed to the parser as it is? Braces
+ * span several tokens for the assembler, and the preprocessor-only
+ * token types (and strings that aren't quoted) may scan differently.
+ */
+static bool scan_token_ok(enum token_type type)
+{
+    switch (type) {
+    case TOKEN_ID:
+    case TOKEN_NUM:
+    case TOKEN_FLOAT:
+    case TOKEN_STR:
+    case TOKEN_HERE:
+    case TOKEN_BASE:
+        return true;
+    case '{':
+        return false;
+    default:
+        return type > TOKEN_WHITESPACE && type < TOKEN_MAX_OPERATOR;
+    }
+}
+
+/*
+ * Would the standard scanner see a single token where the
+ * preprocessor has two adjacent ones, e.g. after token pasting or
+ * from macro expansion?
+ */
+static bool scan_tokens_merge(const Token *a, const Token *b)
+{
+    static const char opchars[] = "<>=!&|^/%";
+    char ac = tok_text(a)[a->len - 1];
+    char bc = tok_text(b)[0];
+
+    if (nasm_isidchar(ac) && nasm_isidchar(bc))
+        return true;
+    if ((a->type == TOKEN_NUM || a->type == TOKEN_FLOAT) &&
+        (bc == '+' || bc == '-'))
+        return true;            /* 1e+5, 0x1p-3 */
+    return strchr(opchars, ac) && strchr(opchars, bc);
+}
+
+/*
+ * Split a detokenized line into tokens for the parser. Returns NULL
+ * if the line needs to be scanned from its text: directives, which
+ * are processed as text anyway, and lines with tokens the parser
+ * would scan differently.
+ */
+static struct scanline *scan_tline(const Token *tline, char *line)
+{
+    const Token *t, *prev;
+    struct scanline *sl;
+    struct tokenval *tv;
+    size_t ntokens, nbytes;
+    char *p, *buf;
+
+    ntokens = nbytes = 0;
+    prev = NULL;
+    list_for_each(t, tline) {
+        if (t->type == TOKEN_WHITESPACE || !t->len) {
+            prev = NULL;
+            continue;
+        }
+        if (!scan_token_ok(t->type) || (prev && scan_tokens_merge(prev, t)))
+            return NULL;
+        if (!ntokens && t->type == '[')
+            return NULL;
+        ntokens++;
+        if (nasm_isidstart(*tok_text(t)))
+            nbytes += t->len + 1; /* See stdscan_prescan() */
+        prev = t;
+    }
+
+    if (!ntokens)
+        return NULL;
+
+    sl = nasm_malloc(sizeof(*sl) + ntokens * sizeof(*tv) + nbytes);
+    sl->ntokens = ntokens;
+    sl->tokens = tv = (struct tokenval *)(sl + 1);
+    buf = (char *)(tv + ntokens);
+
+    p = line;
+    list_for_each(t, tline) {
+        if (t->type != TOKEN_WHITESPACE && t->len)
+            buf += stdscan_prescan(tv++, p, t->len, buf);
+        p += t->len;
+    }
+
+    return sl;
+}
+
 /*
  * A scanner, suitable for use by the expression evaluator, which
  * operates on a line of Tokens. Expects a pointer to a pointer to
@@ -2294,12 +2749,21 @@ static int ppscan(void *private_data, struct tokenval *tokval)
         if (txt[0] == '$') {
             /* Escaped symbol */
             tokval->t_charptr++;
+            pass_dependent = true;
         } else {
             /* This could be an assembler keyword */
-            return nasm_token_hash(txt, tokval);
+            int type = nasm_token_hash(txt, tokval);
+            if (type == TOKEN_ID)
+                pass_dependent = true; /* A symbol reference */
+            return type;
         }
         break;
 
+    case TOKEN_HERE:
+    case TOKEN_BASE:
+        pass_dependent = true;
+        break;
+
     case TOKEN_NUM:
     {
         bool rn_error;
@@ -3209,8 +3673,10 @@ iftype:
 	pps.ntokens = -1;
         tokval.t_type = TOKEN_INVALID;
         evalresult = evaluate(ppscan, &pps, &tokval, NULL, true, NULL);
-        if (!evalresult)
+        if (!evalresult) {
+            delete_tlist(origline);
             return -1;
+        }
         if (tokval.t_type) {
             nasm_warn(WARN_PP_TRAILING, "trailing garbage after expression ignored");
         }
@@ -3643,6 +4109,7 @@ static SMacro *define_smacro(const char *mname, bool casesense,
         smac->next = *smhead;
         *smhead = smac;
     }
+    smac_changed(ctx, mname);
 
     smac->name       = nasm_strdup(mname);
     smac->casesense  = casesense;
@@ -3723,6 +4190,7 @@ static void undef_smacro(const char *mname, bool undefalias)
                                         ctx, s);
                     *sp = s->next;
                     free_smacro(s);
+                    smac_changed(ctx, mname);
                     continue;
                 }
             }
@@ -4295,7 +4763,7 @@ static void user_error(enum preproc_token op, Token **tlinep)
         panic();
     }
 
-    *tlinep = tline = expand_smacro(skip_white(*tlinep));
+    *tlinep = tline = expand_smacro(zap_white(*tlinep));
     t = skip_tok_white(tline);
 
     if (tok_is(tline, TOKEN_STR) && !t) {
@@ -4501,6 +4969,8 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
                 tline = t;
                 *output = tline;
             }
+        } else {
+            delete_tlist(tline);
         }
         break;
 
@@ -4757,6 +5227,10 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
         if (!t)
             goto done;
 
+        /* Nested %require depends on what was included before */
+        if (op == PP_REQUIRE)
+            mcache_abort();
+
         nasm_new(inc);
         inc->next = istk;
         p = tok_text(t);
@@ -4767,6 +5241,10 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
         if (!inc->fp) {
             /* -MG given but file not found, or repeated %require */
             nasm_free(inc);
+        } else if (mcache_include(inc, p, fhe)) {
+            /* Macro definitions loaded from the macro cache */
+            fclose(inc->fp);
+            nasm_free(inc);
         } else {
             inc->nolist  = istk->nolist;
             inc->noline  = istk->noline;
@@ -5074,7 +5552,10 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
                 mmac->nparam_min == spec.nparam_min &&
                 mmac->nparam_max == spec.nparam_max &&
                 mmac->plus == spec.plus) {
+                /* The list slot's reference moves to mmac->next */
                 *mmac_p = mmac->next;
+                mmac->next = NULL;
+                put_mmacro(&mmac);
             } else {
                 mmac_p = &mmac->next;
             }
@@ -5087,9 +5568,8 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
         while (tok_white(tline->next))
             tline = tline->next;
         if (!tline->next) {
-            delete_tlist(origline);
             nasm_nonfatal("`%s' missing rotate count", dname);
-            return DIRECTIVE_FOUND;
+            goto done;
         }
         t = expand_smacro(tline->next);
         tline->next = NULL;
@@ -5100,14 +5580,14 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
             evaluate(ppscan, &pps, &tokval, NULL, true, NULL);
         delete_tlist(tline);
         if (!evalresult)
-            return DIRECTIVE_FOUND;
+            goto done;
         if (tokval.t_type) {
             nasm_warn(WARN_PP_TRAILING,
                       "trailing garbage after expression ignored");
         }
         if (!is_simple(evalresult)) {
             nasm_nonfatal("non-constant value given to `%s'", dname);
-            return DIRECTIVE_FOUND;
+            goto done;
         }
         mmac = istk->mstk.mmac;
         if (!mmac) {
@@ -5313,6 +5793,7 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
          * and store an SMacro.
          */
         define_smacro(mname, casesense, macro_start, NULL);
+        delete_tlist(tline);
         break;
 
     case PP_DEFTOK:
@@ -5433,6 +5914,7 @@ static int do_directive(Token *tline, Token **output, bool suppressed)
         tline = tline->next;
         tline = expand_smacro(tline);
         ppconf.noaliases = !pp_get_boolean_option(tline, !ppconf.noaliases);
+        smac_flush = ++smac_gen;
         break;
 
     case PP_LINE:
@@ -6031,6 +6513,7 @@ expand_smacro_with_params(SMacro *m, Token *mstart, Token **params,
 
     /* Expand the macro */
     m->in_progress++;
+    smac_nesting++;
 
     /*
      * Postprocessing of of parameters. Note that the ordering matters
@@ -6106,9 +6589,12 @@ expand_smacro_with_params(SMacro *m, Token *mstart, Token **params,
         enum token_type type = t->type;
         Token *tnext = t->next;
 
+        smac_fill.work++;
+
         switch (type) {
         case TOKEN_PREPROC_Q:
         case TOKEN_PREPROC_SQ:
+            smac_fill.impure = true; /* Depends on the name as invoked */
             nasm_assert(t != mstart);
             delete_Token(t);
             t = dup_Token(tline, mstart);
@@ -6121,6 +6607,8 @@ expand_smacro_with_params(SMacro *m, Token *mstart, Token **params,
 	    size_t len;
             char *p, *from;
 
+            smac_fill.impure = true;
+
             t->type = mstart->type;
             if (t->type == TOKEN_LOCAL_MACRO) {
 		const char *psp; /* prefix start pointer */
@@ -6146,6 +6634,7 @@ expand_smacro_with_params(SMacro *m, Token *mstart, Token **params,
         }
 
         case TOKEN_COND_COMMA:
+            smac_fill.impure = true;
             delete_Token(t);
             t = cond_comma ? make_tok_char(tline, ',') : NULL;
             break;
@@ -6206,6 +6695,7 @@ expand_smacro_with_params(SMacro *m, Token *mstart, Token **params,
 
     /* Expansion complete */
     m->in_progress--;
+    smac_nesting--;
 
     return tline;
 }
@@ -6404,46 +6894,159 @@ static Token **parse_smacro_args(Token **tp, int *nparamp, const SMacro *m)
 }
 
 /*
- * Expand *one* single-line macro instance. If the first token is not
- * a macro at all, it is simply copied to the output and the pointer
- * advanced.  tpp should be a pointer to a pointer (usually the next
- * pointer of the previous token) to the first token. **tpp is updated
- * to point to the first token of the expansion, and *tpp updated to
- * point to the next pointer of the last token of the expansion.
- *
- * If the expansion is empty, *tpp will be unchanged but **tpp will
- * be advanced past the macro call.
- *
- * Return the macro expanded, or NULL if no expansion took place.
+ * Is the cached expansion of an smacro still valid?
  */
-static SMacro *expand_one_smacro(Token ***tpp)
+static bool smac_memo_valid(struct smac_memo *memo)
 {
-    Token **params = NULL;
-    const char *mname;
-    Token *mstart = **tpp;
-    Token *tline  = mstart;
-    SMacro *head, *m;
-    Token *tafter, **tep;
-    int nparam = 0;
+    size_t i;
 
-    if (!tline)
-        return NULL;            /* Empty line, nothing to do */
+    if (memo->gen == smac_gen)
+        return true;
+    if (memo->gen < smac_flush)
+        return false;
 
-    mname = tok_text(mstart);
+    for (i = 0; i < memo->ndeps; i++) {
+        if (memo->deps[i]->gen > memo->gen)
+            return false;
+    }
 
-    smacro_deadman.total--;
-    smacro_deadman.levels--;
+    memo->gen = smac_gen;
+    return true;
+}
 
-    if (unlikely(smacro_deadman.total < 0 || smacro_deadman.levels < 0)) {
-        if (unlikely(!smacro_deadman.triggered)) {
-            nasm_nonfatal("interminable macro recursion");
-            smacro_deadman.triggered = true;
-        }
-        goto not_a_macro;
+/*
+ * Record a name looked up while filling a cache entry.
+ */
+static void smac_fill_dep(const char *mname)
+{
+    struct smac_stamp **sp;
+
+    sp = (struct smac_stamp **)hash_findi_add(&smac_stamps, mname);
+    if (!*sp)
+        nasm_new(*sp);
+
+    if (smac_fill.ndeps && smac_fill.deps[smac_fill.ndeps-1] == *sp)
+        return;
+
+    if (smac_fill.ndeps >= smac_fill.maxdeps) {
+        smac_fill.maxdeps = smac_fill.maxdeps ? smac_fill.maxdeps << 1 : 16;
+        smac_fill.deps = nasm_realloc(smac_fill.deps, smac_fill.maxdeps *
+                                      sizeof(*smac_fill.deps));
+    }
+    smac_fill.deps[smac_fill.ndeps++] = *sp;
+}
+
+/*
+ * Expand a parameterless smacro at the top level of a line, from
+ * the expansion cache if possible. Returns the expansion as
+ * expand_smacro_with_params() does.
+ */
+static Token *smac_memo_use(SMacro *m, Token *mstart, Token ***epp)
+{
+    struct smac_memo *memo = m->memo;
+    const uint64_t gen = smac_gen;
+    Token *tline, *t;
+
+    if (memo && smac_memo_valid(memo)) {
+        if (memo->impure || smacro_deadman.total < memo->calls ||
+            smacro_deadman.levels < memo->levels)
+            return expand_smacro_with_params(m, mstart, NULL, 0, epp);
+
+        pp_smacro_stats.hits++;
+        pp_smacro_stats.tokens += memo->work;
+        smacro_deadman.total -= memo->calls;
+
+        tline = dup_tlist(memo->expansion, NULL);
+        if (tline) {
+            list_last(t, tline);
+            *epp = &t->next;
+        }
+        return tline;
+    }
+
+    smac_fill.active = true;
+    smac_fill.impure = false;
+    smac_fill.calls  = 0;
+    smac_fill.levels = smacro_deadman.levels;
+    smac_fill.work   = 0;
+    smac_fill.ndeps  = 0;
+
+    tline = expand_smacro_with_params(m, mstart, NULL, 0, epp);
+
+    smac_fill.active = false;
+
+    if (memo) {
+        delete_tlist(memo->expansion);
+        nasm_free(memo->deps);
+    } else {
+        nasm_new(memo);
+        m->memo = memo;
+    }
+
+    memo->gen    = smac_gen;
+    memo->impure = smac_fill.impure || smac_gen != gen;
+    memo->expansion = memo->impure ? NULL : dup_tlist(tline, NULL);
+    memo->calls  = smac_fill.calls;
+    memo->levels = smacro_deadman.levels - smac_fill.levels;
+    memo->work   = smac_fill.work;
+    memo->ndeps  = smac_fill.ndeps;
+    nasm_newn(memo->deps, memo->ndeps);
+    memcpy(memo->deps, smac_fill.deps, memo->ndeps * sizeof(*memo->deps));
+
+    return tline;
+}
+
+/*
+ * Expand *one* single-line macro instance. If the first token is not
+ * a macro at all, it is simply copied to the output and the pointer
+ * advanced.  tpp should be a pointer to a pointer (usually the next
+ * pointer of the previous token) to the first token. **tpp is updated
+ * to point to the first token of the expansion, and *tpp updated to
+ * point to the next pointer of the last token of the expansion.
+ *
+ * If the expansion is empty, *tpp will be unchanged but **tpp will
+ * be advanced past the macro call.
+ *
+ * Return the macro expanded, or NULL if no expansion took place.
+ */
+static SMacro *expand_one_smacro(Token ***tpp)
+{
+    Token **params = NULL;
+    const char *mname;
+    Token *mstart = **tpp;
+    Token *tline  = mstart;
+    SMacro *head, *m;
+    Token *tafter, **tep;
+    int nparam = 0;
+
+    if (!tline)
+        return NULL;            /* Empty line, nothing to do */
+
+    mname = tok_text(mstart);
+
+    smacro_deadman.total--;
+    smacro_deadman.levels--;
+
+    if (smac_fill.active) {
+        smac_fill.calls++;
+        if (smacro_deadman.levels < smac_fill.levels)
+            smac_fill.levels = smacro_deadman.levels;
+    }
+
+    if (unlikely(smacro_deadman.total < 0 || smacro_deadman.levels < 0)) {
+        if (unlikely(!smacro_deadman.triggered)) {
+            nasm_nonfatal("interminable macro recursion");
+            smacro_deadman.triggered = true;
+        }
+        smac_fill.impure = true;
+        goto not_a_macro;
     } else if (tline->type == TOKEN_ID || tline->type == TOKEN_PREPROC_ID) {
-        head = (SMacro *)hash_findix(&smacros, mname);
+        if (smac_fill.active)
+            smac_fill_dep(mname);
+        head = (SMacro *)macro_find(&smacros, tline);
     } else if (tline->type == TOKEN_LOCAL_MACRO) {
         Context *ctx = get_ctx(mname, &mname);
+        smac_fill.impure = true;
         head = ctx ? (SMacro *)hash_findix(&ctx->localmac, mname) : NULL;
     } else {
         goto not_a_macro;
@@ -6470,6 +7073,9 @@ static SMacro *expand_one_smacro(Token ***tpp)
     params = NULL;
     nparam = 0;
 
+    if (m->expand != smacro_expand_default)
+        smac_fill.impure = true; /* Magic macro or function */
+
     if (m->nparam == 0) {
         /*
          * Simple case: the macro is parameterless.
@@ -6477,6 +7083,7 @@ static SMacro *expand_one_smacro(Token ***tpp)
          * drop the macro name token.
          */
     } else {
+        smac_fill.impure = true;
         /*
          * Complicated case: at least one macro with this name
          * exists and takes parameters. We must find the
@@ -6523,7 +7130,11 @@ static SMacro *expand_one_smacro(Token ***tpp)
 
     tafter = tline->next;   /* Skip past the macro call */
     tline->next = NULL;     /* Truncate mstart list at the macro call end */
-    tline = expand_smacro_with_params(m, mstart, params, nparam, &tep);
+    if (!smac_nesting && !nparam && m->expand == smacro_expand_default &&
+        !m->recursive && !m->alias && mstart->type != TOKEN_LOCAL_MACRO)
+        tline = smac_memo_use(m, mstart, &tep);
+    else
+        tline = expand_smacro_with_params(m, mstart, params, nparam, &tep);
     if (tline) {
         **tpp = tline;
         *tep = tafter;
@@ -6816,7 +7427,7 @@ static MMacro *is_mmacro(Token * tline, int *nparamp, Token ***paramsp)
 
     finding = tok_text(tline);
     empty_args =  !tline->next;
-    head = (MMacro *) hash_findix(&mmacros, finding);
+    head = (MMacro *) macro_find(&mmacros, tline);
 
     /*
      * Efficiency: first we see if any macro exists with the given
@@ -7211,6 +7822,76 @@ static void debug_macro_output(void)
     free_debug_macro_info();
 }
 
+/*
+ * Does this token list contain anything expand_mmac_params() would
+ * touch?
+ */
+static bool tlist_has_mmac_params(const Token *t)
+{
+    list_for_each(t, t) {
+        switch (t->type) {
+        case TOKEN_LOCAL_SYMBOL:
+        case TOKEN_MMACRO_PARAM:
+        case TOKEN_PREPROC_Q:
+        case TOKEN_PREPROC_QQ:
+        case TOKEN_INDIRECT:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+/*
+ * The body of a multi-line macro or %rep block is collected in
+ * reverse order. The first time it is expanded, flatten it into an
+ * array in expansion order and note which lines have parameter
+ * slots, so that each expansion afterwards is a walk down the array
+ * rather than a copy of the whole Line list.
+ */
+static void compile_mmacro_body(MMacro *m)
+{
+    const Line *l;
+    size_t n = 0;
+
+    list_for_each(l, m->expansion)
+        n++;
+
+    if (!n)
+        return;
+
+    nasm_newn(m->body, n);
+    m->nbody = n;
+
+    list_for_each(l, m->expansion) {
+        struct mbody_line *bl = &m->body[--n];
+        bl->line   = l;
+        bl->params = tlist_has_mmac_params(l->first);
+    }
+}
+
+/*
+ * Push the body of a multi-line macro or %rep block on to
+ * istk->expansion. The lines themselves are copied one at a time
+ * as pp_tokline() gets to them.
+ */
+static void push_mmacro_body(MMacro *m)
+{
+    Line *l;
+
+    if (!m->body)
+        compile_mmacro_body(m);
+
+    if (!m->nbody)
+        return;
+
+    nasm_new(l);
+    l->next = istk->expansion;
+    l->replay = get_mmacro(m);
+    istk->expansion = l;
+}
+
 /*
  * Expand the multi-line macro call made by the given line, if
  * there is one to be expanded. If there is, push the expansion on
@@ -7223,7 +7904,7 @@ static int expand_mmacro(Token * tline)
     bool dont_prepend = false;
     Token **params, *t, *tt;
     MMacro *m;
-    Line *l, *ll;
+    Line *ll;
     int i, *paramlen;
     const char *mname;
     int nparam = 0;
@@ -7372,13 +8053,7 @@ static int expand_mmacro(Token * tline)
     istk->mstk.mstk = get_mmacro(m);
     istk->mstk.mmac = get_mmacro(m);
 
-    list_for_each(l, m->expansion) {
-        nasm_new(ll);
-        ll->next = istk->expansion;
-        istk->expansion = ll;
-        ll->first = dup_tlist(l->first, NULL);
-        ll->where = l->where;
-    }
+    push_mmacro_body(m);
 
     /*
      * If we had a label, and this macro definition does not include
@@ -7968,6 +8643,7 @@ stdmac_map(const SMacro *s, Token **params, int nparam)
     int tparams;                /* Total number of parameters */
     int greedify;               /* Number of parameters that must be joined */
     Token **fparam;             /* Fixed parameters */
+    int nfp;                    /* Number of entries in fparam[] */
     Token **cparam;             /* Final list of macro call parameters */
 
     t = params[0];
@@ -8038,8 +8714,9 @@ stdmac_map(const SMacro *s, Token **params, int nparam)
         return NULL;            /* Empty expansion */
 
     fparam = NULL;
+    nfp = 0;
     if (fixparams) {
-        int nfp = fixparams;
+        nfp = fixparams;
         fparam = parse_smacro_args(&fixargs, &nfp, smac);
         if (nfp < fixparams) {
             fixparams = nfp;
@@ -8107,6 +8784,8 @@ stdmac_map(const SMacro *s, Token **params, int nparam)
         tline = make_tok_char(tline, ',');
     }
 
+    for (i = 0; i < nfp; i++)
+        delete_tlist(fparam[i]);
     nasm_free(fparam);
     nasm_free(cparam);
 
@@ -8638,125 +9317,1368 @@ static void pp_reset_stdmac(enum preproc_mode mode)
     define_smacro("__?PASS?__", true, make_tok_num(NULL, apass), NULL);
 }
 
-void pp_reset(const char *file, enum preproc_mode mode,
-              struct strlist *dep_list)
-{
-    cstk = NULL;
-    defining = NULL;
-    nested_mac_count = 0;
-    nested_rep_count = 0;
-    unique = 0;
-    deplist = dep_list;
-    pp_mode = mode;
+/*
+ * Macro cache (--macro-cache).
+ *
+ * Including a large macro package can take a substantial part of the
+ * time spent assembling a small file.  If a macro cache directory is
+ * configured, the smacro, mmacro and context state after processing
+ * an %include file is saved in a file named after an MD5 hash of the
+ * file name and the complete preprocessor state *before* the
+ * %include.  The next time the same file is included with the same
+ * state, in this or a later pass or run, the saved state is loaded
+ * instead of reading the file.
+ *
+ * An include is only recorded if it (and anything it includes in
+ * turn) produces no output lines and no diagnostics, and contains
+ * nothing that could depend on the environment, the date or time, or
+ * the pass.  Magic macros and the date/time/pass macros are not
+ * saved; the current definitions are kept instead.
+ */
+#define MCACHE_FORMAT   2
+#define MCACHE_SUFFIX   ".nmc"
+
+struct mcache_dep {
+    char *name;                 /* Name as given to %include */
+    char *path;                 /* Path as found */
+    uint64_t size;
+    unsigned char md5[MD5_HASHBYTES];
+};
 
-    /* Reset options to default */
-    nasm_zero(ppconf);
+struct mcache_entry {
+    struct mcache_entry *next;
+    unsigned char key[MD5_HASHBYTES];
+    int ndeps;
+    struct mcache_dep *deps;    /* deps[0] is the included file itself */
+    unsigned char *state;       /* NULL if the include is not cacheable */
+    size_t statelen;
+};
 
-    /* Disable all debugging info, except in the last pass */
-    ppdbg = 0;
-    if (!(ppopt & PP_TRIVIAL)) {
-        if (pass_final()) {
-            if (dfmt->debug_mmacros)
-                ppdbg |= PDBG_MMACROS;
-            if (dfmt->debug_smacros)
-                ppdbg |= PDBG_SMACROS;
-            if (dfmt->debug_include)
-                ppdbg |= PDBG_INCLUDE;
-        }
+static struct {
+    char *dir;                  /* Cache directory, NULL if disabled */
+    char *cwd;                  /* Working directory, part of the key */
+    struct mcache_entry *entries;
+    struct {                    /* Include currently being recorded */
+        const Include *inc;
+        bool ok;
+        unsigned char key[MD5_HASHBYTES];
+        int ndeps, maxdeps;
+        struct mcache_dep *deps;
+        uint64_t diagnostics;
+        size_t npreserved;
+    } rec;
+} mcache;
+
+/*
+ * Single-line macros which are never saved in the cache. These are
+ * the magic macros and the macros whose value changes between
+ * passes or runs.
+ */
+static bool mcache_preserved(const SMacro *s)
+{
+    static const char * const volatile_smacros[] = {
+        "__?DATE?__", "__?DATE_NUM?__", "__?TIME?__", "__?TIME_NUM?__",
+        "__?UTC_DATE?__", "__?UTC_DATE_NUM?__", "__?UTC_TIME?__",
+        "__?UTC_TIME_NUM?__", "__?POSIX_TIME?__", "__?PASS?__"
+    };
+    size_t i;
 
-        if (list_option('s'))
-            ppdbg |= PDBG_LIST_SMACROS;
+    if (s->expand != smacro_expand_default)
+        return true;
+
+    if (s->name[0] != '_')
+        return false;
+
+    for (i = 0; i < ARRAY_SIZE(volatile_smacros); i++) {
+        if (!strcmp(s->name, volatile_smacros[i]))
+            return true;
     }
+    return false;
+}
 
-    memset(use_loaded, 0, use_package_count * sizeof(bool));
+static size_t mcache_count_preserved(void)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    const SMacro *s;
+    size_t n = 0;
 
-    /* First set up the top level input file */
-    nasm_new(istk);
-    istk->fp = nasm_open_read(file, NF_TEXT);
-    if (!istk->fp) {
-	nasm_fatalf(ERR_NOFILE, "unable to open input file `%s'%s%s",
-                    file, errno ? " " : "", errno ? strerror(errno) : "");
+    hash_for_each(&smacros, it, np) {
+        list_for_each(s, (const SMacro *)np->data) {
+            if (mcache_preserved(s))
+                n++;
+        }
     }
-    src_set(0, file);
-    istk->where = src_where();
-    istk->lineinc = 1;
+    return n;
+}
 
-    if (ppdbg & PDBG_INCLUDE) {
-        /* Let the debug format know the main file */
-        dfmt->debug_include(true, src_nowhere(), istk->where);
+/*
+ * Any of these in an included file, case insensitively, prevents it
+ * from being cached: they depend on the environment, the date and
+ * time, the pass, or the file system.
+ */
+static const char * const mcache_unsafe[] = {
+    "__?date", "__?time", "__?utc_", "__?posix_time", "__?pass",
+    "__date__", "__time__", "__utc_", "__posix_time__", "__pass__",
+    "%!", "%env", "ifenv", "ifnenv", "isenv", "isnenv",
+    "iffile", "ifnfile", "isfile", "isnfile",
+    "%depend", "%pathsearch", "%realpath"
+};
+
+/*
+ * Serializing the preprocessor state. Integers are unsigned LEB128;
+ * strings are stored as length + 1, with 0 meaning NULL; token lists
+ * are (type + 1, length, text) triples terminated by a 0.
+ */
+static void mcache_wstr(struct SAA *s, const char *str)
+{
+    size_t len;
+
+    if (!str) {
+        saa_wleb128u(s, 0);
+        return;
     }
 
-    strlist_add(deplist, file);
+    len = strlen(str);
+    saa_wleb128u(s, len + 1);
+    saa_wbytes(s, str, len);
+}
 
-    do_predef = false;
+static void mcache_wtoken(struct SAA *s, const Token *t)
+{
+    saa_wleb128u(s, t->type + 1);
+    saa_wleb128u(s, t->len);
+    saa_wbytes(s, tok_text(t), t->len);
+}
 
-    if (!(ppopt & PP_TRIVIAL))
-        pp_reset_stdmac(mode);
+static void mcache_wtlist(struct SAA *s, const Token *t)
+{
+    list_for_each(t, t)
+        mcache_wtoken(s, t);
+    saa_wleb128u(s, 0);
 }
 
-void pp_init(enum preproc_opt opt)
+static void mcache_wwhere(struct SAA *s, struct src_location where)
 {
-    ppopt = opt;
-    nasm_newn(use_loaded, use_package_count);
+    mcache_wstr(s, where.filename);
+    saa_wleb128s(s, where.lineno);
 }
 
-static Include *pop_include_stack(void)
+static int mcache_cmp_nodes(const void *a, const void *b)
 {
-    Include *i = istk;
+    const struct hash_node * const *na = a;
+    const struct hash_node * const *nb = b;
 
-    if (i->fp)
-        fclose(i->fp);
-    if (i->conds) {
-        /*
-         * This should never happen for a builtin macro package,
-         *  but if it does, at least get an error message out...
-         */
-        nasm_fatal("expected `%%endif' before end of %s",
-                   i->fp ? "file" : "macro package");
-    }
+    return strcmp((*na)->key, (*nb)->key);
+}
 
-    istk = i->next;
+/*
+ * Return the nonempty hash chains of a table sorted by key, so the
+ * serialized state does not depend on the hash table layout.
+ */
+static const struct hash_node **
+mcache_sorted_nodes(const struct hash_table *tbl, size_t *np)
+{
+    struct hash_iterator it;
+    const struct hash_node *node;
+    const struct hash_node **nodes;
+    size_t n = 0;
 
-    if (!i->nolist)
-        lfmt->downlevel(LIST_INCLUDE);
-    if (!i->noline) {
-        struct src_location whereto
-            = istk ? istk->where : src_nowhere();
-        if (ppdbg & PDBG_INCLUDE)
-            dfmt->debug_include(false, whereto, i->where);
-        src_update(whereto);
+    nasm_newn(nodes, tbl->load + 1);
+    hash_for_each(tbl, it, node) {
+        if (node->data)
+            nodes[n++] = node;
     }
+    qsort(nodes, n, sizeof *nodes, mcache_cmp_nodes);
 
-    return i;
+    *np = n;
+    return nodes;
 }
 
-/*
- * Get a line of tokens. If we popped the macro expansion/include stack,
- * we return a pointer to the dummy token tok_pop; at that point if
- * istk is NULL then we have reached end of input;
- */
-static Token tok_pop;           /* Dummy token placeholder */
+static void mcache_write_smacros(struct SAA *s, const struct hash_table *tbl)
+{
+    const struct hash_node **nodes;
+    size_t i, n;
+    int j;
 
-static Token *pp_tokline(void)
+    nodes = mcache_sorted_nodes(tbl, &n);
+    for (i = 0; i < n; i++) {
+        const SMacro *m;
+
+        mcache_wstr(s, nodes[i]->key);
+        list_for_each(m, (const SMacro *)nodes[i]->data) {
+            if (mcache_preserved(m)) {
+                saa_write8(s, 2);
+                mcache_wstr(s, m->name);
+                continue;
+            }
+
+            saa_write8(s, 1);
+            mcache_wstr(s, m->name);
+            saa_write8(s, m->casesense | (m->recursive << 1) |
+                       (m->varadic << 2) | (m->alias << 3));
+            saa_wleb128u(s, m->nparam);
+            saa_wleb128u(s, m->nparam_min);
+            for (j = 0; j < m->nparam; j++) {
+                const struct smac_param *p = &m->params[j];
+                mcache_wtoken(s, &p->name);
+                saa_wleb128u(s, p->flags);
+                saa_write8(s, p->radix);
+                mcache_wtlist(s, p->def);
+            }
+            mcache_wtlist(s, m->expansion);
+        }
+        saa_write8(s, 0);
+    }
+    mcache_wstr(s, NULL);
+    nasm_free(nodes);
+}
+
+static void mcache_write_mmacros(struct SAA *s, const struct hash_table *tbl)
 {
-    while (true) {
-        Line *l = istk->expansion;
-        Token *tline = NULL;
-        Token *dtline;
-        char *line = NULL;
-        bool suppressed = false;
+    const struct hash_node **nodes;
+    size_t i, n;
+    int j;
 
-        check_mmacro_refcounts();
+    nodes = mcache_sorted_nodes(tbl, &n);
+    for (i = 0; i < n; i++) {
+        const MMacro *m;
+        const Line *l;
+
+        mcache_wstr(s, nodes[i]->key);
+        list_for_each(m, (const MMacro *)nodes[i]->data) {
+            saa_write8(s, 1);
+            mcache_wstr(s, m->name);
+            saa_write8(s, m->casesense | (m->plus << 1) |
+                       (m->capture_label << 2));
+            saa_wleb128s(s, m->nparam_min);
+            saa_wleb128s(s, m->nparam_max);
+            saa_wleb128u(s, m->nolist);
+            saa_wleb128s(s, m->max_depth);
+            mcache_wwhere(s, m->where);
+            mcache_wtlist(s, m->dlist);
 
-        /*
-         * Fetch a tokenized line, either from the macro-expansion
-         * buffer or from the input file.
-         */
-        while (l && l->finishes) {
-            MMacro *fm = l->finishes;
+            /*
+             * The defaults point into dlist; store them as indices.
+             * Like macro parameters they are numbered from 1.
+             */
+            saa_wleb128u(s, m->defaults ? m->ndefs + 1 : 0);
+            for (j = 1; m->defaults && j <= m->ndefs; j++) {
+                const Token *t;
+                uint64_t idx = 1;
 
-            if (!fm->name && fm->in_progress > 1 && !l->suppressed) {
-                /*
+                list_for_each(t, m->dlist) {
+                    if (t == m->defaults[j])
+                        break;
+                    idx++;
+                }
+                saa_wleb128u(s, t ? idx : 0);
+            }
+
+            list_for_each(l, m->expansion) {
+                saa_write8(s, 1);
+                mcache_wwhere(s, l->where);
+                mcache_wtlist(s, l->first);
+            }
+            saa_write8(s, 0);
+        }
+        saa_write8(s, 0);
+    }
+    mcache_wstr(s, NULL);
+    nasm_free(nodes);
+}
+
+static struct SAA *mcache_write_state(void)
+{
+    struct SAA *s = saa_init(1);
+    const Context *ctx;
+    size_t i, nctx = 0;
+
+    saa_wleb128u(s, unique);
+    saa_write8(s, ppconf.noaliases | (ppconf.sane_empty_expansion << 1));
+    saa_wleb128u(s, use_package_count);
+    for (i = 0; i < use_package_count; i++)
+        saa_write8(s, use_loaded[i]);
+    saa_wleb128s(s, StackSize);
+    mcache_wstr(s, StackPointer);
+    saa_wleb128s(s, ArgOffset);
+    saa_wleb128s(s, LocalOffset);
+
+    mcache_write_smacros(s, &smacros);
+    mcache_write_mmacros(s, &mmacros);
+
+    /* Contexts, bottom of the stack first */
+    list_for_each(ctx, cstk)
+        nctx++;
+    saa_wleb128u(s, nctx);
+    while (nctx--) {
+        ctx = cstk;
+        for (i = 0; i < nctx; i++)
+            ctx = ctx->next;
+        mcache_wstr(s, ctx->name);
+        saa_wleb128u(s, ctx->number);
+        saa_wleb128u(s, ctx->depth);
+        mcache_write_smacros(s, &ctx->localmac);
+    }
+
+    return s;
+}
+
+/*
+ * Deserializing.  Any error simply sets rd->err; the caller checks
+ * it at the end and discards anything that was built.
+ */
+struct mcache_rd {
+    const unsigned char *p, *end;
+    bool err;
+};
+
+static uint64_t mcache_ruleb(struct mcache_rd *rd)
+{
+    uint64_t v = 0;
+    unsigned int shift = 0;
+    unsigned char c;
+
+    do {
+        if (rd->p >= rd->end || shift >= 64) {
+            rd->err = true;
+            return 0;
+        }
+        c = *rd->p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return v;
+}
+
+static int64_t mcache_rsleb(struct mcache_rd *rd)
+{
+    int64_t v = 0;
+    unsigned int shift = 0;
+    unsigned char c;
+
+    do {
+        if (rd->p >= rd->end || shift >= 64) {
+            rd->err = true;
+            return 0;
+        }
+        c = *rd->p++;
+        v |= (int64_t)((uint64_t)(c & 0x7f) << shift);
+        shift += 7;
+    } while (c & 0x80);
+
+    if (shift < 64 && (c & 0x40))
+        v |= -((int64_t)1 << shift);
+
+    return v;
+}
+
+static unsigned int mcache_r8(struct mcache_rd *rd)
+{
+    if (rd->p >= rd->end) {
+        rd->err = true;
+        return 0;
+    }
+    return *rd->p++;
+}
+
+static const unsigned char *mcache_rbytes(struct mcache_rd *rd, size_t len)
+{
+    const unsigned char *p = rd->p;
+
+    if (len > (size_t)(rd->end - p)) {
+        rd->err = true;
+        rd->p = rd->end;
+        return NULL;
+    }
+    rd->p += len;
+    return p;
+}
+
+static char *mcache_rstr(struct mcache_rd *rd)
+{
+    uint64_t len = mcache_ruleb(rd);
+    const unsigned char *p;
+
+    if (!len--)
+        return NULL;
+
+    p = mcache_rbytes(rd, len);
+    return p ? nasm_strndup((const char *)p, len) : NULL;
+}
+
+/*
+ * Returns NULL at the end of a list or on error.  nparam is the number
+ * of smacro parameters the token may refer to.
+ */
+static Token *mcache_rtoken(struct mcache_rd *rd, unsigned int nparam)
+{
+    uint64_t type = mcache_ruleb(rd);
+    uint64_t len;
+    const unsigned char *text;
+
+    if (!type--)
+        return NULL;
+
+    /* Only token types which can appear in a macro definition */
+    if (type == TOKEN_EOS || type == TOKEN_MAX_OPERATOR ||
+        type == TOKEN_START_ASM || type == TOKEN_END_ASM ||
+        type >= (uint64_t)TOKEN_SMAC_START_PARAMS + nparam) {
+        rd->err = true;
+        return NULL;
+    }
+
+    len = mcache_ruleb(rd);
+    text = mcache_rbytes(rd, len);
+    if (!text || len > MAX_TEXT) {
+        rd->err = true;
+        return NULL;
+    }
+    return new_Token(NULL, type, len ? (const char *)text : "", len);
+}
+
+static Token *mcache_rtlist(struct mcache_rd *rd, unsigned int nparam)
+{
+    Token *list = NULL;
+    Token **tail = &list;
+    Token *t;
+
+    while ((t = mcache_rtoken(rd, nparam))) {
+        *tail = t;
+        tail = &t->next;
+    }
+    return list;
+}
+
+static struct src_location mcache_rwhere(struct mcache_rd *rd)
+{
+    struct src_location where;
+    char *fname = mcache_rstr(rd);
+
+    where.filename = fname ? src_intern_fname(fname) : NULL;
+    where.lineno   = mcache_rsleb(rd);
+    nasm_free(fname);
+    return where;
+}
+
+/*
+ * Preserved smacros are represented by placeholders with a NULL
+ * expand pointer while loading; nparam is the index into claimed[].
+ */
+struct mcache_claims {
+    SMacro **claimed;
+    size_t n, size;
+};
+
+static bool mcache_claim(struct mcache_claims *cl, SMacro *ph)
+{
+    SMacro *s;
+    size_t i;
+
+    list_for_each(s, (SMacro *)hash_findix(&smacros, ph->name)) {
+        if (!mcache_preserved(s) || strcmp(s->name, ph->name))
+            continue;
+        for (i = 0; i < cl->n; i++) {
+            if (cl->claimed[i] == s)
+                break;
+        }
+        if (i < cl->n)
+            continue;
+
+        if (cl->n >= cl->size) {
+            cl->size = cl->size ? cl->size << 1 : 16;
+            cl->claimed = nasm_realloc(cl->claimed,
+                                       cl->size * sizeof *cl->claimed);
+        }
+        ph->nparam = cl->n;
+        cl->claimed[cl->n++] = s;
+        return true;
+    }
+    return false;
+}
+
+static void mcache_read_smacros(struct mcache_rd *rd, struct hash_table *tbl,
+                                struct mcache_claims *cl)
+{
+    char *key;
+
+    while (!rd->err && (key = mcache_rstr(rd))) {
+        SMacro **tail = (SMacro **)hash_findi_add(tbl, key);
+        unsigned int tag;
+
+        nasm_free(key);
+        while (*tail)
+            tail = &(*tail)->next;
+
+        while (!rd->err && (tag = mcache_r8(rd))) {
+            SMacro *m;
+            unsigned int flags;
+            uint64_t nparam;
+            int j;
+
+            nasm_new(m);
+            *tail = m;
+            tail = &m->next;
+
+            m->name = mcache_rstr(rd);
+            if (!m->name) {
+                rd->err = true;
+                break;
+            }
+
+            if (tag == 2) {
+                if (!cl || !mcache_claim(cl, m))
+                    rd->err = true;
+                continue;
+            } else if (tag != 1) {
+                rd->err = true;
+                break;
+            }
+
+            m->expand     = smacro_expand_default;
+            flags         = mcache_r8(rd);
+            m->casesense  = !!(flags & 1);
+            m->recursive  = !!(flags & 2);
+            m->varadic    = !!(flags & 4);
+            m->alias      = !!(flags & 8);
+            nparam        = mcache_ruleb(rd);
+            m->nparam_min = mcache_ruleb(rd);
+            if (rd->err || nparam > (uint64_t)(rd->end - rd->p) ||
+                m->nparam_min > (int)nparam) {
+                rd->err = true;
+                break;
+            }
+            j = nparam;
+            if (j)
+                nasm_newn(m->params, j);
+
+            for (m->nparam = 0; m->nparam < j; m->nparam++) {
+                struct smac_param *p = &m->params[m->nparam];
+                Token *t = mcache_rtoken(rd, 0);
+
+                if (!t) {
+                    rd->err = true;
+                    break;
+                }
+                steal_Token(&p->name, t);
+                delete_Token(t);
+                p->flags = mcache_ruleb(rd);
+                p->radix = mcache_r8(rd);
+                p->def   = mcache_rtlist(rd, 0);
+            }
+            m->expansion = mcache_rtlist(rd, m->nparam);
+        }
+    }
+}
+
+static void mcache_read_mmacros(struct mcache_rd *rd, struct hash_table *tbl)
+{
+    char *key;
+
+    while (!rd->err && (key = mcache_rstr(rd))) {
+        MMacro **tail = (MMacro **)hash_findi_add(tbl, key);
+
+        nasm_free(key);
+        while (*tail)
+            tail = &(*tail)->next;
+
+        while (!rd->err && mcache_r8(rd)) {
+            MMacro *m = new_mmacro();
+            Line **ltail;
+            unsigned int flags;
+            uint64_t ndefs;
+            int j;
+
+            m->refcnt = 1;      /* Held by the previous list entry */
+            *tail = m;
+            tail = &m->next;
+
+            m->name          = mcache_rstr(rd);
+            flags            = mcache_r8(rd);
+            m->casesense     = !!(flags & 1);
+            m->plus          = !!(flags & 2);
+            m->capture_label = !!(flags & 4);
+            m->nparam_min    = mcache_rsleb(rd);
+            m->nparam_max    = mcache_rsleb(rd);
+            m->nolist        = mcache_ruleb(rd);
+            m->max_depth     = mcache_rsleb(rd);
+            m->where         = mcache_rwhere(rd);
+            m->dlist         = mcache_rtlist(rd, 0);
+
+            ndefs = mcache_ruleb(rd);
+            if (!m->name || ndefs > (uint64_t)(rd->end - rd->p) + 1) {
+                rd->err = true;
+                break;
+            }
+            if (ndefs--) {
+                nasm_newn(m->defaults, ndefs + 2);
+                m->ndefs = ndefs;
+                for (j = 1; j <= m->ndefs; j++) {
+                    uint64_t idx = mcache_ruleb(rd);
+                    Token *t = m->dlist;
+
+                    if (!idx)
+                        continue;
+                    while (t && --idx)
+                        t = t->next;
+                    if (!t) {
+                        rd->err = true;
+                        break;
+                    }
+                    m->defaults[j] = t;
+                }
+            }
+
+            ltail = &m->expansion;
+            while (!rd->err && mcache_r8(rd)) {
+                Line *l;
+
+                nasm_new(l);
+                *ltail = l;
+                ltail = &l->next;
+                l->where = mcache_rwhere(rd);
+                l->first = mcache_rtlist(rd, 0);
+            }
+        }
+    }
+}
+
+/*
+ * The state loaded from a cache entry, before it is installed
+ */
+struct mcache_state {
+    uint64_t unique;
+    struct pp_config ppconf;
+    bool *use_loaded;
+    int StackSize;
+    const char *StackPointer;
+    int ArgOffset, LocalOffset;
+    struct hash_table smacros, mmacros;
+    Context *cstk;
+    struct mcache_claims claims;
+};
+
+static void mcache_free_state(struct mcache_state *st)
+{
+    while (st->cstk) {
+        Context *c = st->cstk;
+        st->cstk = c->next;
+        free_smacro_table(&c->localmac);
+        nasm_free((char *)c->name);
+        nasm_free(c);
+    }
+    free_smacro_table(&st->smacros);
+    free_mmacro_table(&st->mmacros);
+    nasm_free(st->use_loaded);
+    nasm_free(st->claims.claimed);
+}
+
+static bool mcache_read_state(struct mcache_state *st,
+                              const unsigned char *data, size_t len)
+{
+    static const char * const stack_pointers[] = { "bp", "ebp", "rbp" };
+    struct mcache_rd rd;
+    uint64_t nctx;
+    char *sp;
+    size_t i;
+
+    nasm_zero(*st);
+    rd.p   = data;
+    rd.end = data + len;
+    rd.err = false;
+
+    st->unique = mcache_ruleb(&rd);
+    i = mcache_r8(&rd);
+    st->ppconf.noaliases = !!(i & 1);
+    st->ppconf.sane_empty_expansion = !!(i & 2);
+    if (mcache_ruleb(&rd) != use_package_count)
+        return false;
+    nasm_newn(st->use_loaded, use_package_count);
+    for (i = 0; i < use_package_count; i++)
+        st->use_loaded[i] = !!mcache_r8(&rd);
+    st->StackSize = mcache_rsleb(&rd);
+    sp = mcache_rstr(&rd);
+    for (i = 0; sp && i < ARRAY_SIZE(stack_pointers); i++) {
+        if (!strcmp(sp, stack_pointers[i]))
+            st->StackPointer = stack_pointers[i];
+    }
+    nasm_free(sp);
+    if (!st->StackPointer)
+        rd.err = true;
+    st->ArgOffset = mcache_rsleb(&rd);
+    st->LocalOffset = mcache_rsleb(&rd);
+
+    mcache_read_smacros(&rd, &st->smacros, &st->claims);
+    mcache_read_mmacros(&rd, &st->mmacros);
+
+    nctx = mcache_ruleb(&rd);
+    while (!rd.err && nctx--) {
+        Context *ctx;
+
+        nasm_new(ctx);
+        ctx->next = st->cstk;
+        st->cstk = ctx;
+        ctx->name = mcache_rstr(&rd);
+        ctx->number = mcache_ruleb(&rd);
+        ctx->depth = mcache_ruleb(&rd);
+        mcache_read_smacros(&rd, &ctx->localmac, NULL);
+    }
+
+    if (rd.err || rd.p != rd.end ||
+        st->claims.n != mcache_count_preserved()) {
+        mcache_free_state(st);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Replace the current preprocessor state with a loaded one
+ */
+static void mcache_install_state(struct mcache_state *st)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    SMacro **sp;
+
+    /* Free everything but the preserved smacros, which are all claimed */
+    hash_for_each(&smacros, it, np) {
+        SMacro *s, *tmp;
+
+        list_for_each_safe(s, tmp, (SMacro *)np->data) {
+            if (!mcache_preserved(s))
+                free_smacro(s);
+        }
+        *(SMacro **)&np->data = NULL;
+    }
+    hash_free_all(&smacros, true);
+    smacros = st->smacros;
+    smac_flush = ++smac_gen;
+
+    /* Replace the placeholders with the preserved smacros */
+    hash_for_each(&smacros, it, np) {
+        for (sp = (SMacro **)&np->data; *sp; sp = &(*sp)->next) {
+            SMacro *ph = *sp;
+
+            if (ph->expand)
+                continue;
+            *sp = st->claims.claimed[ph->nparam];
+            (*sp)->next = ph->next;
+            free_smacro(ph);
+        }
+    }
+
+    free_mmacro_table(&mmacros);
+    mmacros = st->mmacros;
+
+    macro_bloom_rebuild(&smacros);
+    macro_bloom_rebuild(&mmacros);
+
+    while (cstk)
+        ctx_pop();
+    cstk = st->cstk;
+
+    unique = st->unique;
+    ppconf = st->ppconf;
+    memcpy(use_loaded, st->use_loaded, use_package_count * sizeof(bool));
+    StackSize = st->StackSize;
+    StackPointer = st->StackPointer;
+    ArgOffset = st->ArgOffset;
+    LocalOffset = st->LocalOffset;
+
+    nasm_free(st->use_loaded);
+    nasm_free(st->claims.claimed);
+}
+
+static void mcache_md5str(MD5_CTX *ctx, const char *str)
+{
+    if (!str)
+        str = "";
+    MD5Update(ctx, (const unsigned char *)str, strlen(str) + 1);
+}
+
+static void mcache_md5saa(MD5_CTX *ctx, struct SAA *s)
+{
+    const void *p;
+    size_t len;
+
+    saa_rewind(s);
+    while (len = s->datalen, (p = saa_rbytes(s, &len)))
+        MD5Update(ctx, p, len);
+}
+
+/*
+ * Compute the cache key of an include file given the current state
+ */
+static void mcache_key(unsigned char *key, const char *path)
+{
+    const struct strlist_entry *ip;
+    struct SAA *state;
+    uint32_t opts;
+    MD5_CTX ctx;
+
+    MD5Init(&ctx);
+    mcache_md5str(&ctx, nasm_version);
+    mcache_md5str(&ctx, path);
+    mcache_md5str(&ctx, mcache.cwd);
+    mcache_md5str(&ctx, ofmt->shortname);
+    mcache_md5str(&ctx, dfmt->shortname);
+    strlist_for_each(ip, ipath_list)
+        mcache_md5str(&ctx, ip->str);
+    opts = ppopt;
+    MD5Update(&ctx, (const unsigned char *)&opts, sizeof opts);
+    MD5Update(&ctx, (const unsigned char *)&tasm_compatible_mode,
+              sizeof tasm_compatible_mode);
+
+    state = mcache_write_state();
+    mcache_md5saa(&ctx, state);
+    saa_free(state);
+
+    MD5Final(key, &ctx);
+}
+
+static char *mcache_filename(const unsigned char *key)
+{
+    char hex[MD5_HASHBYTES*2 + sizeof MCACHE_SUFFIX];
+    char *p = hex;
+    int i;
+
+    for (i = 0; i < MD5_HASHBYTES; i++)
+        p += sprintf(p, "%02x", key[i]);
+    strcpy(p, MCACHE_SUFFIX);
+
+    return nasm_catfile(mcache.dir, hex);
+}
+
+static void *mcache_read_file(const char *path, size_t *lenp)
+{
+    FILE *f;
+    off_t size;
+    void *buf;
+
+    f = nasm_open_read(path, NF_BINARY);
+    if (!f)
+        return NULL;
+
+    size = nasm_file_size(f);
+    if (size < 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    buf = nasm_malloc(size + 1);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        nasm_free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+
+    *lenp = size;
+    return buf;
+}
+
+static const char *mcache_magic(void)
+{
+    static char *magic;
+
+    if (!magic)
+        magic = nasm_asprintf("NASM macro cache %s", nasm_version);
+    return magic;
+}
+
+static void mcache_free_deps(struct mcache_dep *deps, int ndeps)
+{
+    int i;
+
+    for (i = 0; i < ndeps; i++) {
+        nasm_free(deps[i].name);
+        nasm_free(deps[i].path);
+    }
+    nasm_free(deps);
+}
+
+static void mcache_free_entry(struct mcache_entry *e)
+{
+    mcache_free_deps(e->deps, e->ndeps);
+    nasm_free(e->state);
+    nasm_free(e);
+}
+
+/*
+ * File timestamps are too coarse to tell if a file was modified, so
+ * the contents are always compared; only the size is a quick check.
+ */
+static bool mcache_dep_current(const struct mcache_dep *dep)
+{
+    unsigned char md5[MD5_HASHBYTES];
+    unsigned char *data;
+    size_t len;
+    MD5_CTX ctx;
+
+    if ((uint64_t)nasm_file_size_by_path(dep->path) != dep->size)
+        return false;
+
+    data = mcache_read_file(dep->path, &len);
+    if (!data || len != dep->size) {
+        nasm_free(data);
+        return false;
+    }
+    MD5Init(&ctx);
+    MD5Update(&ctx, data, len);
+    MD5Final(md5, &ctx);
+    nasm_free(data);
+
+    return !memcmp(md5, dep->md5, MD5_HASHBYTES);
+}
+
+/*
+ * Load a cache file. Returns NULL if it is missing, damaged or stale.
+ */
+static struct mcache_entry *mcache_load(const unsigned char *key)
+{
+    struct mcache_entry *e;
+    const char *magic = mcache_magic();
+    size_t maglen = strlen(magic) + 1;
+    unsigned char md5[MD5_HASHBYTES];
+    const unsigned char *sum;
+    unsigned char *data;
+    struct mcache_rd rd;
+    char *fname;
+    size_t len;
+    uint64_t ndeps;
+    MD5_CTX ctx;
+    int i;
+
+    fname = mcache_filename(key);
+    data = mcache_read_file(fname, &len);
+    nasm_free(fname);
+    if (!data)
+        return NULL;
+
+    rd.p   = data;
+    rd.end = data + len;
+    rd.err = false;
+
+    if (len < maglen + 1 + 2*MD5_HASHBYTES ||
+        memcmp(mcache_rbytes(&rd, maglen), magic, maglen) ||
+        mcache_r8(&rd) != MCACHE_FORMAT ||
+        memcmp(mcache_rbytes(&rd, MD5_HASHBYTES), key, MD5_HASHBYTES)) {
+        nasm_free(data);
+        return NULL;
+    }
+
+    sum = mcache_rbytes(&rd, MD5_HASHBYTES);
+    MD5Init(&ctx);
+    MD5Update(&ctx, rd.p, rd.end - rd.p);
+    MD5Final(md5, &ctx);
+    if (memcmp(md5, sum, MD5_HASHBYTES)) {
+        nasm_free(data);
+        return NULL;
+    }
+
+    nasm_new(e);
+    memcpy(e->key, key, MD5_HASHBYTES);
+    ndeps = mcache_ruleb(&rd);
+    if (ndeps < 1 || ndeps > (uint64_t)(rd.end - rd.p))
+        rd.err = true;
+    else
+        nasm_newn(e->deps, ndeps);
+    for (i = 0; !rd.err && (uint64_t)i < ndeps; i++) {
+        struct mcache_dep *dep = &e->deps[e->ndeps++];
+        const unsigned char *p;
+
+        dep->name  = mcache_rstr(&rd);
+        dep->path  = mcache_rstr(&rd);
+        dep->size  = mcache_ruleb(&rd);
+        p = mcache_rbytes(&rd, MD5_HASHBYTES);
+        if (!p || !dep->name || !dep->path) {
+            rd.err = true;
+        } else {
+            memcpy(dep->md5, p, MD5_HASHBYTES);
+            rd.err = !mcache_dep_current(dep);
+        }
+    }
+
+    if (rd.err) {
+        mcache_free_entry(e);
+        nasm_free(data);
+        return NULL;
+    }
+
+    e->statelen = rd.end - rd.p;
+    e->state = nasm_malloc(e->statelen + 1);
+    memcpy(e->state, rd.p, e->statelen);
+    nasm_free(data);
+    return e;
+}
+
+/*
+ * Write a cache file. This is written to a temporary file and then
+ * renamed, so concurrent assemblies never see a partial file.
+ */
+static void mcache_store(const struct mcache_entry *e)
+{
+    const char *magic = mcache_magic();
+    struct SAA *body = saa_init(1);
+    unsigned char md5[MD5_HASHBYTES];
+    char *fname, *tmpname;
+    MD5_CTX ctx;
+    FILE *f;
+    int i;
+    bool ok;
+
+    saa_wleb128u(body, e->ndeps);
+    for (i = 0; i < e->ndeps; i++) {
+        const struct mcache_dep *dep = &e->deps[i];
+        mcache_wstr(body, dep->name);
+        mcache_wstr(body, dep->path);
+        saa_wleb128u(body, dep->size);
+        saa_wbytes(body, dep->md5, MD5_HASHBYTES);
+    }
+    saa_wbytes(body, e->state, e->statelen);
+
+    MD5Init(&ctx);
+    mcache_md5saa(&ctx, body);
+    MD5Final(md5, &ctx);
+
+    fname = mcache_filename(e->key);
+#ifdef HAVE_GETPID
+    tmpname = nasm_asprintf("%s.%lu.tmp", fname, (unsigned long)getpid());
+#else
+    tmpname = nasm_strcat(fname, ".tmp");
+#endif
+
+    f = nasm_open_write(tmpname, NF_BINARY);
+    if (f) {
+        fwrite(magic, 1, strlen(magic) + 1, f);
+        fputc(MCACHE_FORMAT, f);
+        fwrite(e->key, 1, MD5_HASHBYTES, f);
+        fwrite(md5, 1, MD5_HASHBYTES, f);
+        saa_fpwrite(body, f);
+        ok = !ferror(f);
+        ok &= !fclose(f);
+
+        /*
+         * If the rename fails, assume another assembly got there
+         * first; the file name is determined by its contents.
+         */
+        if (!ok || nasm_rename(tmpname, fname))
+            nasm_remove(tmpname);
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        nasm_warn(WARN_OTHER, "unable to write macro cache file `%s': %s",
+                  fname, strerror(errno));
+    }
+
+    nasm_free(tmpname);
+    nasm_free(fname);
+    saa_free(body);
+}
+
+static void mcache_add_dep(const char *name, const char *path)
+{
+    struct mcache_dep *dep;
+
+    if (mcache.rec.ndeps >= mcache.rec.maxdeps) {
+        mcache.rec.maxdeps = mcache.rec.maxdeps ? mcache.rec.maxdeps << 1 : 8;
+        mcache.rec.deps = nasm_realloc(mcache.rec.deps, mcache.rec.maxdeps *
+                                       sizeof *mcache.rec.deps);
+    }
+    dep = &mcache.rec.deps[mcache.rec.ndeps++];
+    nasm_zero(*dep);
+    dep->name = nasm_strdup(name);
+    dep->path = nasm_strdup(path);
+}
+
+/*
+ * Something happened while recording which means this include cannot
+ * be cached.
+ */
+static void mcache_abort(void)
+{
+    mcache.rec.ok = false;
+}
+
+static void mcache_end_recording(void)
+{
+    mcache_free_deps(mcache.rec.deps, mcache.rec.ndeps);
+    nasm_zero(mcache.rec);
+}
+
+/*
+ * Called on %include or %require after the file has been opened.
+ * Returns true if the state was loaded from the cache, in which case
+ * the file should not be read.
+ */
+static bool mcache_include(Include *inc, const char *name,
+                           const struct file_hash_entry *fhe)
+{
+    const char *path = fhe ? fhe->path : name;
+    unsigned char key[MD5_HASHBYTES];
+    struct mcache_entry *e;
+    struct mcache_state st;
+    int i;
+
+    if (!mcache.dir)
+        return false;
+
+    if (mcache.rec.inc) {
+        /* Included from a file being recorded */
+        mcache_add_dep(name, path);
+        return false;
+    }
+
+    if (pp_mode != PP_NORMAL || (ppopt & PP_TRIVIAL) || ppdbg ||
+        list_active() || defining || pass_dependent ||
+        istk->mstk.mmac || istk->mstk.mstk)
+        return false;
+
+    mcache_key(key, path);
+
+    list_for_each(e, mcache.entries) {
+        if (!memcmp(e->key, key, MD5_HASHBYTES))
+            break;
+    }
+
+    if (!e) {
+        e = mcache_load(key);
+        if (e) {
+            e->next = mcache.entries;
+            mcache.entries = e;
+        }
+    }
+
+    if (e) {
+        if (!e->state || !mcache_read_state(&st, e->state, e->statelen))
+            return false;
+
+        mcache_install_state(&st);
+
+        /* Make the nested includes show up in the dependency list */
+        for (i = 1; i < e->ndeps && deplist; i++)
+            inc_fopen(e->deps[i].name, deplist, NULL, INC_PROBE, NF_TEXT);
+
+        return true;
+    }
+
+    mcache.rec.inc = inc;
+    mcache.rec.ok  = true;
+    memcpy(mcache.rec.key, key, MD5_HASHBYTES);
+    mcache.rec.diagnostics = erropt.diagnostics;
+    mcache.rec.npreserved = mcache_count_preserved();
+    mcache_add_dep(name, path);
+    return false;
+}
+
+/*
+ * Called when the include being recorded has been popped
+ */
+static void mcache_finish(void)
+{
+    struct mcache_entry *e;
+    struct SAA *state;
+    int i;
+
+    nasm_new(e);
+    memcpy(e->key, mcache.rec.key, MD5_HASHBYTES);
+    e->next = mcache.entries;
+    mcache.entries = e;
+
+    if (!mcache.rec.ok || defining || pass_dependent ||
+        erropt.diagnostics != mcache.rec.diagnostics ||
+        mcache_count_preserved() != mcache.rec.npreserved)
+        goto done;
+
+    for (i = 0; i < mcache.rec.ndeps; i++) {
+        struct mcache_dep *dep = &mcache.rec.deps[i];
+        unsigned char *data;
+        size_t len, j;
+        MD5_CTX ctx;
+
+        data = mcache_read_file(dep->path, &len);
+        if (!data)
+            goto done;
+
+        dep->size  = len;
+        MD5Init(&ctx);
+        MD5Update(&ctx, data, len);
+        MD5Final(dep->md5, &ctx);
+
+        for (j = 0; j < len; j++)
+            data[j] = data[j] ? nasm_tolower(data[j]) : ' ';
+        data[len] = '\0';
+        for (j = 0; j < ARRAY_SIZE(mcache_unsafe); j++) {
+            if (strstr((char *)data, mcache_unsafe[j]))
+                break;
+        }
+        nasm_free(data);
+        if (j < ARRAY_SIZE(mcache_unsafe))
+            goto done;
+    }
+
+    state = mcache_write_state();
+    e->statelen = state->datalen;
+    e->state = nasm_malloc(e->statelen + 1);
+    saa_rewind(state);
+    saa_rnbytes(state, e->state, e->statelen);
+    saa_free(state);
+
+    e->deps  = mcache.rec.deps;
+    e->ndeps = mcache.rec.ndeps;
+    mcache.rec.deps = NULL;
+    mcache.rec.ndeps = 0;
+
+    mcache_store(e);
+
+done:
+    mcache_end_recording();
+}
+
+void pp_macro_cache(const char *dir)
+{
+    nasm_free(mcache.dir);
+    nasm_free(mcache.cwd);
+    mcache.dir = dir ? nasm_strdup(dir) : NULL;
+    mcache.cwd = dir ? nasm_realpath(".") : NULL;
+}
+
+static void mcache_cleanup(void)
+{
+    struct mcache_entry *e, *tmp;
+
+    list_for_each_safe(e, tmp, mcache.entries)
+        mcache_free_entry(e);
+    mcache.entries = NULL;
+    mcache_end_recording();
+    pp_macro_cache(NULL);
+}
+
+void pp_reset(const char *file, enum preproc_mode mode,
+              struct strlist *dep_list)
+{
+    cstk = NULL;
+    defining = NULL;
+    nested_mac_count = 0;
+    nested_rep_count = 0;
+    unique = 0;
+    deplist = dep_list;
+    pp_mode = mode;
+    pass_dependent = false;
+
+    /* Reset options to default */
+    nasm_zero(ppconf);
+
+    /* Disable all debugging info, except in the last pass */
+    ppdbg = 0;
+    if (!(ppopt & PP_TRIVIAL)) {
+        if (pass_final()) {
+            if (dfmt->debug_mmacros)
+                ppdbg |= PDBG_MMACROS;
+            if (dfmt->debug_smacros)
+                ppdbg |= PDBG_SMACROS;
+            if (dfmt->debug_include)
+                ppdbg |= PDBG_INCLUDE;
+        }
+
+        if (list_option('s'))
+            ppdbg |= PDBG_LIST_SMACROS;
+    }
+
+    memset(use_loaded, 0, use_package_count * sizeof(bool));
+
+    /* First set up the top level input file */
+    nasm_new(istk);
+    istk->fp = nasm_open_read(file, NF_TEXT);
+    if (!istk->fp) {
+	nasm_fatalf(ERR_NOFILE, "unable to open input file `%s'%s%s",
+                    file, errno ? " " : "", errno ? strerror(errno) : "");
+    }
+    src_set(0, file);
+    istk->where = src_where();
+    istk->lineinc = 1;
+
+    if (ppdbg & PDBG_INCLUDE) {
+        /* Let the debug format know the main file */
+        dfmt->debug_include(true, src_nowhere(), istk->where);
+    }
+
+    strlist_add(deplist, file);
+
+    do_predef = false;
+
+    if (!(ppopt & PP_TRIVIAL))
+        pp_reset_stdmac(mode);
+}
+
+void pp_init(enum preproc_opt opt)
+{
+    ppopt = opt;
+    nasm_newn(use_loaded, use_package_count);
+}
+
+static Include *pop_include_stack(void)
+{
+    Include *i = istk;
+
+    if (i->fp)
+        fclose(i->fp);
+    nasm_free(i->data);
+    if (i->conds) {
+        /*
+         * This should never happen for a builtin macro package,
+         *  but if it does, at least get an error message out...
+         */
+        nasm_fatal("expected `%%endif' before end of %s",
+                   i->fp ? "file" : "macro package");
+    }
+
+    istk = i->next;
+
+    if (!i->nolist)
+        lfmt->downlevel(LIST_INCLUDE);
+    if (!i->noline) {
+        struct src_location whereto
+            = istk ? istk->where : src_nowhere();
+        if (ppdbg & PDBG_INCLUDE)
+            dfmt->debug_include(false, whereto, i->where);
+        src_update(whereto);
+    }
+
+    return i;
+}
+
+/*
+ * Get a line of tokens. If we popped the macro expansion/include stack,
+ * we return a pointer to the dummy token tok_pop; at that point if
+ * istk is NULL then we have reached end of input;
+ */
+static Token tok_pop;           /* Dummy token placeholder */
+
+static Token *pp_tokline(void)
+{
+    while (true) {
+        Line *l = istk->expansion;
+        Token *tline = NULL;
+        Token *dtline;
+        const char *line = NULL;
+        bool suppressed = false;
+        bool params = true;
+
+        check_mmacro_refcounts();
+
+        /*
+         * Fetch a tokenized line, either from the macro-expansion
+         * buffer or from the input file.
+         */
+        while (l && l->finishes) {
+            MMacro *fm = l->finishes;
+
+            if (!fm->name && fm->in_progress > 1 && !l->suppressed) {
+                /*
                  * This is a macro-end marker for a macro with no
                  * name, which means it's not really a macro at all
                  * but a %rep block, and the `in_progress' field is
@@ -8770,15 +10692,7 @@ static Token *pp_tokline(void)
                  * if we did.
                  */
                 fm->in_progress--;
-                list_for_each(l, fm->expansion) {
-                    Line *ll;
-
-                    nasm_new(ll);
-                    ll->next  = istk->expansion;
-                    ll->first = dup_tlist(l->first, NULL);
-                    ll->where = l->where;
-                    istk->expansion = ll;
-                }
+                push_mmacro_body(fm);
                 l = istk->expansion;
                 continue;
             } else {
@@ -8869,16 +10783,28 @@ static Token *pp_tokline(void)
 
             check_mmacro_refcounts();
 
-            istk->expansion = l->next;
-            istk->where = l->where;
             suppressed = l->suppressed;
 
+            if (l->replay) {
+                const struct mbody_line *bl = &l->replay->body[l->pos++];
+
+                istk->where = bl->line->where;
+                tline = dup_tlist(bl->line->first, NULL);
+                params = bl->params;
+                if (l->pos < l->replay->nbody)
+                    l = NULL;   /* More lines to come from this body */
+            } else {
+                istk->where = l->where;
+                tline = l->first;
+                l->first = NULL; /* Otherwise double free at free_line() */
+            }
+
+            if (l)
+                istk->expansion = l->next;
+
             if (!istk->noline)
                 src_update(istk->where);
 
-            tline = l->first;
-            l->first = NULL;    /* Otherwise double free at free_line() */
-
             if (!istk->nolist && !suppressed) {
                 char *listline;
                 listline = detoken(tline, false);
@@ -8886,10 +10812,10 @@ static Token *pp_tokline(void)
                 nasm_free(listline);
             }
 
-            free_line(l);
+            if (l)
+                free_line(l);
         } else if ((line = read_line())) {
             tline = tokenize(line);
-            nasm_free(line);
         } else if (istk->expansion) {
             /* read_line() might have modified istk->expansion */
             continue;
@@ -8899,6 +10825,8 @@ static Token *pp_tokline(void)
              */
             Include *i = pop_include_stack();
 
+            if (i == mcache.rec.inc)
+                mcache_finish();
 
             put_mmacro(&i->mstk.mstk);
             put_mmacro(&i->mstk.mmac);
@@ -8921,7 +10849,7 @@ static Token *pp_tokline(void)
          * condition, in which case we don't want to meddle with
          * anything.
          */
-        if (!defining && !suppressed)
+        if (!defining && !suppressed && params)
             tline = expand_mmac_params(tline);
 
         /*
@@ -8977,10 +10905,18 @@ static Token *pp_tokline(void)
 }
 
 char *pp_getline(void)
+{
+    return pp_getline_scan(NULL);
+}
+
+char *pp_getline_scan(struct scanline **scanned)
 {
     char *line = NULL;
     Token *tline;
 
+    if (scanned)
+        *scanned = NULL;
+
     while (true) {
         tline = pp_tokline();
         if (tline == &tok_pop) {
@@ -8995,7 +10931,11 @@ char *pp_getline(void)
              * De-tokenize the line and emit it.
              */
             line = detoken(tline, true);
+            if (scanned)
+                *scanned = scan_tline(tline, line);
             delete_tlist(tline);
+            if (mcache.rec.inc && line[strspn(line, " \t")])
+                mcache_abort();
             break;
         }
     }
@@ -9032,6 +10972,7 @@ void pp_cleanup_pass(void)
         defining = NULL;
     }
 
+    mcache_end_recording();
     while (cstk)
         ctx_pop();
     free_macros();
@@ -9040,15 +10981,33 @@ void pp_cleanup_pass(void)
 
     if (ppdbg & PDBG_MMACROS)
         debug_macro_output();
+
+    cleanup_Tokens();
+}
+
+bool pp_pass_dependent(void)
+{
+    return pass_dependent;
+}
+
+static void free_smac_stamps(void)
+{
+    hash_free_all(&smac_stamps, true);
+    nasm_free(smac_fill.deps);
+    nasm_zero(smac_fill);
 }
 
 void pp_cleanup_session(void)
 {
     nasm_free(use_loaded);
+    nasm_delete(linebuf);
+    linebufsize = 0;
     free_llist(predef);
     predef = NULL;
     free_Blocks();
     ipath_list = NULL;
+    mcache_cleanup();
+    free_smac_stamps();
 }
 
 void pp_include_path(struct strlist *list)
@@ -9308,8 +11267,10 @@ static void check_mmacro_refcounts(void)
     for (i = istk; i; i = i->next) {
         mmac_dbgref(i->mstk.mstk);
         mmac_dbgref(i->mstk.mmac);
-        for (l = i->expansion; l; l = l->next)
+        for (l = i->expansion; l; l = l->next) {
             mmac_dbgref(l->finishes);
+            mmac_dbgref(l->replay);
+        }
     }
 
     mmac_dbgref((MMacro *)src_macro_current());
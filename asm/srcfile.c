@@ -34,25 +34,34 @@ void src_free(void)
     hash_free_all(&filename_hash, false);
 }
 
+/*
+ * Return the unique copy of a filename, so filenames can be compared
+ * by pointer.  The input filename is duplicated if needed.
+ */
+const char *src_intern_fname(const char *name)
+{
+    struct hash_insert hi;
+    void **dp;
+
+    dp = hash_find(&filename_hash, name, &hi);
+    if (dp)
+        return (const char *)(*dp);
+
+    name = nasm_strdup(name);
+    hash_add(&hi, name, (void *)name);
+    return name;
+}
+
 /*
  * Set the current filename, returning the old one.  The input
  * filename is duplicated if needed.
  */
 const char *src_set_fname(const char *newname)
 {
-    struct hash_insert hi;
     const char *oldname;
-    void **dp;
 
-    if (newname) {
-        dp = hash_find(&filename_hash, newname, &hi);
-        if (dp) {
-            newname = (const char *)(*dp);
-        } else {
-            newname = nasm_strdup(newname);
-            hash_add(&hi, newname, (void *)newname);
-        }
-    }
+    if (newname)
+        newname = src_intern_fname(newname);
 
     oldname = _src_bottom->l.filename;
     _src_bottom->l.filename = newname;
@@ -42,6 +42,7 @@ extern struct src_location_stack *_src_error;
 
 void src_init(void);
 void src_free(void);
+const char *src_intern_fname(const char *name);
 const char *src_set_fname(const char *newname);
 static inline const char *src_get_fname(void)
 {
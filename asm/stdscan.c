@@ -30,6 +30,8 @@ struct stdscan_state {
     char *bufptr;
     struct token_stack *pushback;
     enum stdscan_scan_state sstate;
+    const struct scanline *line; /* Pre-scanned tokens, if any */
+    size_t tokpos;               /* Next token in line */
 };
 
 static struct stdscan_state scan;
@@ -71,6 +73,18 @@ static void stdscan_pushback_pop(void)
 }
 
 void stdscan_reset(char *buffer)
+{
+    stdscan_reset_line(buffer, NULL);
+}
+
+/*
+ * Scan a line which the preprocessor has already split into tokens,
+ * see pp_getline_scan(). The tokens are only used as long as they
+ * match the position in the buffer; anything else, e.g. a
+ * stdscan_reset() or stdscan_set() to somewhere else in the line,
+ * simply falls back to scanning the text.
+ */
+void stdscan_reset_line(char *buffer, const struct scanline *line)
 {
     while (stdscan_templen > 0)
         stdscan_pop();
@@ -80,6 +94,8 @@ void stdscan_reset(char *buffer)
 
     scan.bufptr   = buffer;
     scan.sstate   = ss_init;
+    scan.line     = line;
+    scan.tokpos   = 0;
 }
 
 /*
@@ -255,6 +271,35 @@ static int stdscan_parse_braces(struct tokenval *tv)
 
 static int stdscan_token(struct tokenval *tv);
 
+/*
+ * Return the next pre-scanned token, or TOKEN_INVALID if it has to
+ * be scanned from the text.
+ */
+static int stdscan_line(struct tokenval *tv)
+{
+    const struct tokenval *st;
+    char *p = nasm_skip_spaces(scan.bufptr);
+
+    if (scan.tokpos >= scan.line->ntokens ||
+        scan.line->tokens[scan.tokpos].t_start != p) {
+        /* Out of step with the text */
+        scan.line = NULL;
+        return TOKEN_INVALID;
+    }
+
+    st = &scan.line->tokens[scan.tokpos++];
+    if (st->t_type == TOKEN_INVALID)
+        return TOKEN_INVALID;
+
+    *tv = *st;
+    scan.bufptr = p + st->t_len;
+
+    if (unlikely(tv->t_flag & TFLAG_WARN))
+        nasm_warn(WARN_PTR, "`%s' is not a NASM keyword", tv->t_charptr);
+
+    return tv->t_type;
+}
+
 int stdscan(void *private_data, struct tokenval *tv)
 {
     int i;
@@ -268,6 +313,12 @@ int stdscan(void *private_data, struct tokenval *tv)
         return tv->t_type;
     }
 
+    if (scan.line) {
+        i = stdscan_line(tv);
+        if (i != TOKEN_INVALID)
+            return i;
+    }
+
     nasm_zero(*tv);
 
     scan.bufptr = nasm_skip_spaces(scan.bufptr);
@@ -289,11 +340,11 @@ static int stdscan_symbol(struct tokenval *tv)
     const char *r = p;
     size_t len;
 
-    p++;                        /* Leading character already verified */
-
-    /* Skip the entire symbol but only copy up to IDLEN_MAX characters */
-    while (nasm_isidchar(*p))
-        p++;
+    /*
+     * Skip the entire symbol, the leading character already verified,
+     * but only copy up to IDLEN_MAX characters
+     */
+    p = (char *)nasm_skip_idchars(p + 1);
 
     scan.bufptr = p;
     len = p - r;
@@ -305,6 +356,70 @@ static int stdscan_symbol(struct tokenval *tv)
     return tv->t_type = TOKEN_ID;
 }
 
+/*
+ * Look up an identifier as stdscan_token() does, but without any
+ * side effects.
+ */
+static int stdscan_keyword(struct tokenval *tv)
+{
+    if (tv->t_len <= MAX_KEYWORD) {
+        /* Check to see if it is a keyword of some kind */
+        int token_type = nasm_token_hashn(tv->t_charptr, tv->t_len, tv);
+
+        if (likely(!(tv->t_flag & TFLAG_BRC))) {
+            /* most of the tokens fall into this case */
+            return token_type;
+        }
+    }
+    return tv->t_type = TOKEN_ID;
+}
+
+/*
+ * Pre-scan a token of a line for stdscan_reset_line(), if that can
+ * be done without side effects; otherwise set t_type to
+ * TOKEN_INVALID so it will be scanned from the text. The name of an
+ * identifier is copied to buf, which must have room for len+1
+ * bytes. Returns the number of bytes of buf used.
+ */
+size_t stdscan_prescan(struct tokenval *tv, const char *p, size_t len,
+                       char *buf)
+{
+    size_t i, n;
+
+    nasm_zero(*tv);
+    tv->t_start = p;
+    tv->t_len   = len;
+    tv->t_type  = TOKEN_INVALID;
+
+    if (nasm_isidstart(*p)) {
+        if ((size_t)(nasm_skip_idchars(p + 1) - p) < len)
+            return 0;
+
+        n = len < IDLEN_MAX ? len : IDLEN_MAX - 1;
+        memcpy(buf, p, n);
+        buf[n] = '\0';
+        tv->t_charptr = buf;
+        tv->t_len = n;
+        stdscan_keyword(tv);
+        tv->t_len = len;
+        return n + 1;
+    } else if (nasm_isdigit(*p) && len <= 18) {
+        /* A plain decimal number can't overflow or be malformed */
+        int64_t v = 0;
+
+        for (i = 0; i < len; i++) {
+            if (!nasm_isdigit(p[i]))
+                return 0;
+            v = v * 10 + (p[i] - '0');
+        }
+
+        tv->t_integer = v;
+        tv->t_type = TOKEN_NUM;
+    }
+
+    return 0;
+}
+
 static int stdscan_token(struct tokenval *tv)
 {
     const char *r;
@@ -312,22 +427,13 @@ static int stdscan_token(struct tokenval *tv)
     /* we have a token; either an id, a number, operator or char */
     if (nasm_isidstart(*scan.bufptr)) {
         stdscan_symbol(tv);
+        stdscan_keyword(tv);
 
-        if (tv->t_len <= MAX_KEYWORD) {
-            /* Check to see if it is a keyword of some kind */
-            int token_type = nasm_token_hash(tv->t_charptr, tv);
-
-            if (unlikely(tv->t_flag & TFLAG_WARN)) {
-                nasm_warn(WARN_PTR, "`%s' is not a NASM keyword",
-                          tv->t_charptr);
-            }
-
-            if (likely(!(tv->t_flag & TFLAG_BRC))) {
-                /* most of the tokens fall into this case */
-                return token_type;
-            }
+        if (unlikely(tv->t_flag & TFLAG_WARN)) {
+            nasm_warn(WARN_PTR, "`%s' is not a NASM keyword",
+                      tv->t_charptr);
         }
-        return tv->t_type = TOKEN_ID;
+        return tv->t_type;
     } else if (*scan.bufptr == '$' &&
                (!globl.dollarhex || !nasm_isdigit(scan.bufptr[1]))) {
         /*
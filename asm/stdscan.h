@@ -15,9 +15,13 @@ void stdscan_set(const struct stdscan_state *);
 const struct stdscan_state *stdscan_get(void);
 char * pure_func stdscan_tell(void);
 void stdscan_reset(char *buffer);
+void stdscan_reset_line(char *buffer, const struct scanline *line);
+size_t stdscan_prescan(struct tokenval *tv, const char *p, size_t len,
+                       char *buf);
 int stdscan(void *pvt, struct tokenval *tv);
 void stdscan_pushback(const struct tokenval *tv);
 int nasm_token_hash(const char *token, struct tokenval *tv);
+int nasm_token_hashn(const char *token, size_t len, struct tokenval *tv);
 void stdscan_cleanup(void);
 
 #endif
@@ -184,7 +184,12 @@ if ($output eq 'h') {
     print "};\n";
     print "\n";
 
-    print "int nasm_token_hash(const char *token, struct tokenval *tv)\n";
+    print "/*\n";
+    print " * Look up a token of known length; the token does not need to be\n";
+    print " * null-terminated, so the scanner can hash it in place.\n";
+    print " */\n";
+    print "int nasm_token_hashn(const char *token, size_t len,\n";
+    print "                     struct tokenval *tv)\n";
     print "{\n";
 
     # Put a large value in unused slots.  This makes it extremely unlikely
@@ -212,17 +217,17 @@ if ($output eq 'h') {
     print  "    uint16_t ix;\n";
     print  "    const struct tokendata *data;\n";
     printf "    char lcbuf[%d];\n", $max_len+1;
-    print  "    const char *p = token;\n";
-    print  "    char c, *q = lcbuf;\n";
-    print  "    size_t len = 0;\n";
+    print  "    size_t i;\n";
+    print  "    char c;\n";
     printf "    uint64_t crc = UINT64_C(0x%08x%08x);\n", $$sv[0], $$sv[1];
     print  "\n";
-    print  "    while ((c = *p++)) {\n";
-    printf "        if (++len > %d)\n", $max_len;
-    print  "            goto notfound;\n";
-    print  "        *q++ = c = nasm_tolower(c);\n";
+    printf "    if (len > %d)\n", $max_len;
+    print  "        goto notfound;\n";
+    print  "\n";
+    print  "    for (i = 0; i < len; i++) {\n";
+    print  "        lcbuf[i] = c = nasm_tolower(token[i]);\n";
     print  "        crc = crc64_byte(crc, c);\n";
-    print  "    };\n";
+    print  "    }\n";
     print  "\n";
     printf "    k1 = ((uint32_t)crc & 0x%x) + 0;\n", $n-2;
     printf "    k2 = ((uint32_t)(crc >> 32) & 0x%x) + 1;\n", $n-2;
@@ -249,4 +254,10 @@ if ($output eq 'h') {
     print  "    tv->t_flag    = 0;\n";
     print  "    return tv->t_type = TOKEN_ID;\n";
     print  "}\n";
+    print  "\n";
+    print  "int nasm_token_hash(const char *token, struct tokenval *tv)\n";
+    print  "{\n";
+    printf "    return nasm_token_hashn(token, strnlen(token, %d), tv);\n",
+        $max_len+1;
+    print  "}\n";
 }
@@ -0,0 +1,53 @@
+# generated automatically by aclocal 1.16.5 -*- Autoconf -*-
+
+# Copyright (C) 1996-2021 Free Software Foundation, Inc.
+
+# This file is free software; the Free Software Foundation
+# gives unlimited permission to copy and/or distribute it,
+# with or without modifications, as long as this notice is preserved.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY, to the extent permitted by law; without
+# even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+# PARTICULAR PURPOSE.
+
+m4_ifndef([AC_CONFIG_MACRO_DIRS], [m4_defun([_AM_CONFIG_MACRO_DIRS], [])m4_defun([AC_CONFIG_MACRO_DIRS], [_AM_CONFIG_MACRO_DIRS($@)])])
+m4_include([autoconf/m4/pa_add_cflags.m4])
+m4_include([autoconf/m4/pa_add_cppflags.m4])
+m4_include([autoconf/m4/pa_add_flags.m4])
+m4_include([autoconf/m4/pa_add_headers.m4])
+m4_include([autoconf/m4/pa_add_langflags.m4])
+m4_include([autoconf/m4/pa_add_ldflags.m4])
+m4_include([autoconf/m4/pa_arg_bool.m4])
+m4_include([autoconf/m4/pa_arg_disabled.m4])
+m4_include([autoconf/m4/pa_arg_enabled.m4])
+m4_include([autoconf/m4/pa_attribute_syntax.m4])
+m4_include([autoconf/m4/pa_c_typeof.m4])
+m4_include([autoconf/m4/pa_check_bad_stdc_inline.m4])
+m4_include([autoconf/m4/pa_common_attributes.m4])
+m4_include([autoconf/m4/pa_cross_compile.m4])
+m4_include([autoconf/m4/pa_csym.m4])
+m4_include([autoconf/m4/pa_endian.m4])
+m4_include([autoconf/m4/pa_find_flags.m4])
+m4_include([autoconf/m4/pa_find_func.m4])
+m4_include([autoconf/m4/pa_flags_langlist.m4])
+m4_include([autoconf/m4/pa_func_attribute.m4])
+m4_include([autoconf/m4/pa_func_attribute_error.m4])
+m4_include([autoconf/m4/pa_func_snprintf.m4])
+m4_include([autoconf/m4/pa_func_vsnprintf.m4])
+m4_include([autoconf/m4/pa_have_func.m4])
+m4_include([autoconf/m4/pa_have_func_name.m4])
+m4_include([autoconf/m4/pa_lang_flagvar.m4])
+m4_include([autoconf/m4/pa_lang_foreach.m4])
+m4_include([autoconf/m4/pa_lang_seen_list.m4])
+m4_include([autoconf/m4/pa_lang_seen_set.m4])
+m4_include([autoconf/m4/pa_libext.m4])
+m4_include([autoconf/m4/pa_option_debug.m4])
+m4_include([autoconf/m4/pa_option_gc.m4])
+m4_include([autoconf/m4/pa_option_lto.m4])
+m4_include([autoconf/m4/pa_option_profiling.m4])
+m4_include([autoconf/m4/pa_option_sanitizer.m4])
+m4_include([autoconf/m4/pa_prog_cc.m4])
+m4_include([autoconf/m4/pa_shsym.m4])
+m4_include([autoconf/m4/pa_sym.m4])
+m4_include([autoconf/m4/pa_variadic_macros.m4])
@@ -21,35 +21,6 @@
 #define fetch_or_return(_start, _ptr, _size, _need)         \
     fetch_safe(_start, _ptr, _size, _need, return 0)
 
-/*
- * Flags that go into the `segment' field of `operand' structures
- */
-#define SEG_RELATIVE    1
-#define SEG_RMREG       2
-#define SEG_NODISP      4
-#define SEG_DISP8       8
-#define SEG_DISP16     16
-#define SEG_DISP32     32
-#define SEG_DISP64     64
-#define SEG_DISPMASK  (SEG_NODISP|SEG_DISP8|SEG_DISP16|SEG_DISP32|SEG_DISP64)
-#define SEG_SIGNED    128
-#define SEG_RMMEM     256
-#define SEG_DFV       512
-#define SEG_16BIT     (16 << 8)
-#define SEG_32BIT     (32 << 8)
-#define SEG_64BIT     (64 << 8)
-#define SEG_BITMASK   (SEG_16BIT|SEG_32BIT|SEG_64BIT)
-
-/* These get the address size associated with *one particular operand* */
-static inline uint32_t seg_set_asize(uint32_t seg, unsigned int asize)
-{
-    return (seg & ~SEG_BITMASK) | (asize << 8);
-}
-static inline unsigned int seg_get_asize(uint32_t seg)
-{
-    return (seg & SEG_BITMASK) >> 8;
-}
-
 /*
  * Important: regval must already have been adjusted for rex extensions;
  * the rex flags are only used to determine which 8-bit register decoding
@@ -1314,24 +1285,29 @@ static void remove_redundant_sizes(insn *ins)
     }
 }
 
-int32_t disasm(const uint8_t *dp, int32_t data_size,
-               char *output, int outbufsize,
-               int bits, int64_t offset, int autosync,
-               iflag_t *prefer)
+/*
+ * Decode one instruction into a structured record, without any text
+ * formatting.  Returns the length of the instruction, or 0 if no
+ * valid instruction could be decoded.  This does not touch any global
+ * state, so it is safe to use from multiple threads.
+ */
+int32_t disasm_decode(struct disasm_insn *di, const uint8_t *dp,
+                      int32_t data_size, int bits, int64_t offset,
+                      iflag_t *prefer)
 {
-    const struct itemplate * const * const *ix;
-    const struct itemplate * const *p;
+    const struct disasm_itemplate * const *ix;
+    const struct disasm_itemplate *p;
     const struct itemplate *itemp, *best_itemp;
     int length, best_length = 0;
     int maxlen = 15;
-    int i, slen;
-    char separator;
+    int i;
     const uint8_t *origdata = dp;
     int works;
-    insn ins;
+    insn * const ins = &di->ins;
     iflag_t goodness, best;
     int best_pref;
     struct prefix_info prefix;
+    uint32_t state;
 
     /*
      * Scan for prefixes.
@@ -1364,10 +1340,30 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
     if (!p)
         return 0;               /* No instructions for this opcode */
 
-    nasm_zero(ins);
-    while ((itemp = *p++)) {
+    /*
+     * Most candidates can be rejected on the prefixes and the byte
+     * following the opcode alone, without running matches().
+     */
+    state = dp[1];
+    if ((dp[1] & 0xc0) == 0xc0)
+        state |= DFILT_MOD3;
+    if (prefix.osp)
+        state |= DFILT_66;
+    if (prefix.rep == 0xF2)
+        state |= DFILT_F2;
+    else if (prefix.rep == 0xF3)
+        state |= DFILT_F3;
+    state |= (prefix.rex.pp << DFILT_PP_SHIFT) |
+        (prefix.rex.l << DFILT_L_SHIFT) |
+        (prefix.rex.w ? DFILT_W : 0);
+
+    nasm_zero(*ins);
+    for (; (itemp = p->itemp); p++) {
         insn tmp_ins;
 
+        if ((state ^ p->match) & p->mask)
+            continue;
+
         nasm_zero(tmp_ins);
         tmp_ins.loc.offset = offset;
         tmp_ins.bits       = bits;
@@ -1430,7 +1426,7 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
                     best_itemp = itemp;
                     best_pref = nprefix;
                     best_length = length;
-                    ins = tmp_ins;
+                    *ins = tmp_ins;
                 }
 
                 if (itemp_has(itemp, IF_BESTDIS))
@@ -1442,9 +1438,41 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
     if (!best_itemp)
         return 0;               /* no instruction was matched */
 
-    /* Pick the best match */
-    itemp = best_itemp;
-    length = best_length;
+    length = best_length + (dp - origdata); /* fix up for prefixes */
+
+    /* Resolve relative operands to their target address */
+    di->has_target = false;
+    for (i = 0; i < ins->operands; i++) {
+        struct operand *o = &ins->oprs[i];
+
+        if (o->segment & SEG_RELATIVE) {
+            int nasize = 64 - seg_get_asize(o->segment);
+            uint64_t target = o->offset + offset + length;
+
+            /* sort out wraparound */
+            o->offset = target << nasize >> nasize;
+            di->target = o->offset;
+            di->has_target = true;
+        }
+    }
+
+    di->prefix = prefix;
+    di->length = length;
+    return length;
+}
+
+/*
+ * Format a decoded instruction as text.  Returns the length of the
+ * string written to output.
+ */
+int disasm_format(const struct disasm_insn *di, char *output, int outbufsize)
+{
+    const struct prefix_info * const prefix = &di->prefix;
+    const struct itemplate * const best_itemp = di->ins.itemp;
+    const int bits = di->ins.bits;
+    int i, slen;
+    char separator;
+    insn ins = di->ins;
 
     slen = 0;
 
@@ -1460,23 +1488,18 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
     remove_redundant_sizes(&ins);
 
     separator = ' ';
-    length += dp - origdata;  /* fix up for prefixes */
     for (i = 0; i < ins.operands; i++) {
-        decoflags_t deco = itemp->deco[i];
+        decoflags_t deco = best_itemp->deco[i];
         const operand *o = &ins.oprs[i];
         opflags_t t = o->type;
         int64_t offs = o->offset;
         int asize = seg_get_asize(o->segment);
         int nasize = 64 - asize; /* Address bits to mask off */
+        enum disasm_opkind kind;
 
         output[slen++] = separator;
 
         if (o->segment & SEG_RELATIVE) {
-            /*
-             * sort out wraparound
-             */
-            offs += ins.loc.offset + length;
-            offs = (uint64_t)offs << nasize >> nasize;
             if ((t & (IMMEDIATE|SIZE_MASK)) == IMMEDIATE) {
                 if (asize != bits) {
                     switch (asize) {
@@ -1492,18 +1515,12 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
                     }
                 }
             }
-
-            /*
-             * add sync marker, if autosync is on
-             */
-            if (autosync)
-                add_sync(offs, 0L);
         }
 
         separator = (t & COLON) ? ':' : ',';
 
-        if ((t & (REGISTER | FPUREG)) ||
-                (o->segment & SEG_RMREG)) {
+        kind = disasm_opkind(o);
+        if (kind == DOK_REG) {
             enum reg_enum reg = o->basereg;
             if (t & TO)
                 slen += snprintf(output + slen, outbufsize - slen, "to ");
@@ -1514,8 +1531,8 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
                                  (int)((t & REGSET_MASK) >> (REGSET_SHIFT-1))-1);
             if (deco)
                 slen += append_evex_reg_deco(output + slen, outbufsize - slen,
-                                             deco, &prefix);
-        } else if (t & IMMEDIATE) {
+                                             deco, prefix);
+        } else if (kind == DOK_IMM) {
             if (is_class(UNITY, t)) {
                 output[slen++] = '1';
             } else if (o->segment & SEG_DFV) {
@@ -1569,7 +1586,7 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
                     snprintf(output + slen, outbufsize - slen, "0x%"PRIx64"",
                              offs);
             }
-        } else if (is_class(REGMEM, t)) {
+        } else if (kind == DOK_MEM) {
             int started = false;
 
             if (t & BITS8)
@@ -1587,7 +1604,7 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
             if (t & BITS80)
                 slen +=
                     snprintf(output + slen, outbufsize - slen, "tword ");
-            if (prefix.rex.b && (deco & BRDCAST_MASK)) {
+            if (prefix->rex.b && (deco & BRDCAST_MASK)) {
                 /* when broadcasting, each element size should be used */
                 if (deco & BR_BITS16)
                     slen +=
@@ -1616,10 +1633,10 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
                     snprintf(output + slen, outbufsize - slen, "near ");
             output[slen++] = '[';
 
-            if (prefix.segover) {
+            if (prefix->segover) {
                 slen +=
                     snprintf(output + slen, outbufsize - slen, "%s:",
-                             prefix_name(prefix.segover));
+                             prefix_name(prefix->segover));
             }
             if (o->basereg) {
                 slen += snprintf(output + slen, outbufsize - slen, "%s",
@@ -1705,7 +1722,7 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
 
             if (deco)
                 slen += append_evex_mem_deco(output + slen, outbufsize - slen,
-                                             t, deco, &prefix);
+                                             t, deco, prefix);
         } else {
             slen +=
                 snprintf(output + slen, outbufsize - slen, "<operand%d>",
@@ -1713,6 +1730,29 @@ int32_t disasm(const uint8_t *dp, int32_t data_size,
         }
     }
     output[slen] = '\0';
+    return slen;
+}
+
+/*
+ * Decode and format one instruction, adding a sync point at its
+ * branch target if autosync is on.
+ */
+int32_t disasm(const uint8_t *dp, int32_t data_size,
+               char *output, int outbufsize,
+               int bits, int64_t offset, int autosync,
+               iflag_t *prefer)
+{
+    struct disasm_insn di;
+    int32_t length;
+
+    length = disasm_decode(&di, dp, data_size, bits, offset, prefer);
+    if (!length)
+        return 0;
+
+    if (autosync && di.has_target)
+        add_sync(di.target, 0L);
+
+    disasm_format(&di, output, outbufsize);
     return length;
 }
 
@@ -81,6 +81,75 @@ struct prefix_info {
 const uint8_t *parse_prefixes(struct prefix_info *pf, const uint8_t *data,
                               int bits);
 
+/*
+ * Flags that go into the `segment' field of `operand' structures
+ */
+#define SEG_RELATIVE    1
+#define SEG_RMREG       2
+#define SEG_NODISP      4
+#define SEG_DISP8       8
+#define SEG_DISP16     16
+#define SEG_DISP32     32
+#define SEG_DISP64     64
+#define SEG_DISPMASK  (SEG_NODISP|SEG_DISP8|SEG_DISP16|SEG_DISP32|SEG_DISP64)
+#define SEG_SIGNED    128
+#define SEG_RMMEM     256
+#define SEG_DFV       512
+#define SEG_16BIT     (16 << 8)
+#define SEG_32BIT     (32 << 8)
+#define SEG_64BIT     (64 << 8)
+#define SEG_BITMASK   (SEG_16BIT|SEG_32BIT|SEG_64BIT)
+
+/* These get the address size associated with *one particular operand* */
+static inline uint32_t seg_set_asize(uint32_t seg, unsigned int asize)
+{
+    return (seg & ~SEG_BITMASK) | (asize << 8);
+}
+static inline unsigned int seg_get_asize(uint32_t seg)
+{
+    return (seg & SEG_BITMASK) >> 8;
+}
+
+/*
+ * A decoded instruction.  ins is the instruction as filled in by the
+ * template matcher: ins.opcode is the mnemonic, ins.prefixes[] the
+ * prefixes to display and ins.oprs[] the operands, with the operand
+ * class in type and the registers, displacement or immediate in
+ * basereg, indexreg, scale and offset.  Relative operands
+ * (SEG_RELATIVE) have already been resolved to the absolute target.
+ */
+struct disasm_insn {
+    insn ins;                   /* Instruction and operands */
+    struct prefix_info prefix;  /* Prefixes as decoded */
+    int32_t length;             /* Length in bytes, including prefixes */
+    bool has_target;            /* Has a relative branch target */
+    uint64_t target;            /* Branch target address */
+};
+
+int32_t disasm_decode(struct disasm_insn *di, const uint8_t *dp,
+                      int32_t data_size, int bits, int64_t offset,
+                      iflag_t *prefer);
+int disasm_format(const struct disasm_insn *di, char *output, int outbufsize);
+
+/* Operand kinds, as used by disasm_format() */
+enum disasm_opkind {
+    DOK_OTHER,
+    DOK_REG,                    /* Register, in basereg */
+    DOK_IMM,                    /* Immediate or branch target, in offset */
+    DOK_MEM                     /* Memory reference */
+};
+
+static inline enum disasm_opkind disasm_opkind(const struct operand *o)
+{
+    if ((o->type & (REGISTER | FPUREG)) || (o->segment & SEG_RMREG))
+        return DOK_REG;
+    if (o->type & IMMEDIATE)
+        return DOK_IMM;
+    if (is_class(REGMEM, o->type))
+        return DOK_MEM;
+    return DOK_OTHER;
+}
+
 #define fetch_safe(_start, _ptr, _size, _need, _op)         \
     do {                                                    \
         if (((_ptr) - (_start)) >= ((_size) - (_need)))     \
@@ -22,18 +22,28 @@ const char *_progname;
 
 static int bpl = 8;             /* bytes per line of hex dump */
 
+#define INPUT_BUFSIZE   ((size_t)1 << 16)   /* Read buffer if not mapped */
+#define OUTPUT_BUFSIZE  ((size_t)1 << 20)   /* stdout buffer */
+
+static const char xdigit[] = "0123456789ABCDEF";
+
 static void output_ins(uint64_t, const uint8_t *, int, const char *);
 static bool skip(off_t *posp, off_t dist, FILE *fp);
 
 int main(int argc, char **argv)
 {
-    uint8_t buffer[INSN_MAX * 2], *p;
-    const uint8_t *q;
+    uint8_t *buffer = NULL;
+    const uint8_t *p, *q;
+    const uint8_t *map = NULL;
+    uint8_t tail[INSN_MAX];
+    struct disasm_insn di;
     char outbuf[256];
     char *pname = *argv;
     char *filename = NULL;
     uint64_t nextsync, synclen;
-    size_t lenread;
+    uint64_t limit, avail;
+    size_t lendis;
+    size_t maplen = 0;
     bool autosync = false;
     int bits = 16, b;
     bool eof;
@@ -265,37 +275,77 @@ int main(int argc, char **argv)
 
     reset_global_defaults(bits);
 
+    /*
+     * Map the input file if possible, so the instructions can be
+     * decoded in place; otherwise read it through a buffer.
+     */
+    if (fp != stdin) {
+        off_t size = nasm_file_size(fp);
+
+        if (size > initskip) {
+            uint64_t len = size - initskip;
+            if (len > datamax)
+                len = datamax;
+            map = nasm_map_file(fp, initskip, len);
+            if (map)
+                maplen = len;
+        }
+    }
+
     fileoffs = 0;
     dataread = 0;
-    if (!skip(&fileoffs, initskip, fp))
-        return 1;               /* EOF before header */
+    if (map) {
+        q = map;
+        p = map + maplen;
+        eof = true;
+    } else {
+        if (!skip(&fileoffs, initskip, fp))
+            return 1;           /* EOF before header */
+        q = p = buffer = nasm_malloc(INPUT_BUFSIZE);
+        eof = false;
+    }
+
+    setvbuf(stdout, nasm_malloc(OUTPUT_BUFSIZE), _IOFBF, OUTPUT_BUFSIZE);
 
     /*
-     * This main loop is really horrible, and wants rewriting with
-     * an axe. It'll stay the way it is for a while though, until I
-     * find the energy...
+     * [q, p) is the data not yet disassembled, which starts at
+     * offset.  Instructions are not allowed to extend past the next
+     * sync point; the data is only ever read up to it.
      */
-
-    q = p = buffer;
     nextsync = next_sync(offset, &synclen);
-    lenread = 0;
-    eof = false;
-
-    while (lenread > 0 || (dataread < datamax && !eof && !feof(fp))) {
-        size_t to_read = buffer + sizeof(buffer) - p;
-	if ((nextsync || synclen) &&
-	    to_read > nextsync - offset - (p - q))
-            to_read = nextsync - offset - (p - q);
-        if (to_read > datamax - dataread)
-            to_read = datamax - dataread;
-
-        lenread = 0;
-        if (to_read) {
-            lenread = fread(p, 1, to_read, fp);
-            dataread += lenread;
-            fileoffs += lenread;
-            p += lenread;
-            eof |= !lenread; /* help along systems with bad feof */
+
+    for (;;) {
+        limit = UINT64_MAX;
+        if ((nextsync || synclen) && nextsync >= offset)
+            limit = nextsync - offset;
+
+        avail = p - q;
+        if (!eof && avail < INSN_MAX && avail < limit) {
+            size_t to_read;
+
+            memmove(buffer, q, avail);
+            q = buffer;
+            p = buffer + avail;
+
+            to_read = 0;
+            if (dataread < datamax) {
+                to_read = INPUT_BUFSIZE - avail;
+                if (to_read > limit - avail)
+                    to_read = limit - avail;
+                if (to_read > datamax - dataread)
+                    to_read = datamax - dataread;
+            }
+
+            if (to_read) {
+                size_t lenread = fread(buffer + avail, 1, to_read, fp);
+                dataread += lenread;
+                fileoffs += lenread;
+                p += lenread;
+                eof = !lenread;
+            } else {
+                eof = true;
+            }
+            continue;
         }
 
         if ((nextsync || synclen) && offset == nextsync) {
@@ -303,61 +353,109 @@ int main(int argc, char **argv)
                 fprintf(stdout, "%08"PRIX64"  skipping 0x%"PRIX64" bytes\n",
 			offset, synclen);
                 offset += synclen;
-                dataread += synclen;
-                eof |= skip(&fileoffs, synclen, fp);
+                if (map) {
+                    q += (synclen < avail) ? synclen : avail;
+                } else {
+                    dataread += synclen;
+                    eof = !skip(&fileoffs, synclen, fp);
+                }
             }
-            q = p = buffer;
             nextsync = next_sync(offset, &synclen);
+            continue;
         }
-        while (p > q && (p - q >= INSN_MAX || lenread == 0)) {
-            size_t lendis = disasm(q, INSN_MAX, outbuf, sizeof(outbuf),
-                                   bits, offset, autosync, &prefer);
-            if (!lendis || q + lendis > p ||
-                ((nextsync || synclen) && lendis > nextsync - offset))
-                lendis = eatbyte(*q, outbuf, sizeof(outbuf), bits);
-            output_ins(offset, q, lendis, outbuf);
-            q += lendis;
-            offset += lendis;
+
+        if (!avail)
+            break;
+
+        /*
+         * Near the end of the data, decode from a zero-padded copy
+         * so that nothing beyond it is looked at.  An instruction
+         * which turns out not to fit is neither formatted nor allowed
+         * to add a sync point.
+         */
+        if (avail > limit)
+            avail = limit;
+        if (avail >= INSN_MAX) {
+            lendis = disasm_decode(&di, q, INSN_MAX, bits, offset, &prefer);
+        } else {
+            memcpy(tail, q, avail);
+            memset(tail + avail, 0, sizeof(tail) - avail);
+            lendis = disasm_decode(&di, tail, INSN_MAX, bits, offset,
+                                   &prefer);
         }
-        if (q >= buffer + INSN_MAX) {
-            int count = p - q;
-            memmove(buffer, q, count);
-            p -= (q - buffer);
-            q = buffer;
+        if (!lendis || lendis > avail) {
+            lendis = eatbyte(*q, outbuf, sizeof(outbuf), bits);
+        } else {
+            if (autosync && di.has_target)
+                add_sync(di.target, 0L);
+            disasm_format(&di, outbuf, sizeof(outbuf));
         }
+        output_ins(offset, q, lendis, outbuf);
+        q += lendis;
+        offset += lendis;
     }
 
+    fflush(stdout);
+
+    if (map)
+        nasm_unmap_file(map, maplen);
+    nasm_free(buffer);
+
     if (fp != stdin)
         fclose(fp);
 
     return 0;
 }
 
+/*
+ * Format one instruction into a line buffer and write it out in one
+ * go; this is called for every instruction, so avoid printf for the
+ * hex dump.
+ */
 static void output_ins(uint64_t offset, const uint8_t *data,
                        int datalen, const char *insn)
 {
+    char line[1024];
+    char *lp;
     int bytes;
     int addrwidth;
-    addrwidth = fprintf(stdout, "%08"PRIX64"  ", offset);
+    size_t inslen;
+
+    addrwidth = snprintf(line, sizeof line, "%08"PRIX64"  ", offset);
+    lp = line + addrwidth;
 
     bytes = 0;
     while (datalen > 0 && bytes < bpl) {
-        fprintf(stdout, "%02X", *data++);
+        *lp++ = xdigit[*data >> 4];
+        *lp++ = xdigit[*data++ & 15];
         bytes++;
         datalen--;
     }
 
-    fprintf(stdout, "%*s  %s\n", (bpl - bytes) << 1, "", insn);
+    memset(lp, ' ', ((bpl - bytes) << 1) + 2);
+    lp += ((bpl - bytes) << 1) + 2;
+    inslen = strlen(insn);
+    if (inslen > sizeof line - (lp - line) - 1)
+        inslen = sizeof line - (lp - line) - 1;
+    memcpy(lp, insn, inslen);
+    lp += inslen;
+    *lp++ = '\n';
+    fwrite(line, 1, lp - line, stdout);
 
     while (datalen > 0) {
-        fprintf(stdout, "%*s", addrwidth, "-");
+        lp = line;
+        memset(lp, ' ', addrwidth - 1);
+        lp += addrwidth - 1;
+        *lp++ = '-';
         bytes = 0;
         while (datalen > 0 && bytes < bpl) {
-            fprintf(stdout, "%02X", *data++);
+            *lp++ = xdigit[*data >> 4];
+            *lp++ = xdigit[*data++ & 15];
             bytes++;
             datalen--;
         }
-        putchar('\n');
+        *lp++ = '\n';
+        fwrite(line, 1, lp - line, stdout);
     }
 }
 
@@ -119,6 +119,7 @@ const char *error_pfx(errflags severity);
 struct errinfo {
     FILE *file;                 /* Error output file pointer */
     errflags worst;             /* Worst severity class encountered */
+    uint64_t diagnostics;       /* Diagnostics raised, even if suppressed */
     errflags never;             /* Error flags to unconditionally suppress */
     unsigned int debug_nasm;    /* Debug message level */
     unsigned int verbose_info;  /* Info message level */
@@ -59,6 +59,15 @@ void **hash_findi(struct hash_table *head, const char *string,
 		struct hash_insert *insert);
 void **hash_findib(struct hash_table *head, const void *key, size_t keylen,
                    struct hash_insert *insert);
+void **hash_findibh(struct hash_table *head, const void *key, size_t keylen,
+                    uint64_t hash, struct hash_insert *insert);
+
+/* The hash value hash_findib() computes for a key */
+static inline uint64_t hash_keyi(const void *key, size_t keylen)
+{
+    return crc64ib(CRC64_INIT, key, keylen);
+}
+
 void **hash_add(struct hash_insert *insert, const void *key, void *data);
 static inline void hash_iterator_init(const struct hash_table *head,
                                       struct hash_iterator *iterator)
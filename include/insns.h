@@ -29,17 +29,44 @@ static inline bool itemp_has(const struct itemplate *itemp, unsigned int bit)
     return iflag_test(&insns_flags[itemp->iflag_idx], bit);
 }
 
-/* Disassembler table structure */
+/*
+ * Disassembler table structure: a candidate template for a given
+ * opcode byte, with a quick reject filter.  The candidate can only
+ * match if ((state ^ match) & mask) == 0, where state is made up of
+ * the DFILT_* bits below, as computed from the prefixes and the byte
+ * following the primary opcode.
+ */
+struct disasm_itemplate {
+    const struct itemplate *itemp;
+    uint32_t mask, match;
+};
+
+#define DFILT_NEXT      0x000ff     /* Byte following the opcode */
+#define DFILT_66        0x00100     /* 66 prefix present */
+#define DFILT_F2        0x00200     /* F2 prefix present */
+#define DFILT_F3        0x00400     /* F3 prefix present */
+#define DFILT_MOD3      0x00800     /* Following byte has mod == 3 */
+#define DFILT_PP        0x03000     /* VEX/EVEX pp field */
+#define DFILT_PP_SHIFT  12
+#define DFILT_L         0x0c000     /* VEX L field */
+#define DFILT_L_SHIFT   14
+#define DFILT_W         0x10000     /* VEX/EVEX W field */
 
 /* Instruction tables for the assembler */
 struct itemplate_list {
     unsigned int ntemp;
     const struct itemplate *temp;
+    /*
+     * Template indices grouped by operand count: the templates with
+     * N operands are temp[byops[byops[N]]] up to, but not including,
+     * temp[byops[byops[N+1]]], in their original order.
+     */
+    const uint16_t *byops;
 };
 extern const struct itemplate_list nasm_instructions[];
 
 /* Instruction tables for the disassembler */
-extern const struct itemplate * const * const * const ndisasm_itable[];
+extern const struct disasm_itemplate * const * const ndisasm_itable[];
 
 /* Common table for the byte codes */
 extern const uint8_t nasm_bytecodes[];
@@ -23,6 +23,8 @@ enum label_type {
 };
 
 enum label_type lookup_label(const char *label, int32_t *segment, int64_t *offset);
+enum label_type lookup_label_pass(const char *label, int32_t *segment,
+                                  int64_t *offset, bool *current);
 static inline bool is_extern(enum label_type type)
 {
     return type == LBL_EXTERN || type == LBL_REQUIRED;
@@ -124,6 +124,7 @@ struct out_data {
     uint64_t size;              /* Size of output */
     const struct itemplate *itemp; /* Instruction template */
     const void *data;           /* Data for OUT_RAWDATA */
+    struct nasm_mapping *map;   /* File mapping holding data, if any */
     uint64_t toffset;           /* Target address offset for relocation */
     int32_t tsegment;           /* Target segment for relocation */
     int32_t twrt;               /* Relocation with respect to */
@@ -334,6 +335,17 @@ struct tokenval {
 };
 typedef int (*scanner)(void *private_data, struct tokenval *tv);
 
+/*
+ * A line of preprocessed source split into tokens by the
+ * preprocessor, see pp_getline_scan(). Each entry points into the
+ * text of the line; an entry with t_type == TOKEN_INVALID still has
+ * to be scanned from the text.
+ */
+struct scanline {
+    size_t              ntokens;
+    struct tokenval     *tokens;
+};
+
 /*
  * Expression-evaluator datatype. Expressions, within the
  * evaluator, are stored as an array of these beasts, terminated by
@@ -468,9 +480,31 @@ void pp_reset(const char *file, enum preproc_mode mode,
  */
 char *pp_getline(void);
 
+/*
+ * Same as pp_getline(), but also return the tokens of the line in a
+ * form which can be handed to the parser without scanning the text
+ * again. *scanned is set to NULL if the line has to be scanned from
+ * its text; otherwise it should be freed with nasm_free().
+ */
+char *pp_getline_scan(struct scanline **scanned);
+
 /* Called at the end of each pass. */
 void pp_cleanup_pass(void);
 
+/* Statistics of the smacro expansion cache, reported by -Ov */
+struct pp_smacro_stats {
+    uint64_t hits;              /* Expansions taken from the cache */
+    uint64_t tokens;            /* Tokens not re-expanded due to hits */
+};
+extern struct pp_smacro_stats pp_smacro_stats;
+
+/*
+ * Returns true if the output of the current pass may have depended on
+ * label values or the current location, in which case it cannot be
+ * reused for a subsequent pass.
+ */
+bool pp_pass_dependent(void);
+
 /*
  * Called at the end of the assembly session,
  * after cleanup_pass() has been called for the
@@ -491,6 +525,9 @@ void pp_pre_command(const char *what, char *str);
 /* Include path from command line */
 void pp_include_path(struct strlist *ipath);
 
+/* Macro cache directory from command line */
+void pp_macro_cache(const char *dir);
+
 /* Unwind the macro stack when printing an error message */
 void pp_error_list_macros(errflags severity);
 
@@ -703,6 +740,8 @@ typedef struct operand { /* operand to an instruction */
 #define OPFLAG_RELATIVE     8   /* operand is self-relative, e.g. [foo - $]
                                    where foo is not in the current segment */
 #define OPFLAG_SIMPLE      16   /* operand is a simple expression */
+#define OPFLAG_PREVPASS    32   /* operand uses a label not yet defined
+                                   in this pass (value from the last pass) */
 
 enum extop_type { /* extended operand types */
     EOT_NOTHING = 0,
@@ -1005,6 +1044,7 @@ struct ofmt {
 #define OFMT_TEXT		1	/* Text file format */
 #define OFMT_KEEP_ADDR		2	/* Keep addr; no conversion to data */
 #define OFMT_ZERODATA		4	/* "Native" OUT_ZERODATA support */
+#define OFMT_SECTION_CACHE	8	/* Repeating a section() call is a no-op */
 
     unsigned int flags;
 
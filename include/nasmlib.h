@@ -204,6 +204,16 @@ extern const uint8_t zero_buffer[ZERO_BUF_SIZE];
 void nasm_read(void *, size_t, FILE *);
 void nasm_write(const void *, size_t, FILE *);
 
+/*
+ * Write a list of buffers; for large amounts of data this bypasses
+ * the stdio buffer where possible.
+ */
+struct nasm_iovec {
+    const void *base;
+    size_t len;
+};
+void nasm_writev(const struct nasm_iovec *, size_t, FILE *);
+
 /*
  * NASM failure at build time if the argument is false
  */
@@ -515,7 +525,8 @@ enum file_flags {
     NF_FORMAP   = 0x00000004,   /* Intended to use nasm_map_file() */
     NF_IONBF    = 0x00000010,   /* Force unbuffered stdio */
     NF_IOLBF    = 0x00000020,   /* Force line buffered stdio */
-    NF_IOFBF    = 0000000030    /* Force fully buffered stdio */
+    NF_IOFBF    = 0000000030,   /* Force fully buffered stdio */
+    NF_OUTPUT   = 0x00000040    /* The output file: use a large buffer */
 };
 #define NF_BUF_MASK  0x30
 
@@ -543,6 +554,24 @@ bool nasm_file_exists(const char *filename);
 
 const void *nasm_map_file(FILE *fp, off_t start, off_t len);
 void nasm_unmap_file(const void *p, size_t len);
+
+/*
+ * Reference-counted file mapping, which allows mapped file data to be
+ * kept by its users (e.g. an output format holding INCBIN data until
+ * it writes the output file) instead of copied.
+ */
+struct nasm_mapping {
+    const void *data;           /* Mapped data */
+    size_t len;                 /* Length of the mapped data */
+    size_t refs;                /* Reference count */
+};
+struct nasm_mapping *nasm_map_file_ref(FILE *fp, off_t start, off_t len);
+static inline struct nasm_mapping *nasm_mapping_get(struct nasm_mapping *map)
+{
+    map->refs++;
+    return map;
+}
+void nasm_mapping_put(struct nasm_mapping *map);
 off_t nasm_file_size(FILE *f);
 off_t nasm_file_size_by_path(const char *pathname);
 bool nasm_file_time(time_t *t, const char *pathname);
@@ -550,6 +579,7 @@ void fwritezero(off_t bytes, FILE *fp);
 
 /* Remove a file; explicitly defined to ignore a NULL or empty pathname */
 int nasm_remove(const char *pathname);
+int nasm_rename(const char *oldpath, const char *newpath);
 
 /* Sign-extend a value to an arbitrary number of bits */
 static inline int64_t const_func sext(int64_t value, unsigned int bits)
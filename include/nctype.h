@@ -72,6 +72,7 @@ static inline bool nasm_isidchar(char x)
 {
     return nasm_ctype(x, NCT_ID);
 }
+const char * pure_func nasm_skip_idchars(const char *p);
 static inline bool nasm_isbrcchar(char x)
 {
     return nasm_ctype(x, NCT_ID|NCT_MINUS);
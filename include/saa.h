@@ -14,8 +14,16 @@
  * written. The array can also be read back in the same two ways:
  * as a series of big byte-data blocks or as a list of structures
  * of a given size.
+ *
+ * Data from a file mapping can be added without copying it, see
+ * saa_wmap(). An SAA which is only ever appended to can move its
+ * completed blocks out to a file as it grows, see saa_spill().
  */
 
+struct nasm_mapping;
+struct saa_ref;
+struct saa_extent;
+
 struct SAA {
     /*
      * members `end' and `elem_len' are only valid in first link in
@@ -34,12 +42,18 @@ struct SAA {
     size_t rpos;                /* Read position inside block */
     size_t rptr;                /* Absolute read position */
     char **blk_ptrs;            /* Pointer to pointer blocks */
+    struct saa_ref *refs;       /* Blocks which are file mappings */
+    size_t nrefs;               /* Number of entries in refs */
+    struct saa_extent *spills;  /* Where spilled blocks went */
+    size_t nspills;             /* Number of entries in spills */
+    size_t spilled;             /* Number of leading blocks spilled */
 };
 
 struct SAA * never_null saa_init(size_t elem_len);  /* 1 == byte */
 void saa_free(struct SAA *);
 void *saa_wstruct(struct SAA *);        /* return a structure of elem_len */
 void saa_wbytes(struct SAA *, const void *, size_t);    /* write arbitrary bytes */
+void saa_wmap(struct SAA *, struct nasm_mapping *, const void *, size_t);
 size_t saa_wcstring(struct SAA *s, const char *str);     /* write a C string */
 void saa_rewind(struct SAA *);  /* for reading from beginning */
 void *saa_rstruct(struct SAA *);        /* return NULL on EOA */
@@ -51,6 +65,7 @@ void saa_fwrite(struct SAA *, size_t, const void *, size_t);
 
 /* dump to file */
 void saa_fpwrite(struct SAA *, FILE *);
+void saa_spill(struct SAA *, FILE *);
 
 /* Write specific-sized values */
 void saa_write8(struct SAA *s, uint8_t v);
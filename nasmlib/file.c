@@ -5,6 +5,8 @@
 #include "nasmlib.h"
 #include "error.h"
 
+#define OUTPUT_BUFSIZE	((size_t)1 << 20)
+
 #ifdef HAVE_FCNTL_H
 # include <fcntl.h>
 #endif
@@ -81,6 +83,7 @@ static inline void os_free_filename(os_filename filename)
 # define os_fopen  _wfopen
 # define os_access _waccess
 # define os_remove _wremove
+# define os_rename _wrename
 
 /*
  * On Win32/64, we have to use the _wstati64() function. Note that
@@ -122,6 +125,7 @@ static inline void os_set_binary_mode(FILE *f) {
 
 # define os_fopen  fopen
 # define os_remove remove
+# define os_rename rename
 
 #if defined(HAVE_FACCESSAT) && defined(AT_EACCESS)
 static inline int os_access(os_filename pathname, int mode)
@@ -269,6 +273,19 @@ FILE *nasm_open_write(const char *filename, enum file_flags flags)
         nasm_fatalf(ERR_NOFILE, "unable to open output file: `%s': %s",
                     filename, strerror(errno));
 
+    if (f && (flags & NF_OUTPUT)) {
+        /*
+         * Backends write headers and tables a field at a time; give
+         * them a buffer large enough that this costs few system
+         * calls. It is reused by each output file in turn.
+         */
+        static char *outbuf;
+
+        if (!outbuf)
+            outbuf = nasm_malloc(OUTPUT_BUFSIZE);
+        setvbuf(f, outbuf, _IOFBF, OUTPUT_BUFSIZE);
+    }
+
     switch (flags & NF_BUF_MASK) {
     case NF_IONBF:
         setvbuf(f, NULL, _IONBF, 0);
@@ -425,3 +442,21 @@ int nasm_remove(const char *pathname)
 
     return rv;
 }
+
+/*
+ * Rename a file
+ */
+int nasm_rename(const char *oldpath, const char *newpath)
+{
+    int rv = -1;
+    os_filename osold, osnew;
+
+    osold = os_mangle_filename(oldpath);
+    osnew = os_mangle_filename(newpath);
+    if (osold && osnew)
+        rv = os_rename(osold, osnew);
+    os_free_filename(osold);
+    os_free_filename(osnew);
+
+    return rv;
+}
@@ -5,6 +5,24 @@
 #include "nasmlib.h"
 #include "error.h"
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+/*
+ * NASM is single-threaded, so the locking stdio does on every call
+ * is pure overhead; it dominates when writing tables one field at a
+ * time.
+ */
+#ifdef HAVE_FWRITE_UNLOCKED
+# define os_fwrite fwrite_unlocked
+#else
+# define os_fwrite fwrite
+#endif
+
 void nasm_read(void *ptr, size_t size, FILE *f)
 {
     size_t n = fread(ptr, 1, size, f);
@@ -17,7 +35,7 @@ void nasm_read(void *ptr, size_t size, FILE *f)
 
 void nasm_write(const void *ptr, size_t size, FILE *f)
 {
-    size_t n = fwrite(ptr, 1, size, f);
+    size_t n = os_fwrite(ptr, 1, size, f);
     if (n != size || ferror(f) || feof(f))
         nasm_fatal("unable to write output: %s", strerror(errno));
 }
@@ -46,14 +64,72 @@ void fwriteaddr(uint64_t data, int size, FILE * fp)
     nasm_write(&data, size, fp);
 }
 
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H) && defined(HAVE_FILENO)
+# define os_writev(fd,iov,cnt)	writev(fd,iov,cnt)
+#endif
+
+/* Less than this is cheaper to copy through the stdio buffer */
+#define WRITEV_MIN	((size_t)1 << 18)
+#define WRITEV_IOVS	16
+
+void nasm_writev(const struct nasm_iovec *vec, size_t n, FILE *f)
+{
+#ifdef os_writev
+    size_t total = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        total += vec[i].len;
+
+    if (total >= WRITEV_MIN && !fflush(f)) {
+        struct iovec iov[WRITEV_IOVS];
+        off_t pos = ftello(f);
+        int fd = fileno(f);
+        size_t off = 0;
+
+        i = 0;
+        while (i < n) {
+            int cnt = 0;
+            ssize_t w;
+
+            while (i + cnt < n && cnt < WRITEV_IOVS) {
+                const struct nasm_iovec *v = &vec[i + cnt];
+                size_t skip = cnt ? 0 : off;
+
+                iov[cnt].iov_base = (char *)v->base + skip;
+                iov[cnt].iov_len  = v->len - skip;
+                cnt++;
+            }
+
+            w = os_writev(fd, iov, cnt);
+            if (w <= 0) {
+                if (w < 0 && errno == EINTR)
+                    continue;
+                nasm_fatal("unable to write output: %s", strerror(errno));
+            }
+
+            /* Skip what was written, which may end mid-buffer */
+            off += w;
+            while (i < n && off >= vec[i].len)
+                off -= vec[i++].len;
+        }
+
+        /* Tell stdio where the file position is now */
+        if (pos != (off_t)-1)
+            fseeko(f, pos + total, SEEK_SET);
+        return;
+    }
+#endif
+
+    for (; n; vec++, n--)
+        nasm_write(vec->base, vec->len, f);
+}
+
 /* Can we adjust the file size without actually writing all the bytes? */
 
 #ifdef HAVE_IO_H
 # include <io.h>
 #endif
-#ifdef HAVE_UNISTD_H
-# include <unistd.h>
-#endif
 
 #ifdef HAVE__CHSIZE_S
 # define os_ftruncate(fd,size)	_chsize_s(fd,size)
@@ -16,7 +16,7 @@
 #define HASH_INIT_SIZE  16      /* Initial size (power of 2, min 4) */
 
 #define hash_calc(key,keylen)   crc64b(CRC64_INIT, (key), (keylen))
-#define hash_calci(key,keylen)  crc64ib(CRC64_INIT, (key), (keylen))
+#define hash_calci(key,keylen)  hash_keyi((key), (keylen))
 #define hash_max_load(size)     ((size) * (HASH_MAX_LOAD - 1) / HASH_MAX_LOAD)
 #define hash_expand(size)       ((size) << 1)
 #define hash_mask(size)         ((size) - 1)
@@ -90,10 +90,19 @@ void **hash_find(struct hash_table *head, const char *key,
  */
 void **hash_findib(struct hash_table *head, const void *key, size_t keylen,
                    struct hash_insert *insert)
+{
+    return hash_findibh(head, key, keylen, hash_calci(key, keylen), insert);
+}
+
+/*
+ * Same as hash_findib(), but with the hash value of the key already
+ * known to the caller, as computed by hash_keyi().
+ */
+void **hash_findibh(struct hash_table *head, const void *key, size_t keylen,
+                    uint64_t hash, struct hash_insert *insert)
 {
     struct hash_node *np = NULL;
     struct hash_node *tbl = head->table;
-    uint64_t hash = hash_calci(key, keylen);
     size_t mask = hash_mask(head->size);
     size_t pos = hash_pos(hash, mask);
     size_t inc = hash_inc(hash, mask);
@@ -120,3 +120,35 @@ void nasm_unmap_file(const void *p, size_t len)
 }
 
 #endif
+
+/*
+ * Map a file as above, returning a mapping with one reference, or
+ * NULL if the file cannot be mapped.
+ */
+struct nasm_mapping *nasm_map_file_ref(FILE *fp, off_t start, off_t len)
+{
+    struct nasm_mapping *map;
+    const void *p;
+
+    p = nasm_map_file(fp, start, len);
+    if (!p)
+        return NULL;
+
+    nasm_new(map);
+    map->data = p;
+    map->len  = len;
+    map->refs = 1;
+    return map;
+}
+
+/*
+ * Drop a reference; the file is unmapped when the last one is dropped
+ */
+void nasm_mapping_put(struct nasm_mapping *map)
+{
+    if (!map || --map->refs)
+        return;
+
+    nasm_unmap_file(map->data, map->len);
+    nasm_free(map);
+}
@@ -4,6 +4,15 @@
 #include "nctype.h"
 #include <ctype.h>
 
+/*
+ * The SIMD scanner reads whole aligned blocks, possibly past the end
+ * of the string, which AddressSanitizer would rightly complain about.
+ */
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+# include <emmintrin.h>
+# define HAVE_SSE2_IDSCAN 1
+#endif
+
 /*
  * Table of tolower() results.  This avoids function calls
  * on some platforms.
@@ -84,3 +93,57 @@ void nasm_ctype_init(void)
     tolower_tab_init();
     ctype_tab_init();
 }
+
+#ifdef HAVE_SSE2_IDSCAN
+/*
+ * Return a bit mask of the characters in v which are ASCII identifier
+ * characters: letters, digits and _ . @ ? $ # ~.  Bytes >= 0x80 are
+ * negative as signed bytes and hence never match.
+ */
+static inline unsigned int idchar_mask(__m128i v)
+{
+    const __m128i lc = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i m;
+
+    m = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lc, _mm_set1_epi8('z' + 1)));
+    m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('@')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/*
+ * Return a pointer to the first character at or after p which is not
+ * an identifier character.  With SSE2 this classifies 16 characters
+ * at a time; anything the vector test does not recognize, such as a
+ * non-ASCII character, is left to the ctype table.  The aligned
+ * loads may read beyond the terminating null, but never into the
+ * next page.
+ */
+const char *nasm_skip_idchars(const char *p)
+{
+#ifdef HAVE_SSE2_IDSCAN
+    const __m128i *vp = (const __m128i *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned int nonid = ~idchar_mask(_mm_load_si128(vp)) &
+        (0xffffU << ((uintptr_t)p & 15));
+
+    while (!(nonid & 0xffff))
+        nonid = ~idchar_mask(_mm_load_si128(++vp));
+
+    p = (const char *)vp + __builtin_ctz(nonid);
+#endif
+
+    while (nasm_isidchar(*p))
+        p++;
+
+    return p;
+}
@@ -3,6 +3,7 @@
 
 #include "compiler.h"
 #include "nasmlib.h"
+#include "error.h"
 #include "ilog2.h"
 #include "saa.h"
 
@@ -10,6 +11,21 @@
 #define SAA_BLKSHIFT	16
 #define SAA_BLKLEN	((size_t)1 << SAA_BLKSHIFT)
 
+/* A run of allocation blocks which point into a file mapping */
+struct saa_ref {
+    size_t blk;                 /* First block */
+    size_t nblks;               /* Number of blocks */
+    struct nasm_mapping *map;   /* Mapping holding the data */
+};
+
+/* A run of allocation blocks which were moved out to a file */
+struct saa_extent {
+    size_t blk;                 /* First block */
+    size_t nblks;               /* Number of blocks */
+    FILE *fp;                   /* File holding the data */
+    off_t pos;                  /* Offset of the first block in fp */
+};
+
 struct SAA *saa_init(size_t elem_len)
 {
     struct SAA *s;
@@ -37,6 +53,14 @@ void saa_free(struct SAA *s)
 {
     char **p;
     size_t n;
+    struct saa_ref *r;
+
+    for (r = s->refs, n = s->nrefs; n; r++, n--) {
+        memset(&s->blk_ptrs[r->blk], 0, r->nblks * sizeof(char *));
+        nasm_mapping_put(r->map);
+    }
+    nasm_free(s->refs);
+    nasm_free(s->spills);
 
     for (p = s->blk_ptrs, n = s->nblks; n; p++, n--)
         nasm_free(*p);
@@ -45,8 +69,8 @@ void saa_free(struct SAA *s)
     nasm_free(s);
 }
 
-/* Add one allocation block to an SAA */
-static void saa_extend(struct SAA *s)
+/* Add one block to an SAA, either allocated or given */
+static void saa_add_block(struct SAA *s, char *blk)
 {
     size_t blkn = s->nblks++;
 
@@ -62,10 +86,16 @@ static void saa_extend(struct SAA *s)
         s->wblk = s->blk_ptrs + windex;
     }
 
-    s->blk_ptrs[blkn] = nasm_malloc(s->blk_len);
+    s->blk_ptrs[blkn] = blk ? blk : nasm_malloc(s->blk_len);
     s->length += s->blk_len;
 }
 
+/* Add one allocation block to an SAA */
+static inline void saa_extend(struct SAA *s)
+{
+    saa_add_block(s, NULL);
+}
+
 void *saa_wstruct(struct SAA *s)
 {
     void *p;
@@ -120,6 +150,54 @@ void saa_wbytes(struct SAA *s, const void *data, size_t len)
     }
 }
 
+/*
+ * Write bytes from a file mapping.  Whole blocks are not copied;
+ * instead the SAA points into the mapping and holds a reference to it
+ * until it is freed.  Those blocks are read-only, so this is only
+ * suitable for data which is never patched with saa_fwrite().
+ */
+void saa_wmap(struct SAA *s, struct nasm_mapping *map,
+              const void *data, size_t len)
+{
+    const char *d = data;
+    struct saa_ref *r;
+    size_t l;
+
+    /* Only when appending to the last block */
+    if (!map || s->elem_len != 1 || s->wptr != s->datalen ||
+        s->wblk != &s->blk_ptrs[s->nblks - 1] || len < (s->blk_len << 1)) {
+        saa_wbytes(s, data, len);
+        return;
+    }
+
+    /* Fill up the current block */
+    l = s->blk_len - s->wpos;
+    saa_wbytes(s, d, l);
+    d += l;
+    len -= l;
+
+    r = s->nrefs ? &s->refs[s->nrefs - 1] : NULL;
+    if (!r || r->map != map || r->blk + r->nblks != s->nblks) {
+        s->refs = nasm_realloc(s->refs, (s->nrefs + 1) * sizeof(*s->refs));
+        r = &s->refs[s->nrefs++];
+        r->blk   = s->nblks;
+        r->nblks = 0;
+        r->map   = nasm_mapping_get(map);
+    }
+
+    while (len >= s->blk_len) {
+        saa_add_block(s, (char *)d);
+        r->nblks++;
+        s->wblk = &s->blk_ptrs[s->nblks - 1];
+        s->wptr += s->blk_len;
+        d += s->blk_len;
+        len -= s->blk_len;
+    }
+    s->datalen = s->wptr;
+
+    saa_wbytes(s, d, len);
+}
+
 /*
  * Writes a string, *including* the final null, to the specified SAA,
  * and return the number of bytes written.
@@ -135,6 +213,7 @@ size_t saa_wcstring(struct SAA *s, const char *str)
 
 void saa_rewind(struct SAA *s)
 {
+    nasm_assert(!s->spilled);
     s->rblk = s->blk_ptrs;
     s->rpos = s->rptr = 0;
 }
@@ -223,6 +302,7 @@ void saa_fread(struct SAA *s, size_t posn, void *data, size_t len)
         ix = posn / s->blk_len;
         s->rpos = posn % s->blk_len;
     }
+    nasm_assert(ix >= s->spilled);
     s->rptr = posn;
     s->rblk = &s->blk_ptrs[ix];
 
@@ -247,6 +327,7 @@ void saa_fwrite(struct SAA *s, size_t posn, const void *data, size_t len)
         ix = posn / s->blk_len;
         s->wpos = posn % s->blk_len;
     }
+    nasm_assert(ix >= s->spilled);
     s->wptr = posn;
     s->wblk = &s->blk_ptrs[ix];
 
@@ -263,12 +344,102 @@ void saa_fwrite(struct SAA *s, size_t posn, const void *data, size_t len)
 
 void saa_fpwrite(struct SAA *s, FILE * fp)
 {
-    const char *data;
-    size_t len;
+    struct nasm_iovec *vec;
+    size_t pos, nblks, i;
+
+    if (s->spilled) {
+        const struct saa_extent *e;
+        char *buf = nasm_malloc(s->blk_len);
+        size_t n;
+
+        for (e = s->spills, n = s->nspills; n; e++, n--) {
+            if (fseeko(e->fp, e->pos, SEEK_SET))
+                nasm_fatal("unable to read spilled output: %s",
+                           strerror(errno));
+            for (i = 0; i < e->nblks; i++) {
+                nasm_read(buf, s->blk_len, e->fp);
+                nasm_write(buf, s->blk_len, fp);
+            }
+        }
+        nasm_free(buf);
+    }
+
+    pos = s->spilled * s->blk_len;
+    if (pos >= s->datalen)
+        return;
+
+    /* Hand all the blocks to the output at once */
+    nblks = (s->datalen - pos + s->blk_len - 1) / s->blk_len;
+    nasm_newn(vec, nblks);
+    for (i = 0; i < nblks; i++) {
+        size_t len = s->datalen - pos;
+
+        vec[i].base = s->blk_ptrs[s->spilled + i];
+        vec[i].len  = len < s->blk_len ? len : s->blk_len;
+        pos += vec[i].len;
+    }
+    nasm_writev(vec, nblks, fp);
+    nasm_free(vec);
+}
+
+/* Is this block part of a file mapping? */
+static bool saa_blk_mapped(const struct SAA *s, size_t blk)
+{
+    const struct saa_ref *r;
+    size_t n;
+
+    for (r = s->refs, n = s->nrefs; n; r++, n--) {
+        if (blk >= r->blk && blk < r->blk + r->nblks)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Move all completed blocks of an SAA which is only appended to out
+ * to the end of the file fp, and release their memory. The spilled
+ * data can afterwards only be retrieved by saa_fpwrite(), which
+ * copies it back from fp; the SAA cannot be read or rewritten in
+ * place any more.
+ */
+void saa_spill(struct SAA *s, FILE *fp)
+{
+    size_t wblk = s->wblk - s->blk_ptrs;
+    size_t nblks, i;
+    struct saa_extent *e;
+    off_t pos;
+
+    nasm_assert(s->wptr == s->datalen);
+
+    if (wblk <= s->spilled)
+        return;
+
+    nblks = wblk - s->spilled;
+
+    if (fseeko(fp, 0, SEEK_END) || (pos = ftello(fp)) == (off_t)-1)
+        nasm_fatal("unable to spill output: %s", strerror(errno));
+
+    e = s->nspills ? &s->spills[s->nspills - 1] : NULL;
+    if (!e || e->fp != fp ||
+        e->pos + (off_t)(e->nblks * s->blk_len) != pos) {
+        s->spills = nasm_realloc(s->spills,
+                                 (s->nspills + 1) * sizeof(*s->spills));
+        e = &s->spills[s->nspills++];
+        e->blk   = s->spilled;
+        e->nblks = 0;
+        e->fp    = fp;
+        e->pos   = pos;
+    }
+
+    for (i = s->spilled; i < wblk; i++) {
+        nasm_write(s->blk_ptrs[i], s->blk_len, fp);
+        if (!saa_blk_mapped(s, i))
+            nasm_free(s->blk_ptrs[i]);
+        s->blk_ptrs[i] = NULL;
+    }
 
-    saa_rewind(s);
-    while (len = s->datalen, (data = saa_rbytes(s, &len)) != NULL)
-        nasm_write(data, len, fp);
+    e->nblks  += nblks;
+    s->spilled = wblk;
 }
 
 void saa_write8(struct SAA *s, uint8_t v)
@@ -117,6 +117,8 @@ struct cv8_state {
     const char *last_filename;
     struct source_file *last_source_file;
     struct hash_table file_hash;
+    struct hash_table coff_sym_hash;
+    uint32_t coff_syms_hashed;
     unsigned num_files;
     uint32_t total_filename_len;
 
@@ -274,6 +276,8 @@ static void cv8_cleanup(void)
 {
     struct cv8_symbol *sym;
     struct source_file *file, *ftmp;
+    struct hash_iterator it;
+    const struct hash_node *np;
 
     struct coff_Section *symbol_sect = coff_sects[cv8_state.symbol_sect];
     struct coff_Section *type_sect = coff_sects[cv8_state.type_sect];
@@ -294,6 +298,10 @@ static void cv8_cleanup(void)
         nasm_free(file);
     }
     hash_free(&cv8_state.file_hash);
+    hash_for_each(&cv8_state.coff_sym_hash, it, np)
+        nasm_free((void *)np->key); /* The data are symbol numbers */
+    hash_free(&cv8_state.coff_sym_hash);
+    cv8_state.coff_syms_hashed = 0;
 
     saa_rewind(cv8_state.symbols);
     while ((sym = saa_rstruct(cv8_state.symbols)))
@@ -400,45 +408,63 @@ static int find_section(int32_t segto)
     return -1;
 }
 
-static void register_reloc(struct coff_Section *const sect,
-        int reloc_sect, char *sym, uint32_t addr, uint16_t type)
+/*
+ * Find a COFF symbol by name, returning its 1-based position in the
+ * symbol table. The symbols are indexed by name the first time
+ * through; a linear search per relocation is quadratic in the number
+ * of symbols.
+ */
+static uint32_t find_coff_symbol(const char *name)
 {
-    struct coff_Reloc *r;
-    uint32_t i;
+    void **symp;
+
+    if (cv8_state.coff_syms_hashed != coff_nsyms) {
+        uint32_t i;
+        char *symname = NULL;
+        size_t symnamesize = 0;
+
+        saa_rewind(coff_syms);
+        for (i = 0; i < coff_nsyms; i++) {
+            struct coff_Symbol *s = saa_rstruct(coff_syms);
+            const char *key = s->name;
+            struct hash_insert hi;
+
+            if (s->strpos != -1) {
+                if ((size_t)s->namlen >= symnamesize) {
+                    symnamesize = s->namlen + 1;
+                    symname = nasm_realloc(symname, symnamesize);
+                }
+                saa_fread(coff_strs, s->strpos-4, symname, s->namlen);
+                symname[s->namlen] = '\0';
+                key = symname;
+            }
 
-    r = *sect->tail = nasm_malloc(sizeof(struct coff_Reloc));
-    sect->tail = &r->next;
-    r->next = NULL;
-    sect->nrelocs++;
+            /* The first symbol by a given name is the one referenced */
+            if (!hash_find(&cv8_state.coff_sym_hash, key, &hi))
+                hash_add(&hi, nasm_strdup(key), (void *)(size_t)(i + 1));
+        }
+        nasm_free(symname);
+        cv8_state.coff_syms_hashed = coff_nsyms;
+    }
 
-    r->address = addr;
-    r->symbase = SECT_SYMBOLS;
-    r->type = type;
+    symp = hash_find(&cv8_state.coff_sym_hash, name, NULL);
+    if (!symp)
+        nasm_panic("codeview: relocation for unregistered symbol: %s", name);
 
-    r->symbol = reloc_sect * 2;
-    if (reloc_sect < coff_nsects)
-        return;
+    return (uint32_t)(size_t)*symp;
+}
 
-    saa_rewind(coff_syms);
-    for (i = 0; i < coff_nsyms; i++) {
-        struct coff_Symbol *s = saa_rstruct(coff_syms);
-        r->symbol++;
-        if (s->strpos == -1 && !strcmp(sym, s->name)) {
-            return;
-        } else if (s->strpos != -1) {
-            int res;
-            char *symname;
-
-            symname = nasm_malloc(s->namlen + 1);
-            saa_fread(coff_strs, s->strpos-4, symname, s->namlen);
-            symname[s->namlen] = '\0';
-            res = strcmp(sym, symname);
-            nasm_free(symname);
-            if (!res)
-                return;
-        }
-    }
-    nasm_panic("codeview: relocation for unregistered symbol: %s", sym);
+static void register_reloc(struct coff_Section *const sect,
+        int reloc_sect, char *sym, uint32_t addr, uint16_t type)
+{
+    uint32_t symbol = reloc_sect * 2;
+
+    if (reloc_sect >= coff_nsects)
+        symbol += find_coff_symbol(sym);
+
+    ol_add_reloc(&sect->relocs, addr, symbol,
+                 COFF_RELOC_TYPE(SECT_SYMBOLS, type), 0);
+    sect->nrelocs++;
 }
 
 static inline void section_write32(struct coff_Section *sect, uint32_t val)
@@ -352,7 +352,7 @@ static void aout_deflabel(char *name, int32_t segment, int64_t offset,
                     stdscan_reset(special + n);
                     tokval.t_type = TOKEN_INVALID;
                     e = evaluate(stdscan, NULL, &tokval, &fwd, 0, NULL);
-                    if (fwd) {
+                    if (fwd & (OPFLAG_FORWARD|OPFLAG_EXTERN)) {
                         sym->nextfwd = fwds;
                         fwds = sym;
                         sym->name = nasm_strdup(name);
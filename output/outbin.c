@@ -751,7 +751,7 @@ static void bin_out(const struct out_data *out)
 
     case OUT_RAWDATA:
         if (s->flags & TYPE_PROGBITS)
-            saa_wbytes(s->contents, data, size);
+            saa_wmap(s->contents, out->map, data, size);
 	break;
 
     case OUT_RESERVE:
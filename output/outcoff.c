@@ -154,6 +154,8 @@ static uint32_t strslen;
 
 static void coff_gen_init(void);
 static void coff_sect_write(struct coff_Section *, const uint8_t *, uint32_t);
+static void coff_sect_write_map(struct coff_Section *, struct nasm_mapping *,
+                                const uint8_t *, uint32_t);
 static void coff_write(void);
 static void coff_section_header(char *, int32_t, int32_t, int32_t, int32_t, int32_t, int, int32_t);
 static void coff_write_relocs(struct coff_Section *);
@@ -202,7 +204,6 @@ static void coff_gen_init(void)
 
 static void coff_cleanup(void)
 {
-    struct coff_Reloc *r;
     int i;
 
     dfmt->cleanup();
@@ -211,11 +212,7 @@ static void coff_cleanup(void)
     for (i = 0; i < coff_nsects; i++) {
         if (coff_sects[i]->data)
             saa_free(coff_sects[i]->data);
-        while (coff_sects[i]->head) {
-            r = coff_sects[i]->head;
-            coff_sects[i]->head = coff_sects[i]->head->next;
-            nasm_free(r);
-        }
+        ol_free_relocs(&coff_sects[i]->relocs);
         while (coff_sects[i]->symidx_reloc_head) {
             struct coff_SymIdxReloc * const ir = coff_sects[i]->symidx_reloc_head;
             coff_sects[i]->symidx_reloc_head = ir->next;
@@ -241,7 +238,6 @@ int coff_make_section(char *name, uint32_t flags)
 
     if (flags != BSS_FLAGS)
         s->data = saa_init(1);
-    s->tail = &s->head;
     if (!strcmp(name, ".text"))
         s->index = def_seg;
     else
@@ -641,36 +637,33 @@ static void coff_deflabel(char *name, int32_t segment, int64_t offset,
 static int32_t coff_add_reloc(struct coff_Section *sect, int32_t segment,
                               int16_t type)
 {
-    struct coff_Reloc *r;
-
-    r = *sect->tail = nasm_malloc(sizeof(struct coff_Reloc));
-    sect->tail = &r->next;
-    r->next = NULL;
+    enum coff_symbase symbase;
+    int32_t symbol = 0;
 
-    r->address = sect->len;
     if (segment == NO_SEG) {
-        r->symbol = 0, r->symbase = ABS_SYMBOL;
+        symbase = ABS_SYMBOL;
     } else {
         int i;
-        r->symbase = REAL_SYMBOLS;
+        symbase = REAL_SYMBOLS;
         for (i = 0; i < coff_nsects; i++) {
             if (segment == coff_sects[i]->index) {
-                r->symbol = i * 2;
-                r->symbase = SECT_SYMBOLS;
+                symbol = i * 2;
+                symbase = SECT_SYMBOLS;
                 break;
             }
         }
-        if (r->symbase == REAL_SYMBOLS)
-            r->symbol = raa_read(bsym, segment);
+        if (symbase == REAL_SYMBOLS)
+            symbol = raa_read(bsym, segment);
     }
-    r->type = type;
 
+    ol_add_reloc(&sect->relocs, sect->len, symbol,
+                 COFF_RELOC_TYPE(symbase, type), 0);
     sect->nrelocs++;
 
     /*
      * Return the fixup for standard COFF common variables.
      */
-    if (r->symbase == REAL_SYMBOLS && !(win32 | win64))
+    if (symbase == REAL_SYMBOLS && !(win32 | win64))
         return raa_read(symval, segment);
 
     return 0;
@@ -783,7 +776,7 @@ static void coff_out(const struct out_data *out)
         } else
             s->len += size;
     } else if (type == OUT_RAWDATA) {
-        coff_sect_write(s, data, size);
+        coff_sect_write_map(s, out->map, data, size);
     } else if (type == OUT_ADDRESS) {
         int asize = abs((int)size);
         if (wrt == symtab_sect) {
@@ -877,6 +870,15 @@ static void coff_sect_write(struct coff_Section *sect,
     sect->len += len;
 }
 
+/* Raw data which may be held by reference to a file mapping */
+static void coff_sect_write_map(struct coff_Section *sect,
+                                struct nasm_mapping *map,
+                                const uint8_t *data, uint32_t len)
+{
+    saa_wmap(sect->data, map, data, len);
+    sect->len += len;
+}
+
 typedef struct tagString {
     struct tagString *next;
     int len;
@@ -1290,7 +1292,8 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
 
 static void coff_write_relocs(struct coff_Section *s)
 {
-    struct coff_Reloc *r;
+    const struct ol_relocs *r = &s->relocs;
+    size_t i;
 
     /* a real number of relocations if needed */
     if (s->flags & IMAGE_SCN_LNK_NRELOC_OVFL) {
@@ -1299,13 +1302,15 @@ static void coff_write_relocs(struct coff_Section *s)
         fwriteint16_t(0, ofile);
     }
 
-    for (r = s->head; r; r = r->next) {
-        fwriteint32_t(r->address, ofile);
-        fwriteint32_t(r->symbol + (r->symbase == REAL_SYMBOLS ? initsym :
-                                   r->symbase == ABS_SYMBOL   ? initsym - 1 :
-                                   r->symbase == SECT_SYMBOLS ? 2 : 0),
+    for (i = 0; i < r->n; i++) {
+        enum coff_symbase symbase = COFF_RELOC_SYMBASE(r->type[i]);
+
+        fwriteint32_t(r->addr[i], ofile);
+        fwriteint32_t(r->sym[i] + (symbase == REAL_SYMBOLS ? initsym :
+                                   symbase == ABS_SYMBOL   ? initsym - 1 :
+                                   symbase == SECT_SYMBOLS ? 2 : 0),
                       ofile);
-        fwriteint16_t(r->type, ofile);
+        fwriteint16_t(COFF_RELOC_COFFTYPE(r->type[i]), ofile);
     }
 }
 
@@ -1421,7 +1426,7 @@ const struct ofmt of_coff = {
     "COFF (i386) (DJGPP, some Unix variants)",
     "coff",
     ".o",
-    0,
+    OFMT_SECTION_CACHE,
     32,
     null_debug_arr,
     &null_debug_form,
@@ -1457,7 +1462,7 @@ const struct ofmt of_win32 = {
     "Microsoft extended COFF for Win32 (i386)",
     "win32",
     ".obj",
-    0,
+    OFMT_SECTION_CACHE,
     32,
     win32_debug_arr,
     &df_cv8,
@@ -1485,7 +1490,7 @@ const struct ofmt of_win64 = {
     "Microsoft extended COFF for Win64 (x86-64)",
     "win64",
     ".obj",
-    0,
+    OFMT_SECTION_CACHE,
     64,
     win64_debug_arr,
     &df_cv8,
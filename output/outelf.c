@@ -70,8 +70,13 @@ static struct ELF_SECTDATA {
 static int elf_nsect, nsections;
 static int64_t elf_foffs;
 
+static bool elf_stream;         /* %pragma elf stream */
+static FILE *elf_spillfp;       /* Spilled section contents */
+
 static void elf_write(void);
 static void elf_sect_write(struct elf_section *, const void *, size_t);
+static void elf_sect_write_map(struct elf_section *, struct nasm_mapping *,
+                               const void *, size_t);
 static void elf_sect_writeaddr(struct elf_section *, int64_t, size_t);
 static void elf_section_header(int name, int type, uint64_t flags,
                                void *data, bool is_saa, uint64_t datalen,
@@ -192,16 +197,16 @@ struct elf_format_info {
     void (*elf_sym)(const struct elf_symbol *);
 
     /* Build a relocation table */
-    struct SAA *(*elf_build_reltab)(const struct elf_reloc *);
+    struct SAA *(*elf_build_reltab)(const struct ol_relocs *);
 };
 static const struct elf_format_info *efmt;
 
 static void elf32_sym(const struct elf_symbol *sym);
 static void elf64_sym(const struct elf_symbol *sym);
 
-static struct SAA *elf32_build_reltab(const struct elf_reloc *r);
-static struct SAA *elfx32_build_reltab(const struct elf_reloc *r);
-static struct SAA *elf64_build_reltab(const struct elf_reloc *r);
+static struct SAA *elf32_build_reltab(const struct ol_relocs *r);
+static struct SAA *elfx32_build_reltab(const struct ol_relocs *r);
+static struct SAA *elf64_build_reltab(const struct ol_relocs *r);
 
 static bool dfmt_is_stabs(void);
 static bool dfmt_is_dwarf(void);
@@ -530,6 +535,7 @@ static void elf_init(void)
     const char * const *p;
 
     elf_populate_dirs();
+    elf_stream = false;
     sects = NULL;
     nsects = sectlen = 0;
     syms = saa_init((int32_t)sizeof(struct elf_symbol));
@@ -581,20 +587,19 @@ static void elf_init(void)
 
 static void elf_cleanup(void)
 {
-    struct elf_reloc *r;
     int i;
 
     elf_write();
+    if (elf_spillfp) {
+        fclose(elf_spillfp);
+        elf_spillfp = NULL;
+    }
     for (i = 0; i < nsects; i++) {
         if (sects[i]->type != SHT_NOBITS)
             saa_free(sects[i]->data);
         if (sects[i]->rel)
             saa_free(sects[i]->rel);
-        while (sects[i]->head) {
-            r = sects[i]->head;
-            sects[i]->head = sects[i]->head->next;
-            nasm_free(r);
-        }
+        ol_free_relocs(&sects[i]->relocs);
     }
     hash_free(&section_by_name);
     raa_free(section_by_index);
@@ -637,7 +642,6 @@ elf_make_section(char *name, int type, int flags, uint64_t align)
 
     if (type != SHT_NOBITS)
         s->data = saa_init(1L);
-    s->tail = &s->head;
     if (!strcmp(name, ".text"))
         s->index = def_seg;
     else
@@ -930,7 +934,7 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
             stdscan_reset((char *)spcword);
             tokval.t_type = TOKEN_INVALID;
             e = evaluate(stdscan, NULL, &tokval, &fwd, 0, NULL);
-            if (fwd) {
+            if (fwd & (OPFLAG_FORWARD|OPFLAG_EXTERN)) {
                 sym->nextfwd = fwds;
                 fwds = sym;
                 sym->name = nasm_strdup(name);
@@ -989,25 +993,18 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
 static void elf_add_reloc(struct elf_section *sect, int32_t segment,
                           int64_t offset, int type)
 {
-    struct elf_reloc *r;
-
-    r = *sect->tail = nasm_zalloc(sizeof(struct elf_reloc));
-    sect->tail = &r->next;
-
-    r->address = sect->len;
-    r->offset = offset;
+    uint32_t symbol = 0;
 
     if (segment != NO_SEG) {
         const struct elf_section *s;
         s = raa_read_ptr(section_by_index, segment >> 1);
         if (s)
-            r->symbol = s->shndx + 1;
+            symbol = s->shndx + 1;
         else
-            r->symbol = GLOBAL_TEMP_BASE + raa_read(bsym, segment);
+            symbol = GLOBAL_TEMP_BASE + raa_read(bsym, segment);
     }
-    r->type = type;
 
-    sect->nrelocs++;
+    ol_add_reloc(&sect->relocs, sect->len, symbol, type, offset);
 }
 
 /*
@@ -1036,7 +1033,6 @@ static int64_t elf_add_gsym_reloc(struct elf_section *sect,
                                   int32_t segment, uint64_t offset,
                                   int64_t pcrel, int type, bool exact)
 {
-    struct elf_reloc *r;
     struct elf_section *s;
     struct elf_symbol *sym;
     struct rbtree *srb;
@@ -1065,17 +1061,10 @@ static int64_t elf_add_gsym_reloc(struct elf_section *sect,
     }
     sym = container_of(srb, struct elf_symbol, symv);
 
-    r = *sect->tail = nasm_malloc(sizeof(struct elf_reloc));
-    sect->tail = &r->next;
-
-    r->next     = NULL;
-    r->address  = sect->len;
-    r->offset = offset - pcrel - sym->symv.key;
-    r->symbol   = GLOBAL_TEMP_BASE + sym->globnum;
-    r->type     = type;
-
-    sect->nrelocs++;
-    return r->offset;
+    offset -= pcrel + sym->symv.key;
+    ol_add_reloc(&sect->relocs, sect->len,
+                 GLOBAL_TEMP_BASE + sym->globnum, type, offset);
+    return offset;
 }
 
 static void elf32_out(const struct out_data *out)
@@ -1131,7 +1120,7 @@ static void elf32_out(const struct out_data *out)
         break;
 
     case OUT_RAWDATA:
-        elf_sect_write(s, data, size);
+        elf_sect_write_map(s, out->map, data, size);
         break;
 
     case OUT_ADDRESS:
@@ -1338,7 +1327,7 @@ static void elf64_out(const struct out_data *out)
     case OUT_RAWDATA:
         if (segment != NO_SEG)
             nasm_panic("OUT_RAWDATA with other than NO_SEG");
-        elf_sect_write(s, data, size);
+        elf_sect_write_map(s, out->map, data, size);
         break;
 
     case OUT_ADDRESS:
@@ -1618,7 +1607,7 @@ static void elfx32_out(const struct out_data *out)
     case OUT_RAWDATA:
         if (segment != NO_SEG)
             nasm_panic("OUT_RAWDATA with other than NO_SEG");
-        elf_sect_write(s, data, size);
+        elf_sect_write_map(s, out->map, data, size);
         break;
 
     case OUT_ADDRESS:
@@ -1877,9 +1866,9 @@ static void elf_write(void)
         add_sectname("", ".symtab_shndx");
 
     for (i = 0; i < nsects; i++) {
-        if (sects[i]->head) {
+        if (sects[i]->relocs.n) {
             add_sectname(efmt->relpfx, sects[i]->name);
-            sects[i]->rel = efmt->elf_build_reltab(sects[i]->head);
+            sects[i]->rel = efmt->elf_build_reltab(&sects[i]->relocs);
         }
     }
 
@@ -2200,105 +2189,111 @@ static size_t elf_build_symtab(void)
     return nlocal;
 }
 
-static struct SAA *elf32_build_reltab(const struct elf_reloc *r)
+/*
+ * The relocation tables are converted to their on-disk layout in
+ * batches of this many entries before being added to the SAA.
+ */
+#define RELTAB_BATCH 256
+
+/*
+ * How to convert from a global placeholder to a real symbol index;
+ * the +2 refers to the two special entries, the null entry and the
+ * filename entry.
+ */
+static inline uint32_t elf_reloc_sym(const struct ol_relocs *r, size_t i)
+{
+    uint32_t sym = r->sym[i];
+
+    if (sym >= GLOBAL_TEMP_BASE)
+        sym += -GLOBAL_TEMP_BASE + nsects + nlocals + ndebugs + 2;
+
+    return sym;
+}
+
+static struct SAA *elf32_build_reltab(const struct ol_relocs *r)
 {
     struct SAA *s;
-    int32_t global_offset;
-    Elf32_Rel rel32;
+    Elf32_Rel rel32[RELTAB_BATCH];
+    size_t i, n;
 
-    if (!r)
+    if (!r->n)
         return NULL;
 
     s = saa_init(1L);
 
-    /*
-     * How to onvert from a global placeholder to a real symbol index;
-     * the +2 refers to the two special entries, the null entry and
-     * the filename entry.
-     */
-    global_offset = -GLOBAL_TEMP_BASE + nsects + nlocals + ndebugs + 2;
-
-    while (r) {
-        int32_t sym = r->symbol;
-
-        if (sym >= GLOBAL_TEMP_BASE)
-            sym += global_offset;
+    for (i = 0; i < r->n; i += n) {
+        size_t j;
 
-        rel32.r_offset    = htole32(r->address);
-        rel32.r_info      = htole32(ELF32_R_INFO(sym, r->type));
-        saa_wbytes(s, &rel32, sizeof rel32);
+        n = r->n - i;
+        if (n > RELTAB_BATCH)
+            n = RELTAB_BATCH;
 
-        r = r->next;
+        for (j = 0; j < n; j++) {
+            rel32[j].r_offset = htole32(r->addr[i+j]);
+            rel32[j].r_info   = htole32(ELF32_R_INFO(elf_reloc_sym(r, i+j),
+                                                     r->type[i+j]));
+        }
+        saa_wbytes(s, rel32, n * sizeof rel32[0]);
     }
 
     return s;
 }
 
-static struct SAA *elfx32_build_reltab(const struct elf_reloc *r)
+static struct SAA *elfx32_build_reltab(const struct ol_relocs *r)
 {
     struct SAA *s;
-    int32_t global_offset;
-    Elf32_Rela rela32;
+    Elf32_Rela rela32[RELTAB_BATCH];
+    size_t i, n;
 
-    if (!r)
+    if (!r->n)
         return NULL;
 
     s = saa_init(1L);
 
-    /*
-     * How to onvert from a global placeholder to a real symbol index;
-     * the +2 refers to the two special entries, the null entry and
-     * the filename entry.
-     */
-    global_offset = -GLOBAL_TEMP_BASE + nsects + nlocals + ndebugs + 2;
-
-    while (r) {
-        int32_t sym = r->symbol;
-
-        if (sym >= GLOBAL_TEMP_BASE)
-            sym += global_offset;
+    for (i = 0; i < r->n; i += n) {
+        size_t j;
 
-        rela32.r_offset   = htole32(r->address);
-        rela32.r_info     = htole32(ELF32_R_INFO(sym, r->type));
-        rela32.r_addend   = htole32(r->offset);
-        saa_wbytes(s, &rela32, sizeof rela32);
+        n = r->n - i;
+        if (n > RELTAB_BATCH)
+            n = RELTAB_BATCH;
 
-        r = r->next;
+        for (j = 0; j < n; j++) {
+            rela32[j].r_offset = htole32(r->addr[i+j]);
+            rela32[j].r_info   = htole32(ELF32_R_INFO(elf_reloc_sym(r, i+j),
+                                                      r->type[i+j]));
+            rela32[j].r_addend = htole32(ol_reloc_addend(r, i+j));
+        }
+        saa_wbytes(s, rela32, n * sizeof rela32[0]);
     }
 
     return s;
 }
 
-static struct SAA *elf64_build_reltab(const struct elf_reloc *r)
+static struct SAA *elf64_build_reltab(const struct ol_relocs *r)
 {
     struct SAA *s;
-    int32_t global_offset;
-    Elf64_Rela rela64;
+    Elf64_Rela rela64[RELTAB_BATCH];
+    size_t i, n;
 
-    if (!r)
+    if (!r->n)
         return NULL;
 
     s = saa_init(1L);
 
-    /*
-     * How to onvert from a global placeholder to a real symbol index;
-     * the +2 refers to the two special entries, the null entry and
-     * the filename entry.
-     */
-    global_offset = -GLOBAL_TEMP_BASE + nsects + nlocals + ndebugs + 2;
-
-    while (r) {
-        int32_t sym = r->symbol;
-
-        if (sym >= GLOBAL_TEMP_BASE)
-            sym += global_offset;
+    for (i = 0; i < r->n; i += n) {
+        size_t j;
 
-        rela64.r_offset   = htole64(r->address);
-        rela64.r_info     = htole64(ELF64_R_INFO(sym, r->type));
-        rela64.r_addend   = htole64(r->offset);
-        saa_wbytes(s, &rela64, sizeof rela64);
+        n = r->n - i;
+        if (n > RELTAB_BATCH)
+            n = RELTAB_BATCH;
 
-        r = r->next;
+        for (j = 0; j < n; j++) {
+            rela64[j].r_offset = htole64(r->addr[i+j]);
+            rela64[j].r_info   = htole64(ELF64_R_INFO(elf_reloc_sym(r, i+j),
+                                                      r->type[i+j]));
+            rela64[j].r_addend = htole64(ol_reloc_addend(r, i+j));
+        }
+        saa_wbytes(s, rela64, n * sizeof rela64[0]);
     }
 
     return s;
@@ -2367,16 +2362,54 @@ static void elf_write_sections(void)
         }
 }
 
+/*
+ * With "%pragma elf stream", section contents are moved out to a
+ * temporary file in large chunks as they are generated, and copied
+ * into the object file when it is written, so that the contents of
+ * the whole object are never held in memory at once.
+ */
+#define ELF_SPILL_CHUNK ((size_t)16 << 20)
+
+static void elf_sect_spill(struct elf_section *sect)
+{
+    struct SAA *s = sect->data;
+
+    if (likely(!elf_stream) ||
+        s->datalen - s->spilled * s->blk_len < ELF_SPILL_CHUNK)
+        return;
+
+    if (!elf_spillfp) {
+        elf_spillfp = tmpfile();
+        if (!elf_spillfp)
+            nasm_fatal("unable to create temporary file: %s",
+                       strerror(errno));
+    }
+
+    saa_spill(s, elf_spillfp);
+}
+
 static void elf_sect_write(struct elf_section *sect, const void *data, size_t len)
 {
     saa_wbytes(sect->data, data, len);
     sect->len += len;
+    elf_sect_spill(sect);
+}
+
+/* Raw data which may be held by reference to a file mapping */
+static void elf_sect_write_map(struct elf_section *sect,
+                               struct nasm_mapping *map,
+                               const void *data, size_t len)
+{
+    saa_wmap(sect->data, map, data, len);
+    sect->len += len;
+    elf_sect_spill(sect);
 }
 
 static void elf_sect_writeaddr(struct elf_section *sect, int64_t data, size_t len)
 {
     saa_writeaddr(sect->data, data, len);
     sect->len += len;
+    elf_sect_spill(sect);
 }
 
 static void elf_sectalign(int32_t seg, unsigned int value)
@@ -2393,11 +2426,33 @@ static void elf_sectalign(int32_t seg, unsigned int value)
 
 extern macros_t elf_stdmac[];
 
-/* Claim "elf" as a pragma namespace, for the future */
+/*
+ * ELF pragmas
+ */
+static enum directive_result
+elf_pragma(const struct pragma *pragma)
+{
+    switch (pragma->opcode) {
+    case D_unknown:
+        if (!strcmp(pragma->opname, "stream")) {
+            if (*pragma->tail)
+                return DIRR_BADPARAM;
+
+            elf_stream = true;
+            return DIRR_OK;
+        }
+
+        return DIRR_UNKNOWN;
+
+    default:
+        return DIRR_UNKNOWN;    /* Not an ELF directive */
+    }
+}
+
 static const struct pragma_facility elf_pragma_list[] =
 {
-    { "elf", NULL },
-    { NULL, NULL }          /* Implements the canonical output name */
+    { "elf", elf_pragma },
+    { NULL, elf_pragma }    /* Implements the canonical output name */
 };
 
 
@@ -2440,7 +2495,7 @@ const struct ofmt of_elf32 = {
     "ELF32 (i386) (Linux, most Unix variants)",
     "elf32",
     ".o",
-    0,
+    OFMT_SECTION_CACHE,
     32,
     elf32_debugs_arr,
     &elf32_df_dwarf,
@@ -2497,7 +2552,7 @@ const struct ofmt of_elf64 = {
     "ELF64 (x86-64) (Linux, most Unix variants)",
     "elf64",
     ".o",
-    0,
+    OFMT_SECTION_CACHE,
     64,
     elf64_debugs_arr,
     &elf64_df_dwarf,
@@ -2554,7 +2609,7 @@ const struct ofmt of_elfx32 = {
     "ELFx32 (ELF32 for x86-64) (Linux)",
     "elfx32",
     ".o",
-    0,
+    OFMT_SECTION_CACHE,
     64,
     elfx32_debugs_arr,
     &elfx32_df_dwarf,
@@ -3027,10 +3082,59 @@ static void dwarf_linenum(const char *filename, int32_t linenumber,
     currentline = linenumber;
 }
 
+/*
+ * Add a row to a line number program, advancing the line by ln and
+ * the address by aa, in as few bytes as possible: a single special
+ * opcode if both advances fit, otherwise whatever explicit advances
+ * are needed to bring them into range of one.
+ */
+static void dwarf_line_row(struct SAA *plinep, int32_t ln, uint64_t aa)
+{
+    /* The address advance of DW_LNS_const_add_pc (special opcode 255) */
+    const uint64_t const_add = (255 - opcode_base) / line_range;
+    uint64_t maxaa;
+
+    if (ln < line_base || ln >= line_base + line_range) {
+        saa_write8(plinep,DW_LNS_advance_line);
+        saa_wleb128s(plinep,ln);
+        ln = 0;
+    }
+
+    /* Largest address advance a special opcode can have with this ln */
+    maxaa = (255 - opcode_base - (ln - line_base)) / line_range;
+    if (aa > maxaa) {
+        if (aa - const_add <= maxaa && aa >= const_add) {
+            saa_write8(plinep,DW_LNS_const_add_pc);
+            aa -= const_add;
+        } else {
+            saa_write8(plinep,DW_LNS_advance_pc);
+            saa_wleb128u(plinep,aa);
+            aa = 0;
+        }
+    }
+
+    saa_write8(plinep,(ln - line_base) + (line_range * aa) + opcode_base);
+}
+
+/* Terminate the line number program of a section */
+static void dwarf_end_sequence(const struct sectlist *psect)
+{
+    struct SAA *plinep = psect->psaa;
+    uint64_t aa = sects[psect->section]->len - psect->offset;
+
+    if (aa) {
+        saa_write8(plinep,DW_LNS_advance_pc);
+        saa_wleb128u(plinep,aa);
+    }
+    saa_write8(plinep,DW_LNS_extended_op);
+    saa_write8(plinep,1);           /* operand length */
+    saa_write8(plinep,DW_LNE_end_sequence);
+}
+
 /* called from elf_out with type == TY_DEBUGSYMLIN */
 static void dwarf_output(int type, void *param)
 {
-    int ln, aa, inx, maxln, soc;
+    int ln, aa, inx;
     struct symlininfo *s;
     struct SAA *plinep;
 
@@ -3062,20 +3166,7 @@ static void dwarf_output(int type, void *param)
     }
     /* check for line change */
     if (ln) {
-        /* test if in range of special op code */
-        maxln = line_base + line_range;
-        soc = (ln - line_base) + (line_range * aa) + opcode_base;
-        if (ln >= line_base && ln < maxln && soc < 256) {
-            saa_write8(plinep,soc);
-        } else {
-            saa_write8(plinep,DW_LNS_advance_line);
-            saa_wleb128s(plinep,ln);
-            if (aa) {
-                saa_write8(plinep,DW_LNS_advance_pc);
-                saa_wleb128u(plinep,aa);
-            }
-            saa_write8(plinep,DW_LNS_copy);
-        }
+        dwarf_line_row(plinep, ln, aa);
         dwarf_csect->line = currentline;
         dwarf_csect->offset = s->offset;
     }
@@ -3112,14 +3203,9 @@ static void dwarf_generate(void)
         totlen = 0;
         highaddr = 0;
         for (indx = 0; indx < dwarf_nsections; indx++) {
-            plinep = psect->psaa;
             /* Line Number Program Epilogue */
-            saa_write8(plinep,2);           /* std op 2 */
-            saa_write8(plinep,(sects[psect->section]->len)-psect->offset);
-            saa_write8(plinep,DW_LNS_extended_op);
-            saa_write8(plinep,1);           /* operand length */
-            saa_write8(plinep,DW_LNE_end_sequence);
-            totlen += plinep->datalen;
+            dwarf_end_sequence(psect);
+            totlen += psect->psaa->datalen;
             /* range table relocation entry */
             saa_write32(parangesrel, paranges->datalen + 4);
             saa_write32(parangesrel, ((uint32_t) (psect->section + 2) << 8) +  R_386_32);
@@ -3156,14 +3242,9 @@ static void dwarf_generate(void)
         totlen = 0;
         highaddr = 0;
         for (indx = 0; indx < dwarf_nsections; indx++)  {
-            plinep = psect->psaa;
             /* Line Number Program Epilogue */
-            saa_write8(plinep,2);			/* std op 2 */
-            saa_write8(plinep,(sects[psect->section]->len)-psect->offset);
-            saa_write8(plinep,DW_LNS_extended_op);
-            saa_write8(plinep,1);			/* operand length */
-            saa_write8(plinep,DW_LNE_end_sequence);
-            totlen += plinep->datalen;
+            dwarf_end_sequence(psect);
+            totlen += psect->psaa->datalen;
             /* range table relocation entry */
             saa_write32(parangesrel, paranges->datalen + 4);
             saa_write32(parangesrel, ((uint32_t) (psect->section + 2) << 8) +  R_X86_64_32);
@@ -3202,14 +3283,9 @@ static void dwarf_generate(void)
         totlen = 0;
         highaddr = 0;
         for (indx = 0; indx < dwarf_nsections; indx++) {
-            plinep = psect->psaa;
             /* Line Number Program Epilogue */
-            saa_write8(plinep,2);			/* std op 2 */
-            saa_write8(plinep,(sects[psect->section]->len)-psect->offset);
-            saa_write8(plinep,DW_LNS_extended_op);
-            saa_write8(plinep,1);			/* operand length */
-            saa_write8(plinep,DW_LNE_end_sequence);
-            totlen += plinep->datalen;
+            dwarf_end_sequence(psect);
+            totlen += psect->psaa->datalen;
             /* range table relocation entry */
             saa_write64(parangesrel, paranges->datalen + 4);
             saa_write64(parangesrel, ((uint64_t) (psect->section + 2) << 32) +  R_X86_64_64);
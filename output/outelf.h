@@ -10,6 +10,7 @@
 #include "elf.h"
 #include "rbtree.h"
 #include "saa.h"
+#include "outlib.h"
 
 #define GLOBAL_TEMP_BASE  0x40000000 /* bigger than any sane symbol index */
 
@@ -61,14 +62,6 @@ extern uint8_t elf_abiver;
         WRITELONG(p, n_value);                              \
     } while (0)
 
-struct elf_reloc {
-    struct elf_reloc    *next;
-    int64_t             address;        /* relative to _start_ of section */
-    int64_t             symbol;         /* symbol index */
-    int64_t             offset;         /* symbol addend */
-    int                 type;           /* type of relocation */
-};
-
 struct elf_symbol {
     struct rbtree       symv;           /* symbol value and symbol rbtree */
     int32_t             strpos;         /* string table position of name */
@@ -85,7 +78,6 @@ struct elf_section {
     struct SAA          *data;
     uint64_t            len;
     uint64_t            size;
-    uint64_t            nrelocs;
     int32_t             index;		/* NASM index or NO_SEG if internal */
     int			shndx;          /* ELF index */
     int                 type;           /* SHT_* */
@@ -95,8 +87,7 @@ struct elf_section {
     uint64_t		entsize;        /* entry size */
     char                *name;
     struct SAA          *rel;
-    struct elf_reloc    *head;
-    struct elf_reloc    **tail;
+    struct ol_relocs    relocs;         /* relocations against section */
     struct rbtree       *gsyms;         /* global symbols in section */
 };
 
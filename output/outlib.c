@@ -26,6 +26,45 @@ uint64_t realsize(enum out_type type, uint64_t size)
     }
 }
 
+/* Relocation buffers */
+
+size_t ol_add_reloc(struct ol_relocs *rel, uint64_t addr, uint32_t sym,
+                    uint32_t type, int64_t addend)
+{
+    size_t i = rel->n;
+
+    if (i >= rel->size) {
+        rel->size = rel->size ? rel->size << 1 : 64;
+        rel->addr = nasm_realloc(rel->addr, rel->size * sizeof(*rel->addr));
+        rel->sym  = nasm_realloc(rel->sym,  rel->size * sizeof(*rel->sym));
+        rel->type = nasm_realloc(rel->type, rel->size * sizeof(*rel->type));
+        if (rel->addend)
+            rel->addend = nasm_realloc(rel->addend,
+                                       rel->size * sizeof(*rel->addend));
+    }
+
+    if (addend && !rel->addend)
+        nasm_newn(rel->addend, rel->size); /* Earlier entries are zero */
+
+    rel->addr[i] = addr;
+    rel->sym[i]  = sym;
+    rel->type[i] = type;
+    if (rel->addend)
+        rel->addend[i] = addend;
+
+    rel->n = i + 1;
+    return i;
+}
+
+void ol_free_relocs(struct ol_relocs *rel)
+{
+    nasm_free(rel->addr);
+    nasm_free(rel->sym);
+    nasm_free(rel->type);
+    nasm_free(rel->addend);
+    nasm_zero(*rel);
+}
+
 /* Common section/symbol handling */
 
 struct ol_sect *_ol_sect_list;
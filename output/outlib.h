@@ -44,6 +44,33 @@ extern const struct dfmt * const null_debug_arr[2];
     int32_t _segment    = (_out)->legacy.tsegment;                    \
     int32_t _wrt        = (_out)->legacy.twrt
 
+/*
+ * Relocation buffer shared by the backends. Objects can carry
+ * millions of relocations, so they are kept as parallel arrays
+ * rather than as a list of individually allocated structures.
+ *
+ * The meaning of sym and type is up to the backend. The addend
+ * array is only allocated once a nonzero addend has been added.
+ */
+struct ol_relocs {
+    size_t n;                   /* Number of relocations */
+    size_t size;                /* Allocated entries */
+    uint64_t *addr;             /* Offset in the section */
+    uint32_t *sym;              /* Symbol reference */
+    uint32_t *type;             /* Relocation type */
+    int64_t *addend;            /* Addends, or NULL if all zero */
+};
+
+/* Append a relocation; returns its index */
+size_t ol_add_reloc(struct ol_relocs *rel, uint64_t addr, uint32_t sym,
+                    uint32_t type, int64_t addend);
+void ol_free_relocs(struct ol_relocs *rel);
+
+static inline int64_t ol_reloc_addend(const struct ol_relocs *rel, size_t i)
+{
+    return rel->addend ? rel->addend[i] : 0;
+}
+
 /*
  * Common routines for tasks that really should migrate into the core.
  * This provides a common interface for maintaining sections and symbols,
@@ -97,7 +97,7 @@ struct section {
     int32_t index;		/* Main section index */
     int32_t subsection;		/* Current subsection index */
     int32_t fileindex;
-    struct reloc *relocs;
+    struct ol_relocs relocs;	/* see macho_add_reloc() */
     struct rbtree *syms[2]; /* All/global symbols symbols in section */
     int align;
     bool by_name;	    /* This section was specified by full MachO name */
@@ -110,7 +110,6 @@ struct section {
     uint64_t size;         /* in-memory and -file size  */
     uint64_t offset;	   /* in-file offset */
     uint32_t pad;          /* padding bytes before section */
-    uint32_t nreloc;       /* relocation entry count */
     uint32_t flags;        /* type and attributes (masked) */
     uint32_t extreloc;     /* external relocations */
 };
@@ -121,9 +120,6 @@ struct section {
 static struct section absolute_sect;
 
 struct reloc {
-    /* nasm internal data */
-    struct reloc *next;
-
     /* data that goes into the file */
     int32_t addr;		/* op's offset in section */
     uint32_t snum:24,		/* contains symbol index if
@@ -135,6 +131,38 @@ struct reloc {
 	type:4;                 /* reloc type */
 };
 
+/*
+ * Relocations are kept per section in a struct ol_relocs, with the
+ * symbol number in sym and the remaining bits of the second word of
+ * the file entry in type.
+ */
+#define MACHO_RELOC_SNUM_MASK	0x00ffffff
+
+static void macho_add_reloc(struct ol_relocs *rel, const struct reloc *r)
+{
+    uint32_t info;
+
+    info  = r->pcrel << 24;
+    info |= r->length << 25;
+    info |= r->ext << 27;
+    info |= (uint32_t)r->type << 28;
+    ol_add_reloc(rel, (uint32_t)r->addr, r->snum, info, 0);
+}
+
+static struct reloc macho_get_reloc(const struct ol_relocs *rel, size_t i)
+{
+    struct reloc r;
+    uint32_t info = rel->type[i];
+
+    r.addr   = (int32_t)rel->addr[i];
+    r.snum   = rel->sym[i] & MACHO_RELOC_SNUM_MASK;
+    r.pcrel  = (info >> 24) & 1;
+    r.length = (info >> 25) & 3;
+    r.ext    = (info >> 27) & 1;
+    r.type   = (info >> 28) & 15;
+    return r;
+}
+
 struct symbol {
     /* nasm internal data */
     struct rbtree symv[2];	/* All/global symbol rbtrees; "key" contains the
@@ -385,7 +413,7 @@ static int64_t add_reloc(struct section *sect, int32_t section,
 			 int64_t offset,
 			 enum reltype reltype, int bytes)
 {
-    struct reloc *r;
+    struct reloc reloc, *r = &reloc;
     struct section *s;
     int32_t fi;
     int64_t adjust;
@@ -397,7 +425,6 @@ static int64_t add_reloc(struct section *sect, int32_t section,
      ** now, might have to be fixed by macho_fixup_relocs() later on. make
      ** sure we don't make the symbol scattered by setting the highest
      ** bit by accident */
-    r = nasm_malloc(sizeof(struct reloc));
     r->addr = sect->size & ~R_SCATTERED;
     r->ext = 1;
     adjust = 0;
@@ -511,19 +538,13 @@ static int64_t add_reloc(struct section *sect, int32_t section,
     if (r->pcrel)
 	adjust += ((r->ext && fmt.ptrsize == 8) ? bytes : -(int64_t)sect->size);
 
-    /* NeXT as puts relocs in reversed order (address-wise) into the
-     ** files, so we do the same, doesn't seem to make much of a
-     ** difference either way */
-    r->next = sect->relocs;
-    sect->relocs = r;
+    macho_add_reloc(&sect->relocs, r);
     if (r->ext)
 	sect->extreloc = 1;
-    ++sect->nreloc;
 
     return adjust;
 
  bail:
-    nasm_free(r);
     return 0;
 }
 
@@ -849,7 +870,6 @@ static int32_t macho_section(char *name, int *bits)
 	s->by_name = false;
 
 	s->size = 0;
-	s->nreloc = 0;
 	s->flags = flags;
     }
 
@@ -1317,7 +1337,7 @@ static uint32_t macho_write_segment (uint64_t offset)
 
     /* emit section headers */
     for (s = sects; s != NULL; s = s->next) {
-	if (s->nreloc) {
+	if (s->relocs.n) {
 	    nasm_assert((s->flags & SECTION_TYPE) != S_ZEROFILL);
 	    s->flags |= S_ATTR_LOC_RELOC;
 	    if (s->extreloc)
@@ -1351,10 +1371,10 @@ static uint32_t macho_write_segment (uint64_t offset)
             fwriteint32_t(s->align, ofile);
             /* To be compatible with cctools as we emit
             a zero reloff if we have no relocations.  */
-            fwriteint32_t(s->nreloc ? rel_base + s_reloff : 0, ofile);
-            fwriteint32_t(s->nreloc, ofile);
+            fwriteint32_t(s->relocs.n ? rel_base + s_reloff : 0, ofile);
+            fwriteint32_t(s->relocs.n, ofile);
 
-            s_reloff += s->nreloc * MACHO_RELINFO_SIZE;
+            s_reloff += s->relocs.n * MACHO_RELINFO_SIZE;
         } else {
             fwriteint32_t(0, ofile);
             fwriteint32_t(s->align, ofile);
@@ -1373,23 +1393,19 @@ static uint32_t macho_write_segment (uint64_t offset)
     return offset;
 }
 
-/* For a given chain of relocs r, write out the entire relocation
-   chain to the object file.  */
+/* Write out the relocation entries of a section to the object file.
+   NeXT as puts relocs in reversed order (address-wise) into the
+   files, so we do the same, doesn't seem to make much of a
+   difference either way */
 
-static void macho_write_relocs (struct reloc *r)
+static void macho_write_relocs (const struct ol_relocs *rel)
 {
-    while (r) {
-	uint32_t word2;
-
-	fwriteint32_t(r->addr, ofile); /* reloc offset */
+    size_t i = rel->n;
 
-	word2 = r->snum;
-	word2 |= r->pcrel << 24;
-	word2 |= r->length << 25;
-	word2 |= r->ext << 27;
-	word2 |= r->type << 28;
-	fwriteint32_t(word2, ofile); /* reloc data */
-	r = r->next;
+    while (i--) {
+	fwriteint32_t(rel->addr[i], ofile); /* reloc offset */
+	fwriteint32_t((rel->sym[i] & MACHO_RELOC_SNUM_MASK) | rel->type[i],
+		      ofile); /* reloc data */
     }
 }
 
@@ -1397,7 +1413,8 @@ static void macho_write_relocs (struct reloc *r)
 static void macho_write_section (void)
 {
     struct section *s;
-    struct reloc *r;
+    struct reloc r;
+    size_t i;
     uint8_t *p;
     int32_t len;
     int64_t l;
@@ -1415,12 +1432,13 @@ static void macho_write_section (void)
 	 * start of the _text_ section, in the _file_. See outaout.c
 	 * for more information. */
 	saa_rewind(s->data);
-	for (r = s->relocs; r != NULL; r = r->next) {
-	    len = (uint32_t)1 << r->length;
+	for (i = s->relocs.n; i--; ) {
+	    r = macho_get_reloc(&s->relocs, i);
+	    len = (uint32_t)1 << r.length;
 	    if (len > 4)	/* Can this ever be an issue?! */
 		len = 8;
 	    blk.val = 0;
-	    saa_fread(s->data, r->addr, blk.buf, len);
+	    saa_fread(s->data, r.addr, blk.buf, len);
 
 	    /* get offset based on relocation type */
 #ifdef WORDS_LITTLEENDIAN
@@ -1440,20 +1458,20 @@ static void macho_write_section (void)
 	       offset. Otherwise the only value we need is the symbol
 	       offset which we already have. The linker takes care
 	       of the rest of the address.  */
-	    if (!r->ext) {
+	    if (!r.ext) {
 		/* generate final address by section address and offset */
-		nasm_assert(r->snum <= seg_nsects);
-		l += sectstab[r->snum]->addr;
-		if (r->pcrel)
+		nasm_assert(r.snum <= seg_nsects);
+		l += sectstab[r.snum]->addr;
+		if (r.pcrel)
 		    l -= s->addr;
-	    } else if (r->pcrel && r->type == GENERIC_RELOC_VANILLA) {
+	    } else if (r.pcrel && r.type == GENERIC_RELOC_VANILLA) {
 		l -= s->addr;
 	    }
 
 	    /* write new offset back */
 	    p = blk.buf;
 	    WRITEDLONG(p, l);
-	    saa_fwrite(s->data, r->addr, blk.buf, len);
+	    saa_fwrite(s->data, r.addr, blk.buf, len);
 	}
 
 	/* dump the section data to file */
@@ -1466,7 +1484,7 @@ static void macho_write_section (void)
 
     /* emit relocation entries */
     for (s = sects; s != NULL; s = s->next)
-	macho_write_relocs (s->relocs);
+	macho_write_relocs (&s->relocs);
 }
 
 /* Write out the symbol table. We should already have sorted this
@@ -1533,21 +1551,18 @@ static void macho_write_symtab (void)
 }
 
 /* Fixup the snum in the relocation entries, we should be
-   doing this only for externally referenced symbols. */
-static void macho_fixup_relocs (struct reloc *r)
+   doing this only for externally referenced symbols.  snum_map
+   maps initial_snum to the final snum, or is -1 if unused. */
+static void macho_fixup_relocs (struct ol_relocs *rel,
+				const int32_t *snum_map, uint32_t nmap)
 {
-    struct symbol *sym;
+    size_t i;
 
-    while (r != NULL) {
-	if (r->ext) {
-	    for (sym = syms; sym != NULL; sym = sym->next) {
-		if (sym->initial_snum == r->snum) {
-		    r->snum = sym->snum;
-		    break;
-		}
-	    }
-	}
-	r = r->next;
+    for (i = 0; i < rel->n; i++) {
+	struct reloc r = macho_get_reloc(rel, i);
+
+	if (r.ext && r.snum < nmap && snum_map[r.snum] != -1)
+	    rel->sym[i] = snum_map[r.snum];
     }
 }
 
@@ -1683,8 +1698,9 @@ static void macho_write (void)
 static void macho_cleanup(void)
 {
     struct section *s;
-    struct reloc *r;
     struct symbol *sym;
+    int32_t *snum_map;
+    uint32_t nmap;
 
     dfmt->cleanup();
 
@@ -1692,9 +1708,21 @@ static void macho_cleanup(void)
     macho_layout_symbols (&nsyms, &strslen);
 
     /* Fixup relocation entries */
+    nmap = 0;
+    for (sym = syms; sym != NULL; sym = sym->next) {
+	if (sym->initial_snum >= (int32_t)nmap)
+	    nmap = sym->initial_snum + 1;
+    }
+    snum_map = nasm_malloc(nmap * sizeof(*snum_map));
+    memset(snum_map, -1, nmap * sizeof(*snum_map));
+    for (sym = syms; sym != NULL; sym = sym->next) {
+	if (sym->initial_snum >= 0 && snum_map[sym->initial_snum] == -1)
+	    snum_map[sym->initial_snum] = sym->snum;
+    }
     for (s = sects; s != NULL; s = s->next) {
-	macho_fixup_relocs (s->relocs);
+	macho_fixup_relocs (&s->relocs, snum_map, nmap);
     }
+    nasm_free(snum_map);
 
     /* First calculate and finalize needed values.  */
     macho_calculate_sizes();
@@ -1706,11 +1734,7 @@ static void macho_cleanup(void)
         sects = sects->next;
 
         saa_free(s->data);
-        while (s->relocs != NULL) {
-            r = s->relocs;
-            s->relocs = s->relocs->next;
-            nasm_free(r);
-        }
+        ol_free_relocs(&s->relocs);
 
         nasm_free(s);
     }
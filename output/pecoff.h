@@ -449,7 +449,7 @@ struct coff_Section {
     uint32_t len;
     int nrelocs;
     int32_t index;
-    struct coff_Reloc *head, **tail;
+    struct ol_relocs relocs;    /* type is COFF_RELOC_TYPE() */
     uint32_t flags;             /* section flags */
     uint32_t align_flags;       /* user-specified alignment flags */
     uint32_t sectalign_flags;   /* minimum alignment from sectalign */
@@ -467,18 +467,23 @@ struct coff_Section {
     int32_t comdat_associated;  /* associated section for selection==5 */
 };
 
-struct coff_Reloc {
-    struct coff_Reloc *next;
-    int32_t address;            /* relative to _start_ of section */
-    int32_t symbol;             /* symbol number */
-    enum {
-        SECT_SYMBOLS,
-        ABS_SYMBOL,
-        REAL_SYMBOLS
-    } symbase;                  /* relocation for symbol number :) */
-    int16_t type;
+/* What the symbol number of a relocation is relative to */
+enum coff_symbase {
+    SECT_SYMBOLS,
+    ABS_SYMBOL,
+    REAL_SYMBOLS
 };
 
+/*
+ * Relocations are kept in a struct ol_relocs: the address is relative
+ * to the start of the section, and the symbol base is stored in the
+ * upper half of the type.
+ */
+#define COFF_RELOC_TYPE(symbase, type) \
+    (((uint32_t)(symbase) << 16) | (uint16_t)(type))
+#define COFF_RELOC_SYMBASE(rtype)   ((enum coff_symbase)((rtype) >> 16))
+#define COFF_RELOC_COFFTYPE(rtype)  ((uint16_t)(rtype))
+
 struct coff_SymIdxReloc {
     struct coff_SymIdxReloc *next;
     uint32_t symbol;            /* symbol number */
@@ -0,0 +1,48 @@
+#!/usr/bin/perl
+#
+# Generate a test case for the size of the DWARF line program: code
+# with a mix of small and large line and address advances, as from
+# macro-heavy sources.  Compare the size of .debug_line from
+# "nasm -f elf64 -g -F dwarf".
+#
+
+($len) = @ARGV;
+$len = 200000 unless ($len);
+
+srand(0);
+
+print "\tbits 64\n";
+print "%macro prologue 1\n";
+print "\tpush rbp\n";
+print "\tmov rbp, rsp\n";
+print "\tsub rsp, %1\n";
+print "%endmacro\n";
+print "%macro epilogue 0\n";
+print "\tleave\n";
+print "\tret\n";
+print "%endmacro\n";
+print "\n";
+
+print "\tsection .text\n";
+for ($i = 0; $i < $len; $i++) {
+    $r = int(rand(16));
+    if ($r == 0) {
+	print "func$i:\n";
+	print "\tprologue ", 8*int(rand(64)), "\n";
+    } elsif ($r == 1) {
+	print "\tepilogue\n";
+    } elsif ($r == 2) {
+	# A line advance out of the range of a special opcode
+	print ";\n" x int(rand(32));
+	print "\tnop\n";
+    } elsif ($r == 3) {
+	# An address advance out of the range of a special opcode
+	print "\ttimes ", int(rand(512)), " nop\n";
+    } elsif ($r < 8) {
+	print "\tmov eax, ", int(rand(1 << 20)), "\n";
+    } elsif ($r < 12) {
+	print "\tlea rax, [rbx+rcx*4+", int(rand(4096)), "]\n";
+    } else {
+	print "\tadd rax, rdx\n";
+    }
+}
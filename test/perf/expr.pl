@@ -0,0 +1,24 @@
+#!/usr/bin/perl
+#
+# Generate a test case for expression evaluation performance: a large
+# table of computed constants, as found in generated lookup tables
+#
+
+@ops = qw(+ - * | & ^ << >>);
+
+srand(0);
+sub pickone(@) {
+    return $_[int(rand(scalar @_))];
+}
+
+($len) = @ARGV;
+$len = 500000 unless ($len);
+
+print "\tbits 32\n";
+print "K\tequ 12\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    print "\tdd (($i ", pickone(@ops), " K) ", pickone(@ops), " 3) & 0xffffffff, ",
+        "$i*4+2, ~($i & 0xff), ($i < K) ? $i : -$i\n";
+}
@@ -0,0 +1,56 @@
+#!/usr/bin/perl
+#
+# Generate a test case for lexer performance: about $mb megabytes of
+# identifier-heavy source. If a NASM binary is given as well, assemble
+# the generated file with it and report the throughput in MB/s.
+#
+
+use Time::HiRes qw(time);
+
+@insns = qw(mov add sub and or xor cmp test lea);
+@regs  = qw(eax ebx ecx edx esi edi ebp);
+
+srand(0);
+sub pickone(@) {
+    return $_[int(rand(scalar @_))];
+}
+
+($mb, $nasm) = @ARGV;
+$mb = 100 unless ($mb);
+
+if (defined($nasm)) {
+    $file = "lex-$$.asm";
+    open($out, '>', $file) or die "$0: $file: $!\n";
+} else {
+    $out = \*STDOUT;
+}
+
+$size = 0;
+$n = 0;
+print $out "\tbits 32\n";
+while ($size < $mb * 1048576) {
+    my $sym = sprintf("%s_table_entry_%x", pickone(@insns), $n);
+    my $line;
+
+    $line  = "$sym:\n";
+    $line .= "\t" . pickone(@insns) . " " . pickone(@regs) .
+        ", [" . pickone(@regs) . " + $sym - $sym + 4*" . ($n & 7) . "]\n";
+    $line .= "\tdd $sym.local_label_$n - $sym, " . pickone(@regs) .
+        "_equivalent_value ; comment text $sym\n";
+    $line .= ".local_label_$n:\n";
+    print $out $line;
+    $size += length($line);
+    $n++;
+}
+printf $out "%s_equivalent_value equ %d\n", $_, length($_) for (@regs);
+
+if (defined($nasm)) {
+    close($out);
+    my $t = time;
+    system($nasm, '-f', 'bin', '-o', '/dev/null', $file) == 0
+        or die "$0: $nasm failed\n";
+    $t = time - $t;
+    unlink($file);
+    printf "%.1f MB in %.2f s: %.1f MB/s\n", $size / 1048576, $t,
+        $size / 1048576 / $t;
+}
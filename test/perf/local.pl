@@ -0,0 +1,21 @@
+#!/usr/bin/perl
+#
+# Generate a test case for local label lookup performance: a large
+# number of jump tables, each with many local labels
+#
+
+($len, $tab) = @ARGV;
+$len = 500000 unless ($len);
+$tab = 1000 unless ($tab);
+
+srand(0);
+
+print "\tbits 64\n";
+print "\tsection .text\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    print "table", int($i/$tab), ":\n" if ($i % $tab == 0);
+    print ".l$i:\n";
+    print "\tdq .l", $i - ($i % $tab) + int(rand($i % $tab + 1)), "\n";
+}
@@ -0,0 +1,34 @@
+#!/usr/bin/perl
+#
+# Generate a test case for relocation performance: a lookup table
+# with a large number of absolute relocations against external and
+# local symbols, plus relative ones from code
+#
+
+($len, $nsym) = @ARGV;
+$len = 10000000 unless ($len);
+$nsym = 1000 unless ($nsym);
+
+$blk = 1000;
+
+srand(0);
+
+print "\tbits 64\n";
+for ($i = 0; $i < $nsym; $i++) {
+    print "\textern ext$i\n";
+}
+print "\n";
+
+print "\tsection .text\n";
+print "func:\n";
+for ($i = 0; $i < $len/8; $i += $blk) {
+    print "\ttimes $blk call ext", int(rand($nsym)), "\n";
+}
+print "\n";
+
+print "\tsection .data\n";
+print "table:\n";
+for ($i = $len/8; $i < $len; $i += 2*$blk) {
+    print "\ttimes $blk dq ext", int(rand($nsym)), "\n";
+    print "\ttimes $blk dq func\n";
+}
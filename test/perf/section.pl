@@ -0,0 +1,19 @@
+#!/usr/bin/perl
+#
+# Generate a test case for section switching performance: many small
+# functions, each followed by its read-only data, as a compiler emits
+#
+
+($len) = @ARGV;
+$len = 200000 unless ($len);
+
+print "\tbits 64\n";
+for ($i = 0; $i < $len; $i++) {
+    print "\tsection .text\n";
+    print "func$i:\n";
+    print "\tlea rax, [rel str$i]\n";
+    print "\tret\n";
+    print "\tsection .rodata\n";
+    print "str$i:\n";
+    print "\tdb \"string $i\", 0\n";
+}
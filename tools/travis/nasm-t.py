@@ -9,6 +9,7 @@ import lzma
 import sys
 import re
 import os
+import struct
 
 fmtr_class = argparse.ArgumentDefaultsHelpFormatter
 parser = argparse.ArgumentParser(prog = 'nasm-t.py',
@@ -22,6 +23,10 @@ parser.add_argument('--nasm',
                     dest = 'nasm', default = './nasm',
                     help = 'Nasm executable to use')
 
+parser.add_argument('--ndisasm',
+                    dest = 'ndisasm', default = None,
+                    help = 'Ndisasm executable to use (default: next to nasm)')
+
 sp = parser.add_subparsers(dest = 'cmd')
 for cmd in ['run']:
     spp = sp.add_parser(cmd, help = 'Run test cases')
@@ -129,6 +134,56 @@ def read_ref_file(path):
     with lzma.open(xz_path, "rb") as f:
         return f.read()
 
+#
+# Extract the contents of one section of an ELF or COFF object, so a
+# test can check e.g. debug information without depending on the rest
+# of the object (which may hold absolute paths), or check that several
+# output formats hold the same data.
+def elf_section(data, name):
+    is64 = data[4] == 2
+    end = '<' if data[5] == 1 else '>'
+    if is64:
+        shoff, = struct.unpack_from(end + 'Q', data, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from(end + 'HHH', data, 0x3a)
+        shfmt = end + 'IIQQQQIIQQ'
+    else:
+        shoff, = struct.unpack_from(end + 'I', data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from(end + 'HHH', data, 0x2e)
+        shfmt = end + 'IIIIIIIIII'
+    shdrs = [struct.unpack_from(shfmt, data, shoff + i * shentsize)
+             for i in range(shnum)]
+    stroff = shdrs[shstrndx][4]
+    for sh in shdrs:
+        n = data[stroff + sh[0]:data.index(b'\0', stroff + sh[0])]
+        if n == name.encode("utf-8"):
+            return data[sh[4]:sh[4] + sh[5]]
+    return None
+
+def coff_section(data, name):
+    nsects, = struct.unpack_from('<H', data, 2)
+    shoff = 20 + struct.unpack_from('<H', data, 16)[0]
+    for i in range(nsects):
+        n, size, pos = struct.unpack_from('<8s8xII', data, shoff + i * 40)
+        if n.rstrip(b'\0') == name.encode("utf-8"):
+            return data[pos:pos + size]
+    return None
+
+def obj_section(data, name):
+    if data[:4] == b'\x7fELF':
+        return elf_section(data, name)
+    if data[:2] in (b'\x4c\x01', b'\x64\x86'):
+        return coff_section(data, name)
+    return None
+
+def read_output(path, t):
+    with open(path, "rb") as f:
+        data = f.read()
+    if 'section' in t:
+        data = obj_section(data, t['section'])
+        if data is None:
+            raise OSError("no section " + t['section'] + " in " + path)
+    return data
+
 def read_stdfile(path):
     return read_ref_file(path).decode("utf-8","replace")
 
@@ -358,7 +413,10 @@ def prepare_run_opts(desc):
             outfile = desc['_base-dir'] + os.sep + t['output']
         if 'option' in t:
             opts += t['option'].split(" ")
-    opts += ['-o', outfile, '-L+', '-l', outfile + '.lst']
+    desc['_outfile'] = outfile
+    opts += ['-o', outfile]
+    if desc.get('listing') != 'false':
+        opts += ['-L+', '-l', outfile + '.lst']
     if 'source' in desc:
         opts += [desc['_base-dir'] + os.sep + desc['source']]
 
@@ -409,8 +467,48 @@ def exec_nasm(desc):
         test_fail(desc['_test-name'],
                   "Unexpected ret code: " + str(wait_rc))
         return None, None, None
+
+    if 'ndisasm' in desc:
+        stdout = exec_ndisasm(desc)
+        if stdout == None:
+            return None, None, None
     return pnasm, stdout, stderr
 
+#
+# Disassemble the output of a test; the output of ndisasm then takes
+# the place of the stdout of nasm
+def exec_ndisasm(desc):
+    ndisasm = args.ndisasm
+    if not ndisasm:
+        ndisasm = os.path.join(os.path.dirname(args.nasm), 'ndisasm')
+    opts = [ndisasm] + desc['ndisasm'].split(" ")
+    outfile = desc['_outfile']
+
+    if desc.get('ndisasm-input') == 'stdin':
+        opts += ['-']
+        print("\tExecuting %s < %s" % (" ".join(opts), outfile))
+        with open(outfile, "rb") as f:
+            pdis = subprocess.run(opts, stdin = f, capture_output = True)
+    else:
+        opts += [outfile]
+        print("\tExecuting %s" % (" ".join(opts)))
+        pdis = subprocess.run(opts, capture_output = True)
+
+    if pdis.returncode != 0:
+        show_std("stderr", pdis.stderr.decode("utf-8","replace"))
+        test_fail(desc['_test-name'],
+                  "Unexpected ndisasm ret code: " + str(pdis.returncode))
+        return None
+    return pdis.stdout.decode("utf-8","replace")
+
+#
+# Apply the filter of a stdout or stderr target, if any
+def filter_std(t, data):
+    if 'filter' in t:
+        f = t['filter']
+        data = re.sub(f['match'], f['subst'], data, 0, re.M)
+    return data
+
 def test_run(desc):
     print("=== Running %s ===" % (desc['_test-name']))
 
@@ -422,11 +520,6 @@ def test_run(desc):
         return False
 
     for t in desc['target']:
-        f = None
-        if 'filter' in t:
-            f = t['filter']
-            f_pat = re.compile(f['match'], re.M)
-            f_sub = f['subst']
 
         if 'output' in t:
             output = desc['_base-dir'] + os.sep + t['output']
@@ -436,8 +529,7 @@ def test_run(desc):
             print("\tComparing %s %s" % (output, match))
             try:
                 match_data = read_ref_file(match)
-                with open(output, "rb") as f:
-                    out_data = f.read()
+                out_data = read_output(output, t)
             except OSError:
                 return test_fail(desc['_test-name'], "Can't read " + match + " or " + output)
             if match_data != out_data:
@@ -450,8 +542,7 @@ def test_run(desc):
             if match_data == None:
                 return test_fail(test, "Can't read " + match)
             out_data = stdout
-            if f:
-                out_data = f_pat.sub(f_sub, out_data, 0)
+            out_data = filter_std(t, out_data)
             if cmp_std(match, match_data, 'stdout', out_data) == False:
                 return test_fail(desc['_test-name'], "stdout mismatch")
             else:
@@ -463,8 +554,7 @@ def test_run(desc):
             if match_data == None:
                 return test_fail(test, "Can't read " + match)
             out_data = stderr
-            if f:
-                out_data = f_pat.sub(f_sub, out_data, 0)
+            out_data = filter_std(t, out_data)
             if cmp_std(match, match_data, 'stderr', out_data) == False:
                 return test_fail(desc['_test-name'], "stderr mismatch")
             else:
@@ -557,18 +647,17 @@ def test_update(desc):
             output = desc['_base-dir'] + os.sep + t['output']
             match = desc['_base-dir'] + os.sep + t['match']
             print("\tMoving %s to %s" % (output, match))
-            with open(output, "rb") as f:
-                data = f.read()
+            data = read_output(output, t)
             os.remove(output)
             write_ref_file(match, data, delta)
         if 'stdout' in t:
             match = desc['_base-dir'] + os.sep + t['stdout']
             print("\tMoving %s to %s" % ('stdout', match))
-            write_ref_file(match, stdout.encode("utf-8"), delta)
+            write_ref_file(match, filter_std(t, stdout).encode("utf-8"), delta)
         if 'stderr' in t:
             match = desc['_base-dir'] + os.sep + t['stderr']
             print("\tMoving %s to %s" % ('stderr', match))
-            write_ref_file(match, stderr.encode("utf-8"), delta)
+            write_ref_file(match, filter_std(t, stderr).encode("utf-8"), delta)
 
     return test_updated(desc['_test-name'])
 
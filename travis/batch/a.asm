@@ -0,0 +1,12 @@
+	bits 16
+	org 0x100
+
+start:	mov dx, msg
+	mov ah, 9
+	int 0x21
+	jmp .done
+	times 200 nop
+.done:	mov ax, 0x4c00
+	int 0x21
+
+msg:	db 'Hello from job a$'
@@ -0,0 +1,18 @@
+%macro fill 1
+  %assign i 0
+  %rep %1
+	dw i * i
+    %assign i i+1
+  %endrep
+%endmacro
+
+	bits 32
+	section .text
+	jmp far_label
+	fill 64
+far_label:
+	lea eax, [ebx+ecx*4+table]
+	ret
+
+	section .data align=16
+table:	dd 1, 2, 3, 4
@@ -0,0 +1,11 @@
+	bits 64
+	default rel
+
+	mov rax, [rel value]
+	vpaddd ymm0, ymm1, [value]
+	jz .skip
+	times 130 db 0x90
+.skip:	ret
+
+	align 8
+value:	dq __?NASM_VERSION_ID?__ - __?NASM_VERSION_ID?__ + 0x123456789abcdef
@@ -0,0 +1,23 @@
+;; Line tables where the end of a section is far from its last row;
+;; the address advance in the end_sequence is a ULEB128
+%ifidn __?OUTPUT_FORMAT?__, elf64
+	bits 64
+%else
+	bits 32
+%endif
+
+	section .text
+start:
+	nop
+	mov eax, 1
+	times 200 nop		; 200 bytes after the last row
+
+	section .text.big exec
+big:
+	xor eax, eax
+	inc eax
+	times 20000 nop		; three-byte ULEB128
+
+	section .text.short exec
+	ret
+	times 100 nop		; still a single byte
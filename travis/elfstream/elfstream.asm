@@ -0,0 +1,18 @@
+;; A section larger than the spill chunk of "%pragma elf stream";
+;; the output must not depend on the pragma
+%ifdef STREAM
+%pragma elf stream
+%endif
+
+	section .data
+start:
+	times 0x440000 dd $-$$
+	dq start, tail
+
+	section .rodata
+	db 'between the chunks'
+
+	section .data
+	times 0x100 dd $-$$
+tail:
+	dq tail
@@ -0,0 +1,27 @@
+;; Integer constant folding, and the same operators on relocatable
+;; and forward-referenced operands
+	bits 32
+	org 0x1000
+
+K	equ 12
+
+start:
+	dd 4*8+2, 7-7, -5+5, 3-10, 0x7fffffff+1
+	dd K|1, K^5, K&4, K<<3, K>>1, -K>>>1
+	dd 100/7, 100 % 7, -100//7, -100 %% 7
+	dd ~K, !K, !0, -~K
+	dd K && 0, K || 0, K ^^ K
+	dd K == 12, K != 12, K < 13, K <= 11, K > 11, K >= 13
+	dd 3 <=> 5, 5 <=> 3, 5 <=> 5
+	dd (K > 10) ? K*2 : K/2
+
+;; Vectors: these must not take the scalar path
+	dd start+4, 4+start, start-start, here-start
+	dd start+K*2-K, (here-start)*2, later-start+1
+	dd here-start < 0x100, later-start <=> 0
+	mov eax, [ebx+K*2-K]
+	mov eax, [ebx*2+K-12]
+	lea ecx, [eax+ebx-0]
+
+here:
+later	equ $+8
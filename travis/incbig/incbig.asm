@@ -0,0 +1,12 @@
+;; Large INCBINs which the output formats keep by reference to the
+;; file mapping.  The input is any large file which never changes.
+;; TIMES INCBIN does not search the include path by itself
+%pathsearch DATA "crc32.h"
+
+	db 1, 2, 3
+	incbin DATA, 0x1235, 0x30000-3	; unaligned, ends on a block boundary
+	times 2 incbin DATA, 0x40001, 0x20000	; one mapping, used twice
+	db 'mid'
+	incbin DATA, 7, 0x20001		; the same file again, not contiguous
+	incbin DATA, 0x55555, 0x1001	; too small to be kept by reference
+	db 'end'
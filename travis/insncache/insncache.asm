@@ -0,0 +1,30 @@
+;; Repeated instructions which can be replayed from the encoding cache
+	bits 64
+
+%rep 4
+	add eax, 1
+	mov rax, 0x123456789
+	vpaddd zmm1{k1}{z}, zmm2, zmm3
+	vaddps zmm4, zmm5, zmm6, {rz-sae}
+	shl ecx, 3
+%endrep
+	times 3 push rbx
+
+;; Branches to absolute addresses depend on the location
+	times 2 jmp 0x10
+	times 2 jz 0x10
+
+;; The cache must not hide warnings or CPU level changes
+[warning -number-overflow]
+	add al, 0x1234
+[warning +number-overflow]
+	add al, 0x1234
+	add al, 0x1234
+
+	bits 32
+	inc eax
+	cpu 386
+	inc eax
+	cpu 186
+	pushf
+	pushf
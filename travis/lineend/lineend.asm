@@ -0,0 +1,14 @@
+;; Mixed line endings, continuation lines and ^Z
+	db 1, 2
+	db 3, \
+	4
+%warning after a CR LF continuation
+	db 5	db 6, \	7%warning after a CR continuation
+	db 8, \
+	9, \
+	10
+%warning after two LF continuations
+	db '\'
+	db 11	db 12
+%warning after ^Z
+	db 13 ; \
\ No newline at end of file
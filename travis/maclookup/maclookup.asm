@@ -0,0 +1,39 @@
+;
+; Macro lookups by identifier token: case-insensitive names, long
+; names kept out of line, and tables emptied by %clear and refilled.
+;
+	bits 32
+
+%idefine Small 1
+%define a_very_long_single_line_macro_name_indeed_yes 2
+%imacro Emit 1
+	db %1
+%endmacro
+%macro a_very_long_multi_line_macro_name_to_look_up_here 0
+	db 3
+%endmacro
+
+	db SMALL, small, a_very_long_single_line_macro_name_indeed_yes
+	EMIT 4
+	emit Small
+	a_very_long_multi_line_macro_name_to_look_up_here
+
+%undef small
+%define small 5
+	db small
+
+%clear define
+%clear macro
+
+%ifdef small
+	db 0xee
+%endif
+
+%define small 6
+%macro emit 1
+	dw %1
+%endmacro
+	emit small
+
+%define tok_%[small] 7
+	db tok_6
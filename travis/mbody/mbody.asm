@@ -0,0 +1,66 @@
+;
+; Multi-line macro and %rep bodies are replayed line by line from a
+; compiled copy of the body; check that parameter substitution,
+; %rotate, locals, %exitrep and %exitmacro still behave.
+;
+	bits 32
+
+%macro rot 1-*
+  %rep %0
+	db %1
+	%rotate 1
+  %endrep
+%endmacro
+
+%macro loc 1
+%%here:	db %1
+	dd %%here
+  %defstr name %?
+	db name
+%endmacro
+
+%macro early 1
+	db 1
+  %if %1
+	%exitmacro
+  %endif
+	db 2
+	db %1
+%endmacro
+
+%macro outer 2
+	inner %1, %2
+	db %0
+%endmacro
+
+%macro inner 2
+	db %2, %1
+%endmacro
+
+	rot 1, 2, 3
+	loc 4
+	loc 5
+	early 0
+	early 1
+	outer 6, 7
+
+%assign i 0
+%rep 10
+	db i
+  %if i == 6
+	%exitrep
+  %endif
+	db 0xff
+  %assign i i+1
+%endrep
+
+%rep 3
+  %rep 2
+	nop
+  %endrep
+	rot 8, 9
+%endrep
+
+%rep 0
+	db 0xee
+%endrep
@@ -0,0 +1,15 @@
+;; Assemble twice with the same macro cache directory; the second run
+;; loads mcdefs.inc from the cache and must produce the same output
+%include "mcdefs.inc"
+
+	section .data
+	dd MC_BASE
+	dd MC_ADD(MC_BASE, 3)
+	dd MC_SCALE(5, 2+1)
+	dd MC_LOWER
+	dd MC_LIST
+	mc_pair 5, MC_ADD(6, 7)
+	mc_fill 1
+	mc_fill 2, 3, 4
+	db %$mcval
+%pop mcctx
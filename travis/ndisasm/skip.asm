@@ -0,0 +1,10 @@
+;; Input for "ndisasm -k": data regions between the instructions
+	bits 32
+
+	mov eax, 1
+	db 'data in the code', 0	; 5,17
+	add eax, ebx
+	ret
+	db 0xff, 0xfe, 0x12, 0x34	; 25,4
+	xor eax, eax
+	ret
@@ -0,0 +1,10 @@
+;; Input for "ndisasm -a": more than 4096 sync points pending at the
+;; same time, and more than one input buffer when read from stdin
+	bits 32
+
+%rep 5000
+	jmp near target
+%endrep
+	times 5000 mov dword [ebx+0x12345678], 0x9abcdef0
+target:
+	ret
@@ -0,0 +1,22 @@
+;
+; Make sure that replaying the preprocessed source of the first pass
+; (--pass-cache) generates the same code as preprocessing every pass.
+;
+	%pragma list options -p
+
+	bits 32
+
+%macro jcc_chain 1
+%assign i 0
+%rep %1
+lbl_%+i:
+	jz lbl_%+%eval((i * 7) % %1)
+	jmp near lbl_%+%eval((i * 3) % %1)
+	times i nop
+%assign i i+1
+%endrep
+%endmacro
+
+start:
+	jcc_chain 64
+	ret
@@ -0,0 +1,20 @@
+;
+; The preprocessor output depends on the value of $ here, so the
+; pass cache must not be used.
+;
+	%pragma list options -p
+
+	bits 32
+
+start:
+	jmp near finish
+%rep 40
+	jz finish
+%endrep
+%if ($ - start) > 100
+	db 'long'
+%else
+	db 'short'
+%endif
+finish:
+	ret
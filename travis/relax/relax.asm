@@ -0,0 +1,28 @@
+;
+; Each conditional jump spans exactly as much code as fits a short
+; jump, and also spans the jump after it.  When the last jump becomes
+; near, the growth ripples back through all of them; branch relaxation
+; should find this without a pass per jump.
+;
+	bits 32
+
+%assign i 0
+%rep 40
+  %if i >= 2
+    %assign k i-2
+t%[k]:	nop
+  %endif
+j%[i]:	jz t%[i]
+	times 62 nop
+  %assign i i+1
+%endrep
+t38:	nop
+	times 200 nop
+t39:	ret
+
+	; A backward jump, and a forward jump over a relaxed one
+back:	jmp j0
+	jmp fwd
+	jnz back
+	times 100 nop
+fwd:	ret
@@ -0,0 +1,17 @@
+;
+; Tokens which come out of the preprocessor separately but are
+; adjacent in the text of the line have to be scanned as a single
+; token by the parser.
+;
+%define f(x) x
+
+	bits 32
+lab1:
+	dd f(lab)f(1)		; lab1
+	dd f(1)f(2)		; 12
+	dd 1 f(<)f(<) 4		; 1 << 4
+	dd 2 f(!)f(=) 3		; 2 != 3
+	dq f(1e)f(+2)		; 1e+2
+	dq f(0x1p)f(-3)		; 0x1p-3
+	dd f($)f($)		; $$
+	dd f(0x)f(10)		; 0x10
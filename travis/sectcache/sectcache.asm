@@ -0,0 +1,32 @@
+;; Repeated section switches which can be served from the section cache
+	bits 64
+
+%rep 3
+	section .text
+	nop
+	section .rodata
+	db 1
+	section .data align=16
+	dq 2
+	[section .text]
+	ret
+%endrep
+
+;; A redeclaration which warns must warn every time
+%rep 2
+	section .rodata write
+	db 3
+%endrep
+
+;; A redeclaration made while the warning is disabled is not cached
+	[warning -other]
+	section .rodata write
+	[warning +other]
+	section .rodata write
+	db 4
+
+;; The same name with a different section bits setting
+	section .text
+	bits 32
+	section .text
+	inc eax
@@ -0,0 +1,42 @@
+;
+; Cached expansions of parameterless single-line macros have to
+; follow changes to any macro they were expanded from.
+;
+%define A B+1
+%define B 10
+	dd A, A			; 11
+%define B 20
+	dd A			; 21
+%define B C
+%define C 5
+	dd A			; 6
+%define C 6
+	dd A			; 7
+%idefine ii A*2
+	dd ii, II		; 6+1*2
+%undef C
+%define C 7
+	dd ii			; 7+1*2
+%define L __?LINE?__
+	dd L
+	dd L
+%assign n 0
+%define N n*2
+%rep 3
+	dd N			; 0, 2, 4
+%assign n n+1
+%endrep
+%define F(x) x+B
+%define G F(1)
+	dd G			; 1+7
+%define B 8
+	dd G			; 1+8
+%push ctx
+%define %$x 3
+%define X %$x
+	dd X			; 3
+%pop
+%push ctx
+%define %$x 4
+	dd X			; 4
+%pop
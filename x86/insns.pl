@@ -410,7 +410,7 @@ while (<F>) {
     @field_list = apx_evex_forms(@field_list);
 
     foreach my $fields (@field_list) {
-        ($formatted, $nd) = format_insn(@$fields);
+        ($formatted, $nd, $filter) = format_insn(@$fields);
         if ($formatted) {
             $insns++;
 	    xpush(\$aname{$fields->[0]}, [$formatted, $fields]);
@@ -419,7 +419,7 @@ while (<F>) {
 	    $k_opcodes{$fields->[0]} = $n_opcodes++;
 	}
         if ($formatted && !$nd) {
-            push(@big, [$formatted, $fields]);
+            push(@big, [$formatted, $fields, $filter]);
             my @sseq = startseq($fields->[2], $fields->[3]);
             foreach my $i (@sseq) {
 		xpush(\$distable[$i->[0]][$i->[1]]{$i->[2]}, $#big);
@@ -520,6 +520,32 @@ if ( $output eq 'a' ) {
 		print A '        ', codesubst($j->[0]), "\n";
 	    }
 	    print A "};\n\n";
+
+	    # Index of the templates by operand count, in template
+	    # order. The first MAX_OPERANDS+2 entries are the offsets
+	    # into this array at which the list for each operand
+	    # count starts.
+	    my @byops = map { [] } (0..$MAX_OPERANDS);
+	    $n = 0;
+	    foreach $j (@$pat) {
+		my($nops) = ($j->[0] =~ /^\{I_\w+, ([0-9]+),/);
+		push(@{$byops[$nops]}, $n++);
+	    }
+	    my $off = $MAX_OPERANDS+2;
+	    my @ofs = ();
+	    foreach my $l (@byops) {
+		push(@ofs, $off);
+		$off += scalar(@$l);
+	    }
+	    push(@ofs, $off);
+	    printf A "static const uint16_t instrux_%s_byops[%d] = {\n",
+		$i, $off;
+	    print A '    ', join(',', @ofs), ",\n";
+	    for (my $o = 0; $o <= $MAX_OPERANDS; $o++) {
+		next unless (scalar(@{$byops[$o]}));
+		printf A "    /* %d */ %s,\n", $o, join(',', @{$byops[$o]});
+	    }
+	    print A "};\n\n";
 	}
     }
     printf A "const struct itemplate_list nasm_instructions[%d] = {\n",
@@ -528,7 +554,8 @@ if ( $output eq 'a' ) {
 	my $pat  = $aname{$i};
 	my $npat = scalar(@$pat);
 	my $tbl  = $npat ? "instrux_$i" : "NULL /* $i */";
-	printf A "    { %3d, %s },\n", $npat, $tbl;
+	my $idx  = $npat ? "instrux_${i}_byops" : "NULL";
+	printf A "    { %3d, %s, %s },\n", $npat, $tbl, $idx;
     }
     print A "};\n";
 
@@ -580,24 +607,24 @@ if ( $output eq 'd' ) {
 		    if (defined($tbl)) {
 			my $name = sprintf("%s_%02x", $tname, $o);
 			push(@itbls, $name);
-			printf D "\nstatic const struct itemplate * const %s[] = {\n", $name;
+			printf D "\nstatic const struct disasm_itemplate %s[] = {\n", $name;
 			foreach my $j (@$tbl) {
-			    print D "    instrux + $j,\n";
+			    printf D "    { instrux + %d, %s },\n", $j, $big[$j]->[2];
 			}
-			print D "    NULL\n};\n";
+			print D "    { NULL, 0, 0 }\n};\n";
 		    } else {
 			push(@itbls, 'NULL');
 		    }
 		}
 
-		printf D "\nstatic const struct itemplate * const * const %s[256] = {\n", $tname;
+		printf D "\nstatic const struct disasm_itemplate * const %s[256] = {\n", $tname;
 		print D map { "    $_,\n" } @itbls;
 		print D "};\n";
 	    }
         }
     }
 
-    print D "\nconst struct itemplate * const * const * const\n";
+    print D "\nconst struct disasm_itemplate * const * const\n";
     print D "ndisasm_itable[] = {\n";
     for (my $c = 0; $c < $vex_classes; $c++) {
 	my $class = $vex_class[$c];
@@ -711,6 +738,7 @@ sub format_insn($$$$) {
     my ($num, $flagsindex);
     my @bytecode;
     my ($op, @ops, @opsize, $opp, @opx, @oppx, @decos, @opevex);
+    my @opkind;
     my $opinfo;
 
     return (undef, undef) if $operands eq 'ignore';
@@ -831,6 +859,8 @@ sub format_insn($$$$) {
 
             $op = join('|',@opx);
             push(@ops, $op);
+	    push(@opkind, ($isrm || ($isreg && $ismem)) ? 'rm' :
+		 ($ismem && !$ismoffs) ? 'mem' : $isreg ? 'reg' : '');
 	    push(@opsize, $opsz);
             push(@decos, (@opevex ? join('|', @opevex) : '0'));
         }
@@ -888,7 +918,110 @@ sub format_insn($$$$) {
     $flagsindex = insns_flag_index(\%flags);
     die "$fname:$line: $opcode: error in flags $flags\n" unless (defined($flagsindex));
 
-    return ("{I_$opcode, $nops, {$operands}, $decorators, \@\@CODES-$codes\@\@, $flagsindex, $line},", $nd);
+    return ("{I_$opcode, $nops, {$operands}, $decorators, \@\@CODES-$codes\@\@, $flagsindex, $line},", $nd,
+	    disasm_filter(\@bytecode, \@opkind, \%flags));
+}
+
+#
+# Compute the quick reject filter used by the disassembler to avoid
+# running matches() on candidates which cannot possibly match; see
+# struct disasm_itemplate in include/insns.h for the bit layout.
+# Only conditions which matches() would check anyway are encoded here,
+# so the filter can never reject a valid decoding.
+#
+sub disasm_filter($$$) {
+    my($bytecode, $opkind, $flags) = @_;
+    my @codes = @$bytecode;
+    my $mask  = 0;
+    my $match = 0;
+    my $pos   = -1;		# Data byte position, undef if unknown
+    my $opex  = 0;
+    my $c;
+
+    # Set a filter condition, unless it contradicts an earlier one
+    my $want = sub($$) {
+	my($m, $v) = @_;
+	$m &= ~$mask | ~($match ^ $v);
+	$mask  |= $m;
+	$match |= $v & $m;
+    };
+    # Account for one data byte, if possibly the one after the opcode
+    my $byte = sub($$) {
+	my($m, $v) = @_;
+	return unless (defined($pos));
+	$want->($m, $v) if (++$pos == 1);
+    };
+
+    while (defined($c = shift(@codes)) && $c) {
+	my $ox = $opex;
+	$opex = 0;
+
+	if ($c >= 01 && $c <= 04) {
+	    $byte->(0xff, shift(@codes)) while ($c--);
+	} elsif ($c >= 05 && $c <= 07) {
+	    $opex = $c;
+	} elsif ($c >= 010 && $c <= 013) {
+	    $byte->(0xf8, shift(@codes));
+	} elsif (($c >= 0100 && $c <= 0137) || ($c >= 0200 && $c <= 0237)) {
+	    my $kind = $opkind->[(($c >> 3) & 3) + (($ox & 2) << 1)];
+	    if ($c >= 0200) {
+		$byte->(070, ($c & 7) << 3);
+	    } else {
+		$byte->(0, 0);
+	    }
+	    if (defined($pos) && $pos == 1) {
+		if ($kind eq 'mem') {
+		    $want->(0x800, 0);
+		} elsif ($kind eq 'reg') {
+		    $want->(0x800, 0x800);
+		}
+	    }
+	    undef $pos;		# Variable length EA
+	} elsif ($c == 0171) {
+	    $byte->(0xc7, shift(@codes));
+	} elsif ($c == 0172 || $c == 0173) {
+	    shift(@codes);
+	    $byte->(0, 0);
+	} elsif (($c >= 0174 && $c <= 0177) || ($c >= 0020 && $c <= 0027) ||
+		 ($c >= 0050 && $c <= 0053) || ($c >= 0274 && $c <= 0277) ||
+		 ($c >= 0300 && $c <= 0303)) {
+	    $byte->(0, 0);
+	} elsif (($c >= 0030 && $c <= 0177) || ($c >= 0254 && $c <= 0257)) {
+	    undef $pos;		# Multibyte or variable immediate
+	} elsif (($c >= 0240 && $c <= 0243) || $c == 0250) {
+	    my @p = splice(@codes, 0, 4);
+	    $want->(0x3000, ($p[1] & 3) << 12);
+	    $want->(0x10000, ($p[1] >> 7) << 16) unless ($flags->{'WIG'});
+	} elsif (($c >= 0260 && $c <= 0263) || $c == 0270) {
+	    my($m, $wlp) = splice(@codes, 0, 2);
+	    $want->(0x3000, ($wlp & 3) << 12);
+	    $want->(0xc000, (($wlp >> 2) & 3) << 14) unless ($flags->{'LIG'});
+	    $want->(0x10000, ($wlp >> 7) << 16) unless ($flags->{'WIG'});
+	} elsif ($c == 0326) {
+	    $want->(0x400, 0);
+	} elsif ($c == 0331) {
+	    $want->(0x600, 0);
+	} elsif ($c == 0332) {
+	    $want->(0x600, 0x200);
+	} elsif ($c == 0333) {
+	    $want->(0x600, 0x400);
+	} elsif ($c == 0360) {
+	    $want->(0x700, 0);
+	} elsif ($c == 0361) {
+	    $want->(0x700, 0x100);
+	} elsif ($c == 0364) {
+	    $want->(0x100, 0);
+	} elsif ($c == 0366) {
+	    $want->(0x100, 0x100);
+	} elsif (!(($c >= 014 && $c <= 017) ||
+		   ($c >= 0271 && $c <= 0273) ||
+		   ($c >= 0310 && $c <= 0377))) {
+	    # Unknown byte code; don't try to be clever
+	    return '0, 0';
+	}
+    }
+
+    return sprintf('0x%05x, 0x%05x', $mask, $match);
 }
 
 #